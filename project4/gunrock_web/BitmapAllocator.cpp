@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <utility>
+
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "BitmapAllocator.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define BITS_PER_WORD (64)
+#define WORDS_PER_BLOCK (UFS_BLOCK_SIZE * 8 / BITS_PER_WORD)
+
+BitmapAllocator::BitmapAllocator(int count) {
+  this->count = count;
+  this->words = (count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  this->nextFit = false;
+  this->cursor = 0;
+  this->forget();
+}
+
+void BitmapAllocator::setNextFit(bool nextFit) {
+  this->nextFit = nextFit;
+  this->cursor = 0;
+}
+
+int BitmapAllocator::allocate(unsigned char *bitmap) {
+  vector<int> indexes;
+  return this->allocateN(bitmap, 1, indexes) == 1 ? indexes[0] : -1;
+}
+
+int BitmapAllocator::allocateN(unsigned char *bitmap, int k, vector<int> &indexes) {
+  // Everything before lowWater is full, next-fit wraps around to it
+  int low = this->hasHints ? this->lowWater : 0;
+  int ranges[2][2] = { { low, this->words }, { low, low } };
+  if (this->nextFit && this->cursor > low) {
+    ranges[0][0] = this->cursor;
+    ranges[1][1] = this->cursor;
+  }
+
+  int found = 0;
+  for (int range = 0; range < 2 && found < k; range++) {
+    int word = ranges[range][0];
+    while (found < k) {
+      int index = this->findFree(bitmap, word, ranges[range][1]);
+      if (index < 0) {
+        break;
+      }
+      bitmap[index / 8] |= 1 << (index % 8);
+      indexes.push_back(index);
+      found++;
+      // The same word may have more free bits
+      word = index / BITS_PER_WORD;
+    }
+  }
+  if (this->nextFit && found > 0) {
+    this->cursor = indexes.back() / BITS_PER_WORD;
+  }
+  return found;
+}
+
+int BitmapAllocator::allocateRun(unsigned char *bitmap, int k, int goal, vector<int> &indexes) {
+  int found = 0;
+  for (int index = goal; index >= 0 && index < this->count && found < k; index++) {
+    if ((bitmap[index / 8] >> (index % 8)) & 1) {
+      break;
+    }
+    bitmap[index / 8] |= 1 << (index % 8);
+    indexes.push_back(index);
+    found++;
+  }
+  if (found == k) {
+    return found;
+  }
+
+  vector<pair<int, int> > runs;
+  this->freeRuns(bitmap, runs);
+  int need = k - found;
+  int best = -1;
+  for (size_t idx = 0; idx < runs.size(); idx++) {
+    if (runs[idx].second >= need && (best < 0 || runs[idx].second < runs[best].second)) {
+      best = idx;
+    }
+  }
+
+  vector<pair<int, int> > chosen;
+  if (best >= 0) {
+    chosen.push_back(make_pair(runs[best].first, need));
+  } else {
+    // Longest first, keeping bit order between runs of the same length
+    stable_sort(runs.begin(), runs.end(), longerRun);
+    for (size_t idx = 0; idx < runs.size() && need > 0; idx++) {
+      chosen.push_back(make_pair(runs[idx].first, min(need, runs[idx].second)));
+      need -= chosen.back().second;
+    }
+    sort(chosen.begin(), chosen.end());
+  }
+
+  for (size_t idx = 0; idx < chosen.size(); idx++) {
+    for (int index = chosen[idx].first; index < chosen[idx].first + chosen[idx].second; index++) {
+      bitmap[index / 8] |= 1 << (index % 8);
+      indexes.push_back(index);
+      found++;
+    }
+  }
+  return found;
+}
+
+int BitmapAllocator::allocateNear(unsigned char *bitmap, int goal) {
+  int low = this->hasHints ? this->lowWater : 0;
+  int start = max(low, min(goal, this->count - 1) / BITS_PER_WORD);
+  int index = this->findFree(bitmap, start, this->words);
+  if (index < 0) {
+    index = this->findFree(bitmap, low, start);
+  }
+  if (index >= 0) {
+    bitmap[index / 8] |= 1 << (index % 8);
+  }
+  return index;
+}
+
+void BitmapAllocator::freeRuns(const unsigned char *bitmap, vector<pair<int, int> > &runs) {
+  int runStart = -1;
+  for (int word = 0; word < this->words; word++) {
+    if (this->hasHints && runStart < 0 && word % WORDS_PER_BLOCK == 0 && this->blockFull(word / WORDS_PER_BLOCK)) {
+      word += WORDS_PER_BLOCK - 1;
+      continue;
+    }
+    uint64_t freeBits = ~this->loadWord(bitmap, word);
+    // Find each edge between free and used bits with ctz
+    int bit = 0;
+    while (bit < BITS_PER_WORD) {
+      uint64_t rest = (runStart < 0 ? freeBits : ~freeBits) >> bit;
+      if (rest == 0) {
+        break;
+      }
+      bit += __builtin_ctzll(rest);
+      if (runStart < 0) {
+        runStart = word * BITS_PER_WORD + bit;
+      } else {
+        runs.push_back(make_pair(runStart, word * BITS_PER_WORD + bit - runStart));
+        runStart = -1;
+      }
+    }
+  }
+  if (runStart >= 0) {
+    runs.push_back(make_pair(runStart, this->count - runStart));
+  }
+}
+
+void BitmapAllocator::reset(const unsigned char *bitmap) {
+  this->hasHints = true;
+  this->blockFree.assign((this->words + WORDS_PER_BLOCK - 1) / WORDS_PER_BLOCK, 0);
+  this->blockReleased.assign(this->blockFree.size(), 0);
+  this->totalFree = 0;
+  for (int word = 0; word < this->words; word++) {
+    int free = BITS_PER_WORD - __builtin_popcountll(this->loadWord(bitmap, word));
+    this->blockFree[word / WORDS_PER_BLOCK] += free;
+    this->totalFree += free;
+  }
+  this->lowWater = 0;
+  this->advanceLowWater(bitmap);
+}
+
+void BitmapAllocator::update(const unsigned char *before, const unsigned char *after) {
+  if (!this->hasHints) {
+    return;
+  }
+  for (int word = 0; word < this->words; word++) {
+    uint64_t oldValue = this->loadWord(before, word);
+    uint64_t newValue = this->loadWord(after, word);
+    if (oldValue == newValue) {
+      continue;
+    }
+    int delta = __builtin_popcountll(oldValue) - __builtin_popcountll(newValue);
+    this->blockFree[word / WORDS_PER_BLOCK] += delta;
+    this->totalFree += delta;
+    if (newValue != ~0ULL && word < this->lowWater) {
+      this->lowWater = word;
+    }
+  }
+  // after includes whatever was released
+  this->blockReleased.assign(this->blockFree.size(), 0);
+  this->advanceLowWater(after);
+}
+
+void BitmapAllocator::forget() {
+  this->hasHints = false;
+  this->lowWater = 0;
+  this->blockFree.clear();
+  this->blockReleased.clear();
+  this->totalFree = -1;
+}
+
+void BitmapAllocator::release(int index) {
+  if (!this->hasHints) {
+    return;
+  }
+  int word = index / BITS_PER_WORD;
+  this->blockReleased[word / WORDS_PER_BLOCK]++;
+  this->lowWater = min(this->lowWater, word);
+}
+
+int BitmapAllocator::freeCount() {
+  return this->hasHints ? this->totalFree : -1;
+}
+
+int BitmapAllocator::countFree(const unsigned char *bitmap, int count) {
+  BitmapAllocator allocator(count);
+  allocator.reset(bitmap);
+  return allocator.freeCount();
+}
+
+bool BitmapAllocator::longerRun(const pair<int, int> &first, const pair<int, int> &second) {
+  return first.second > second.second;
+}
+
+// Bits past the end of the bitmap read as set, and so do the bytes past
+// the end of the caller's buffer
+uint64_t BitmapAllocator::loadWord(const unsigned char *bitmap, int word) {
+  int bytes = (this->count + 7) / 8;
+  int offset = word * sizeof(uint64_t);
+  uint64_t value = ~0ULL;
+  memcpy(&value, bitmap + offset, min((int) sizeof(uint64_t), bytes - offset));
+  int valid = this->count - word * BITS_PER_WORD;
+  if (valid < BITS_PER_WORD) {
+    value |= ~0ULL << valid;
+  }
+  return value;
+}
+
+// Index of the first free bit in words [startWord, endWord), -1 if none
+int BitmapAllocator::findFree(const unsigned char *bitmap, int startWord, int endWord) {
+  int word = startWord;
+  while (word < endWord) {
+    int block = word / WORDS_PER_BLOCK;
+    int blockEnd = min(endWord, (block + 1) * WORDS_PER_BLOCK);
+    if (this->hasHints && this->blockFull(block)) {
+      word = blockEnd;
+      continue;
+    }
+
+#ifdef __AVX2__
+    // Skip runs of full words four at a time
+    const __m256i full = _mm256_set1_epi8(-1);
+    while (word + 4 <= blockEnd && (word + 4) * BITS_PER_WORD <= this->count) {
+      __m256i value = _mm256_loadu_si256((const __m256i *) (bitmap + word * sizeof(uint64_t)));
+      if (!_mm256_testc_si256(value, full)) {
+        break;
+      }
+      word += 4;
+    }
+#endif
+
+    for (; word < blockEnd; word++) {
+      uint64_t value = this->loadWord(bitmap, word);
+      if (value != ~0ULL) {
+        return word * BITS_PER_WORD + __builtin_ctzll(~value);
+      }
+    }
+  }
+  return -1;
+}
+
+void BitmapAllocator::advanceLowWater(const unsigned char *bitmap) {
+  while (this->lowWater < this->words) {
+    int block = this->lowWater / WORDS_PER_BLOCK;
+    if (this->blockFull(block)) {
+      this->lowWater = (block + 1) * WORDS_PER_BLOCK;
+    } else if (this->loadWord(bitmap, this->lowWater) == ~0ULL) {
+      this->lowWater++;
+    } else {
+      break;
+    }
+  }
+  this->lowWater = min(this->lowWater, this->words);
+}
+
+bool BitmapAllocator::blockFull(int block) {
+  return this->blockFree[block] == 0 && this->blockReleased[block] == 0;
+}
@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "BlockHashCache.h"
+#include "ufs.h"
+
+using namespace std;
+
+BlockHashCache::BlockHashCache(size_t maxEntries) {
+  this->maxEntries = maxEntries;
+  pthread_mutex_init(&this->lock, NULL);
+}
+
+BlockHashCache::~BlockHashCache() {
+  pthread_mutex_destroy(&this->lock);
+}
+
+bool BlockHashCache::lookup(int blockNumber, uint64_t *hash) {
+  pthread_mutex_lock(&this->lock);
+  unordered_map<int, uint64_t>::iterator iter = this->hashes.find(blockNumber);
+  bool found = iter != this->hashes.end();
+  if (found) {
+    *hash = iter->second;
+  }
+  pthread_mutex_unlock(&this->lock);
+  return found;
+}
+
+void BlockHashCache::insert(int blockNumber, uint64_t hash) {
+  pthread_mutex_lock(&this->lock);
+  if (this->hashes.size() >= this->maxEntries && this->hashes.find(blockNumber) == this->hashes.end()) {
+    // Any hash is as good as another to lose, drop a quarter of them
+    unordered_map<int, uint64_t>::iterator iter = this->hashes.begin();
+    while (iter != this->hashes.end() && this->hashes.size() > this->maxEntries * 3 / 4) {
+      iter = this->hashes.erase(iter);
+    }
+  }
+  if (this->maxEntries > 0) {
+    this->hashes[blockNumber] = hash;
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void BlockHashCache::forget(const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->lock);
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    this->hashes.erase(blockNumbers[idx]);
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void BlockHashCache::clear() {
+  pthread_mutex_lock(&this->lock);
+  this->hashes.clear();
+  pthread_mutex_unlock(&this->lock);
+}
+
+// FNV-1a over 64-bit words. Multiplying only carries bits upwards, so
+// each step also folds the high half back down.
+uint64_t BlockHashCache::hash(const void *block) {
+  const unsigned char *bytes = (const unsigned char *) block;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int offset = 0; offset < UFS_BLOCK_SIZE; offset += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + offset, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 32;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
@@ -0,0 +1,211 @@
+#include <string.h>
+
+#include "DirectoryCache.h"
+
+using namespace std;
+
+// Rough per-entry cost of the hash node, list node and name
+#define DIRECTORY_CACHE_ENTRY_OVERHEAD (128)
+
+DirectoryCache::DirectoryCache(size_t budgetBytes) {
+  this->budgetBytes = budgetBytes;
+  pthread_mutex_init(&this->lock, NULL);
+  this->generation = 0;
+  memset(&this->counters, 0, sizeof(this->counters));
+}
+
+DirectoryCache::~DirectoryCache() {
+  pthread_mutex_destroy(&this->lock);
+}
+
+bool DirectoryCache::lookup(int parentInodeNumber, const string &name, int *inodeNumber) {
+  pthread_mutex_lock(&this->lock);
+  Key key = { parentInodeNumber, name };
+  unordered_map<Key, Entry, KeyHash>::iterator iter = this->entries.find(key);
+  if (iter != this->entries.end()) {
+    this->lru.splice(this->lru.begin(), this->lru, iter->second.position);
+    *inodeNumber = iter->second.inodeNumber;
+    if (*inodeNumber >= 0) {
+      this->counters.hits++;
+    } else {
+      this->counters.negativeHits++;
+    }
+    pthread_mutex_unlock(&this->lock);
+    return true;
+  }
+
+  if (this->complete.count(parentInodeNumber) > 0) {
+    *inodeNumber = -1;
+    this->counters.negativeHits++;
+    pthread_mutex_unlock(&this->lock);
+    return true;
+  }
+
+  this->counters.misses++;
+  pthread_mutex_unlock(&this->lock);
+  return false;
+}
+
+void DirectoryCache::fill(int parentInodeNumber, const vector<dir_ent_t> &entries) {
+  vector<string> names;
+  size_t bytes = 0;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    if (entries[idx].inum != -1) {
+      names.push_back(string(entries[idx].name, strnlen(entries[idx].name, DIR_ENT_NAME_SIZE)));
+      bytes += DirectoryCache::cost(names.back());
+    }
+  }
+  // A directory that would push out most of the cache is looked up one
+  // name at a time instead
+  if (bytes > this->budgetBytes / 2) {
+    return;
+  }
+
+  pthread_mutex_lock(&this->lock);
+  unsigned long evictions = this->counters.evictions;
+  size_t name = 0;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    if (entries[idx].inum != -1) {
+      this->insertLocked(parentInodeNumber, names[name++], entries[idx].inum);
+    }
+  }
+  // Only complete if nothing was pushed out while adding it
+  if (evictions == this->counters.evictions) {
+    this->complete.insert(parentInodeNumber);
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DirectoryCache::insert(int parentInodeNumber, const string &name, int inodeNumber) {
+  pthread_mutex_lock(&this->lock);
+  this->insertLocked(parentInodeNumber, name, inodeNumber);
+  pthread_mutex_unlock(&this->lock);
+}
+
+bool DirectoryCache::list(int parentInodeNumber, const string &after, const string &prefix,
+                          int maxEntries, vector<dir_ent_t> &entries) {
+  pthread_mutex_lock(&this->lock);
+  if (this->complete.count(parentInodeNumber) == 0) {
+    pthread_mutex_unlock(&this->lock);
+    return false;
+  }
+
+  map<int, set<string> >::iterator names = this->namesByDirectory.find(parentInodeNumber);
+  if (names != this->namesByDirectory.end()) {
+    set<string>::iterator name = after < prefix ? names->second.lower_bound(prefix)
+                                                : names->second.upper_bound(after);
+    for (; name != names->second.end() && (int) entries.size() < maxEntries; name++) {
+      if (name->compare(0, prefix.length(), prefix) != 0) {
+        break;
+      }
+      Key key = { parentInodeNumber, *name };
+      int inodeNumber = this->entries[key].inodeNumber;
+      // Unlinked names stay as negative entries
+      if (inodeNumber < 0) {
+        continue;
+      }
+      dir_ent_t entry;
+      memset(&entry, 0, sizeof(entry));
+      strncpy(entry.name, name->c_str(), DIR_ENT_NAME_SIZE - 1);
+      entry.inum = inodeNumber;
+      entries.push_back(entry);
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return true;
+}
+
+void DirectoryCache::invalidateDirectory(int inodeNumber) {
+  pthread_mutex_lock(&this->lock);
+  map<int, set<string> >::iterator iter = this->namesByDirectory.find(inodeNumber);
+  if (iter != this->namesByDirectory.end()) {
+    set<string> names = iter->second;
+    for (set<string>::iterator name = names.begin(); name != names.end(); name++) {
+      Key key = { inodeNumber, *name };
+      this->erase(key);
+    }
+  }
+  this->complete.erase(inodeNumber);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DirectoryCache::clear() {
+  pthread_mutex_lock(&this->lock);
+  this->entries.clear();
+  this->lru.clear();
+  this->namesByDirectory.clear();
+  this->complete.clear();
+  this->counters.entries = 0;
+  this->counters.bytes = 0;
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DirectoryCache::checkGeneration(uint64_t generation) {
+  pthread_mutex_lock(&this->lock);
+  bool stale = generation != this->generation;
+  this->generation = generation;
+  pthread_mutex_unlock(&this->lock);
+  if (stale) {
+    this->clear();
+  }
+}
+
+DirectoryCacheStats DirectoryCache::stats() {
+  pthread_mutex_lock(&this->lock);
+  DirectoryCacheStats result = this->counters;
+  pthread_mutex_unlock(&this->lock);
+  return result;
+}
+
+// Called with lock held
+void DirectoryCache::insertLocked(int parentInodeNumber, const string &name, int inodeNumber) {
+  Key key = { parentInodeNumber, name };
+  unordered_map<Key, Entry, KeyHash>::iterator iter = this->entries.find(key);
+  if (iter != this->entries.end()) {
+    iter->second.inodeNumber = inodeNumber;
+    this->lru.splice(this->lru.begin(), this->lru, iter->second.position);
+    return;
+  }
+
+  this->lru.push_front(key);
+  Entry entry = { inodeNumber, this->lru.begin() };
+  this->entries[key] = entry;
+  this->namesByDirectory[parentInodeNumber].insert(name);
+  this->counters.entries++;
+  this->counters.bytes += DirectoryCache::cost(name);
+  while (this->counters.bytes > this->budgetBytes && this->lru.size() > 1) {
+    this->evict();
+  }
+}
+
+// Called with lock held
+void DirectoryCache::erase(const Key &key) {
+  unordered_map<Key, Entry, KeyHash>::iterator iter = this->entries.find(key);
+  if (iter == this->entries.end()) {
+    return;
+  }
+  this->lru.erase(iter->second.position);
+  this->entries.erase(iter);
+
+  map<int, set<string> >::iterator names = this->namesByDirectory.find(key.parentInodeNumber);
+  names->second.erase(key.name);
+  if (names->second.empty()) {
+    this->namesByDirectory.erase(names);
+  }
+  this->counters.entries--;
+  this->counters.bytes -= DirectoryCache::cost(key.name);
+}
+
+// Called with lock held
+void DirectoryCache::evict() {
+  Key key = this->lru.back();
+  if (this->entries[key].inodeNumber >= 0) {
+    this->complete.erase(key.parentInodeNumber);
+  }
+  this->erase(key);
+  this->counters.evictions++;
+}
+
+size_t DirectoryCache::cost(const string &name) {
+  return DIRECTORY_CACHE_ENTRY_OVERHEAD + name.length();
+}
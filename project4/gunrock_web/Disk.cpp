@@ -1,8 +1,11 @@
 #include <iostream>
+#include <algorithm>
 #include <unistd.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -10,30 +13,55 @@
 #include <sys/mman.h>
 
 #include "Disk.h"
+#include "IoUring.h"
+#include "LatencyModel.h"
+#include "Snapshot.h"
 #include "dthread.h"
 
 using namespace std;
 
+// Submission queue depth and number of registered block buffers
+#define DISK_RING_ENTRIES (64)
+#define DISK_BUFFER_POOL_BLOCKS (64)
+// Most blocks the readahead cache holds, taken from the buffer pool
+#define DISK_READAHEAD_BLOCKS (32)
+
 Disk::Disk(string imageFile, int blockSize) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
-  this->isInTransaction = false;
+  pthread_mutex_init(&this->txnLock, NULL);
+  pthread_cond_init(&this->txnReleased, NULL);
+  pthread_mutex_init(&this->mergeLock, NULL);
+  pthread_mutex_init(&this->discardLock, NULL);
+  this->nextTxnId = 1;
+  this->undoCount = 0;
   
   struct stat stat;
-  int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
-  if (imageFileDescriptor < 0) {
+  this->fd = open(imageFile.c_str(), O_RDWR);
+  this->canPunchHoles = this->fd >= 0;
+  if (this->fd < 0) {
+    this->fd = open(imageFile.c_str(), O_RDONLY);
+  }
+  if (this->fd < 0) {
     cerr << "could not open " << imageFile << endl;
     exit(1);
   }
-  int ret = fstat(imageFileDescriptor, &stat);
+  int ret = fstat(this->fd, &stat);
   if (ret != 0) {
     cerr << "Could not stat image file" << endl;
     exit(1);
   }
-  close(imageFileDescriptor);
   
   this->imageFileSize = stat.st_size;
 
+  // A delta file from ds3snap stands in for its base image
+  this->snapshot = NULL;
+  if (Snapshot::isSnapshot(this->fd)) {
+    this->snapshot = new Snapshot(imageFile, this->fd);
+    this->imageFileSize = this->snapshot->numberOfBlocks() * this->blockSize;
+    this->canPunchHoles = false;
+  }
+
   if ((this->imageFileSize % this->blockSize) != 0 || this->blockSize == 0) {
     cerr << "Your disk image size must be a multiple of your block size" << endl;
     cerr << "  imageSize: " << this->imageFileSize << endl;
@@ -41,7 +69,51 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
     exit(1);
   }
-  
+
+  this->inFlight = 0;
+  pthread_mutex_init(&this->ringLock, NULL);
+  // Snapshots split runs between two files, so they always take the
+  // synchronous path
+  this->ring = this->snapshot == NULL ? new IoUring(DISK_RING_ENTRIES) : NULL;
+  if (this->ring != NULL && !this->ring->isAvailable()) {
+    delete this->ring;
+    this->ring = NULL;
+  }
+
+  size_t poolSize = (size_t) DISK_BUFFER_POOL_BLOCKS * this->blockSize;
+  if (posix_memalign((void **) &this->bufferPool, 4096, poolSize) != 0) {
+    cerr << "Could not allocate disk buffer pool" << endl;
+    exit(1);
+  }
+  for (int idx = DISK_BUFFER_POOL_BLOCKS - 1; idx >= 0; idx--) {
+    this->freeBuffers.push_back(this->bufferPool + (size_t) idx * this->blockSize);
+  }
+  this->bufferPoolRegistered = this->ring != NULL && this->ring->registerBuffer(this->bufferPool, poolSize);
+
+  this->readahead = new Readahead(this, this->blockSize, DISK_READAHEAD_BLOCKS);
+
+  this->diskStats = new DiskStats();
+  char *traceFile = getenv("DS3_TRACE");
+  if (traceFile != NULL && !this->diskStats->openTrace(traceFile)) {
+    cerr << "Could not open trace file " << traceFile << endl;
+    exit(1);
+  }
+
+  this->latencyModel = NULL;
+}
+
+Disk::~Disk() {
+  delete this->readahead;
+  delete this->diskStats;
+  delete this->ring;
+  free(this->bufferPool);
+  pthread_mutex_destroy(&this->ringLock);
+  pthread_mutex_destroy(&this->txnLock);
+  pthread_cond_destroy(&this->txnReleased);
+  pthread_mutex_destroy(&this->mergeLock);
+  pthread_mutex_destroy(&this->discardLock);
+  delete this->snapshot;
+  close(this->fd);
 }
 
 int Disk::numberOfBlocks() {
@@ -49,94 +121,755 @@ int Disk::numberOfBlocks() {
 }
 
 void Disk::readBlock(int blockNumber, void *buffer) {
-  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
-    cerr << "Invalid block number " << blockNumber << endl;
-    exit(1);
+  this->readBlocks(blockNumber, 1, buffer);
+}
+
+void Disk::writeBlock(int blockNumber, void *buffer) {
+  this->writeBlocks(blockNumber, 1, buffer);
+}
+
+void Disk::readBlocks(int startBlock, int count, void *buffer) {
+  vector<int> blockNumbers;
+  vector<struct iovec> iovecs(count);
+  for (int idx = 0; idx < count; idx++) {
+    blockNumbers.push_back(startBlock + idx);
+    iovecs[idx].iov_base = (unsigned char *)buffer + idx * this->blockSize;
+    iovecs[idx].iov_len = this->blockSize;
   }
+  this->readBlocksV(blockNumbers, iovecs.data());
+}
 
-  int fd = open(this->imageFile.c_str(), O_RDONLY);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+void Disk::writeBlocks(int startBlock, int count, void *buffer) {
+  vector<int> blockNumbers;
+  vector<struct iovec> iovecs(count);
+  for (int idx = 0; idx < count; idx++) {
+    blockNumbers.push_back(startBlock + idx);
+    iovecs[idx].iov_base = (unsigned char *)buffer + idx * this->blockSize;
+    iovecs[idx].iov_len = this->blockSize;
   }
+  this->writeBlocksV(blockNumbers, iovecs.data());
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("read::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+void Disk::readBlocksV(const vector<int> &blockNumbers, struct iovec *iovecs) {
+  this->checkBlockNumbers(blockNumbers);
+  Transaction *txn = this->currentTransaction();
+  this->waitForBlocks(txn, blockNumbers, false);
+
+  // Serve what we can from readahead and read the rest from the image
+  vector<int> missBlockNumbers;
+  vector<struct iovec> missIovecs;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (!this->readahead->lookup(blockNumbers[idx], iovecs[idx].iov_base)) {
+      missBlockNumbers.push_back(blockNumbers[idx]);
+      missIovecs.push_back(iovecs[idx]);
+    }
   }
+  this->complete(this->submitBlocksV(DISK_OP_READ, missBlockNumbers, missIovecs.data(), true));
 
-  ret = read(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not read file" << endl;
-    exit(1);
+  // Remember what this transaction saw of the mergeable blocks, its
+  // writes to them are merged relative to these images
+  if (txn != NULL && !txn->aborted) {
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      if (this->isMergeable(blockNumbers[idx])) {
+        unsigned char *data = (unsigned char *) iovecs[idx].iov_base;
+        txn->readImages[blockNumbers[idx]].assign(data, data + this->blockSize);
+      }
+    }
   }
 
-  close(fd);
+  size_t runStart = 0;
+  for (size_t idx = 1; idx <= blockNumbers.size(); idx++) {
+    if (idx == blockNumbers.size() || blockNumbers[idx] != blockNumbers[idx - 1] + 1) {
+      this->readahead->access(blockNumbers[runStart], idx - runStart);
+      runStart = idx;
+    }
+  }
 }
 
-void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
-    cerr << "Invalid block number " << blockNumber << endl;
-    exit(1);
+void Disk::writeBlocksV(const vector<int> &blockNumbers, struct iovec *iovecs) {
+  this->complete(this->submitWrite(blockNumbers, iovecs, true));
+}
+
+DiskBatch *Disk::submitReadBlocksV(const vector<int> &blockNumbers, struct iovec *iovecs) {
+  return this->submitBlocksV(DISK_OP_READ, blockNumbers, iovecs, false);
+}
+
+DiskBatch *Disk::submitWriteBlocksV(const vector<int> &blockNumbers, struct iovec *iovecs) {
+  return this->submitWrite(blockNumbers, iovecs, false);
+}
+
+// Apply transaction rules to a write, then submit what is left of it
+DiskBatch *Disk::submitWrite(const vector<int> &blockNumbers, struct iovec *iovecs, bool wait) {
+  this->checkBlockNumbers(blockNumbers);
+  vector<int> noBlocks;
+
+  // Writes after an abort are dropped, commit() reports the failure
+  Transaction *txn = this->currentTransaction();
+  if (txn != NULL && txn->aborted) {
+    return this->submitBlocksV(DISK_OP_WRITE, noBlocks, iovecs, wait);
   }
 
-  if (isInTransaction) {
-    struct UndoRecord undoRecord;
-    undoRecord.blockNumber = blockNumber;
-    undoRecord.blockData = new unsigned char[blockSize];
-    this->readBlock(blockNumber, undoRecord.blockData);
-    undoLog.push_front(undoRecord);
+  // Mergeable blocks are merged one at a time, the rest go out as a batch
+  vector<int> ordinaryBlockNumbers;
+  vector<struct iovec> ordinaryIovecs;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (this->isMergeable(blockNumbers[idx])) {
+      this->writeMergeable(txn, blockNumbers[idx], iovecs[idx].iov_base);
+      if (txn != NULL && txn->aborted) {
+        return this->submitBlocksV(DISK_OP_WRITE, noBlocks, iovecs, wait);
+      }
+    } else {
+      ordinaryBlockNumbers.push_back(blockNumbers[idx]);
+      ordinaryIovecs.push_back(iovecs[idx]);
+    }
   }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+  if (ordinaryBlockNumbers.size() == blockNumbers.size()) {
+    ordinaryIovecs.assign(iovecs, iovecs + blockNumbers.size());
+  }
+
+  if (!this->waitForBlocks(txn, ordinaryBlockNumbers, true)) {
+    return this->submitBlocksV(DISK_OP_WRITE, noBlocks, iovecs, wait);
+  }
+  this->cancelDiscards(ordinaryBlockNumbers);
+  if (txn != NULL) {
+    this->saveUndoImages(txn, ordinaryBlockNumbers);
+  }
+  return this->submitBlocksV(DISK_OP_WRITE, ordinaryBlockNumbers,
+                             ordinaryBlockNumbers.size() == blockNumbers.size() ? iovecs : ordinaryIovecs.data(),
+                             wait);
+}
+
+bool Disk::isAsync() {
+  return this->ring != NULL;
+}
+
+// op is DISK_OP_READ, DISK_OP_WRITE or DISK_OP_UNDO, which reads blocks
+// to save them in the undo log
+DiskBatch *Disk::submitBlocksV(int op, const vector<int> &blockNumbers, struct iovec *iovecs, bool wait) {
+  this->checkBlockNumbers(blockNumbers);
+  bool isWrite = op == DISK_OP_WRITE;
+
+  DiskBatch *batch = new DiskBatch();
+  batch->isWrite = isWrite;
+  batch->pending = 0;
+  batch->isSync = wait;
+  batch->submitTime = DiskStats::now();
+  if (blockNumbers.empty()) {
+    return batch;
+  }
+
+  if (isWrite) {
+    this->readahead->beginWrite(blockNumbers);
+    batch->writeBlocks = blockNumbers;
+  }
+
+  Transaction *txn = this->currentTransaction();
+  uint64_t txnId = txn != NULL ? txn->id : 0;
+  this->diskStats->record(op, blockNumbers, txnId);
+  if (isWrite) {
+    this->diskStats->record(DISK_OP_FSYNC, blockNumbers, txnId);
+  }
+  if (this->latencyModel != NULL) {
+    this->latencyModel->access(isWrite ? DISK_OP_WRITE : DISK_OP_READ, blockNumbers);
+    if (isWrite) {
+      this->latencyModel->access(DISK_OP_FSYNC, blockNumbers);
+    }
+  }
+
+  if (this->ring == NULL) {
+    if (this->snapshot != NULL) {
+      this->snapshot->transferBlocksV(isWrite, blockNumbers, iovecs);
+    } else {
+      this->transferBlocksV(this->fd, isWrite, blockNumbers, iovecs);
+    }
+    uint64_t transferred = DiskStats::now();
+    this->diskStats->recordLatency(isWrite ? DISK_OP_WRITE : DISK_OP_READ, transferred - batch->submitTime);
+    if (isWrite) {
+      if (this->snapshot != NULL) {
+        this->snapshot->sync();
+      } else {
+        fsync(this->fd);
+      }
+      this->diskStats->recordLatency(DISK_OP_FSYNC, DiskStats::now() - transferred);
+    }
+    return batch;
+  }
+
+  // Split into runs of adjacent blocks, one submission queue entry each.
+  // The requests vector is sized up front because the kernel hands back
+  // pointers into it.
+  vector<size_t> runStarts;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (idx == 0 || blockNumbers[idx] != blockNumbers[idx - 1] + 1 ||
+        idx - runStarts.back() >= IOV_MAX) {
+      runStarts.push_back(idx);
+    }
+  }
+  batch->requests.resize(runStarts.size() + (isWrite ? 1 : 0));
+
+  pthread_mutex_lock(&this->ringLock);
+  for (size_t run = 0; run < runStarts.size(); run++) {
+    size_t runStart = runStarts[run];
+    size_t runEnd = run + 1 < runStarts.size() ? runStarts[run + 1] : blockNumbers.size();
+    int iovcnt = runEnd - runStart;
+
+    struct DiskRequest *request = &batch->requests[run];
+    request->batch = batch;
+    request->expectedBytes = (ssize_t) iovcnt * this->blockSize;
+    request->op = isWrite ? DISK_OP_WRITE : DISK_OP_READ;
+
+    struct io_uring_sqe *sqe = this->getSqe();
+    sqe->fd = this->fd;
+    sqe->off = (off_t) blockNumbers[runStart] * this->blockSize;
+    sqe->user_data = (unsigned long long) request;
+    if (iovcnt == 1 && this->bufferPoolRegistered && this->isPoolBuffer(iovecs[runStart].iov_base)) {
+      sqe->opcode = isWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->addr = (unsigned long long) iovecs[runStart].iov_base;
+      sqe->len = this->blockSize;
+      sqe->buf_index = 0;
+    } else {
+      sqe->opcode = isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->addr = (unsigned long long) (iovecs + runStart);
+      sqe->len = iovcnt;
+    }
+    batch->pending++;
+    this->inFlight++;
+  }
+
+  if (isWrite) {
+    // Drain orders the fsync after every write submitted before it
+    struct DiskRequest *request = &batch->requests.back();
+    request->batch = batch;
+    request->expectedBytes = 0;
+    request->op = DISK_OP_FSYNC;
+
+    struct io_uring_sqe *sqe = this->getSqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = this->fd;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = (unsigned long long) request;
+    batch->pending++;
+    this->inFlight++;
+  }
+
+  this->reapCompletions(wait ? batch->pending : 0);
+  pthread_mutex_unlock(&this->ringLock);
+  return batch;
+}
+
+void Disk::complete(DiskBatch *batch) {
+  if (this->ring != NULL) {
+    pthread_mutex_lock(&this->ringLock);
+    while (batch->pending > 0) {
+      this->reapCompletions(1);
+    }
+    pthread_mutex_unlock(&this->ringLock);
+  }
+  if (batch->isWrite) {
+    this->readahead->endWrite(batch->writeBlocks);
   }
+  delete batch;
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("write::lseek");
-    cerr << "Could not seek to file" << endl;
+// Get a submission queue entry, making room by submitting or reaping when
+// the submission queue is full or the completion queue could overflow.
+// Called with ringLock held.
+struct io_uring_sqe *Disk::getSqe() {
+  while (this->inFlight >= this->ring->cqEntries()) {
+    this->reapCompletions(1);
+  }
+  struct io_uring_sqe *sqe = this->ring->getSqe();
+  if (sqe == NULL) {
+    this->reapCompletions(0);
+    sqe = this->ring->getSqe();
+  }
+  if (sqe == NULL) {
+    cerr << "Could not queue disk I/O" << endl;
     exit(1);
   }
+  return sqe;
+}
 
-  ret = write(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not write file" << endl;
+// Submit anything queued, wait for waitNr completions and account for
+// every completion that is ready. Called with ringLock held.
+void Disk::reapCompletions(unsigned waitNr) {
+  int ret = this->ring->submitAndWait(waitNr);
+  if (ret < 0 && errno != EAGAIN && errno != EBUSY) {
+    perror("io_uring_enter");
+    cerr << "Could not submit disk I/O" << endl;
     exit(1);
   }
-  fsync(fd);
-  close(fd);
+
+  struct io_uring_cqe cqe;
+  while (this->ring->peekCqe(&cqe)) {
+    struct DiskRequest *request = (struct DiskRequest *) cqe.user_data;
+    if (cqe.res != request->expectedBytes) {
+      if (cqe.res < 0) {
+        errno = -cqe.res;
+        perror(request->batch->isWrite ? "write::io_uring" : "read::io_uring");
+      }
+      cerr << (request->batch->isWrite ? "Could not write file" : "Could not read file") << endl;
+      exit(1);
+    }
+    if (request->batch->isSync) {
+      // Asynchronous batches may be reaped long after they finish, so
+      // only synchronous I/O feeds the latency histograms
+      this->diskStats->recordLatency(request->op, DiskStats::now() - request->batch->submitTime);
+    }
+    request->batch->pending--;
+    this->inFlight--;
+  }
 }
 
-void Disk::beginTransaction() {
-  if (isInTransaction) {
+void *Disk::allocateBuffer() {
+  pthread_mutex_lock(&this->ringLock);
+  void *buffer = NULL;
+  if (!this->freeBuffers.empty()) {
+    buffer = this->freeBuffers.back();
+    this->freeBuffers.pop_back();
+  }
+  pthread_mutex_unlock(&this->ringLock);
+
+  if (buffer == NULL) {
+    // The pool is exhausted, fall back to an unregistered buffer
+    buffer = new unsigned char[this->blockSize];
+  }
+  return buffer;
+}
+
+void Disk::freeBuffer(void *buffer) {
+  if (!this->isPoolBuffer(buffer)) {
+    delete [] (unsigned char *) buffer;
+    return;
+  }
+  pthread_mutex_lock(&this->ringLock);
+  this->freeBuffers.push_back(buffer);
+  pthread_mutex_unlock(&this->ringLock);
+}
+
+bool Disk::isPoolBuffer(void *buffer) {
+  unsigned char *address = (unsigned char *) buffer;
+  return address >= this->bufferPool &&
+    address < this->bufferPool + (size_t) DISK_BUFFER_POOL_BLOCKS * this->blockSize;
+}
+
+void Disk::checkBlockNumbers(const vector<int> &blockNumbers) {
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (blockNumbers[idx] < 0 || blockNumbers[idx] >= this->numberOfBlocks()) {
+      cerr << "Invalid block number " << blockNumbers[idx] << endl;
+      exit(1);
+    }
+  }
+}
+
+// Issue one preadv/pwritev per run of adjacent block numbers.
+void Disk::transferBlocksV(int fd, bool isWrite, const vector<int> &blockNumbers, struct iovec *iovecs) {
+  size_t runStart = 0;
+  while (runStart < blockNumbers.size()) {
+    size_t runEnd = runStart + 1;
+    while (runEnd < blockNumbers.size() &&
+           blockNumbers[runEnd] == blockNumbers[runEnd - 1] + 1 &&
+           runEnd - runStart < IOV_MAX) {
+      runEnd++;
+    }
+
+    int iovcnt = runEnd - runStart;
+    off_t offset = (off_t) blockNumbers[runStart] * this->blockSize;
+    ssize_t expected = (ssize_t) iovcnt * this->blockSize;
+    ssize_t ret;
+    if (isWrite) {
+      ret = pwritev(fd, iovecs + runStart, iovcnt, offset);
+    } else {
+      ret = preadv(fd, iovecs + runStart, iovcnt, offset);
+    }
+    if (ret != expected) {
+      if (ret < 0) {
+        perror(isWrite ? "write::pwritev" : "read::preadv");
+      }
+      cerr << (isWrite ? "Could not write file" : "Could not read file") << endl;
+      exit(1);
+    }
+
+    runStart = runEnd;
+  }
+}
+
+void Disk::prefetchBlocks(const vector<int> &blockNumbers) {
+  this->readahead->hint(blockNumbers);
+}
+
+ReadaheadStats Disk::readaheadStats() {
+  return this->readahead->stats();
+}
+
+Transaction *Disk::beginTransaction() {
+  if (this->currentTransaction() != NULL) {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
-  isInTransaction = true;
+
+  Transaction *txn = new Transaction();
+  txn->aborted = false;
+  pthread_mutex_lock(&this->txnLock);
+  txn->id = this->nextTxnId++;
+  this->threadTransactions[pthread_self()] = txn;
+  pthread_mutex_unlock(&this->txnLock);
+
+  this->diskStats->record(DISK_OP_BEGIN, txn->id);
+  return txn;
 }
 
-void Disk::commit() {
-  isInTransaction = false;
+bool Disk::commit() {
+  Transaction *txn = this->currentTransaction();
+  if (txn == NULL) {
+    return true;
+  }
+
+  bool committed = !txn->aborted;
+  if (committed) {
+    this->diskStats->record(DISK_OP_COMMIT, txn->id);
+    // Held while punching, so nobody writes the blocks meanwhile
+    pthread_mutex_lock(&this->discardLock);
+    this->punchHoles(txn->discards);
+    pthread_mutex_unlock(&this->discardLock);
+  }
   deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
+  for (iter = txn->undoLog.begin(); iter != txn->undoLog.end(); iter++) {
     delete [] iter->blockData;
   }
-  undoLog.clear();
+  for (iter = txn->mergeUndoLog.begin(); iter != txn->mergeUndoLog.end(); iter++) {
+    delete [] iter->blockData;
+  }
+  this->endTransaction(txn);
+  return committed;
 }
 
 void Disk::rollback() {
-  isInTransaction = false;
+  Transaction *txn = this->currentTransaction();
+  if (txn == NULL) {
+    return;
+  }
+  if (!txn->aborted) {
+    this->diskStats->record(DISK_OP_ROLLBACK, txn->id);
+    this->undoTransaction(txn);
+  }
+  this->endTransaction(txn);
+}
+
+void Disk::abort() {
+  Transaction *txn = this->currentTransaction();
+  if (txn != NULL && !txn->aborted) {
+    this->abortTransaction(txn);
+  }
+}
+
+Transaction *Disk::currentTransaction() {
+  pthread_mutex_lock(&this->txnLock);
+  Transaction *txn = NULL;
+  map<pthread_t, Transaction *>::iterator iter = this->threadTransactions.find(pthread_self());
+  if (iter != this->threadTransactions.end()) {
+    txn = iter->second;
+  }
+  pthread_mutex_unlock(&this->txnLock);
+  return txn;
+}
+
+uint64_t Disk::undoGeneration() {
+  pthread_mutex_lock(&this->txnLock);
+  uint64_t generation = this->undoCount;
+  pthread_mutex_unlock(&this->txnLock);
+  return generation;
+}
+
+void Disk::setMergeable(int startBlock, int count) {
+  this->mergeableRanges.push_back(make_pair(startBlock, count));
+}
+
+void Disk::setReadImage(int blockNumber, const void *image) {
+  Transaction *txn = this->currentTransaction();
+  if (txn == NULL || txn->aborted || !this->isMergeable(blockNumber)) {
+    return;
+  }
+  const unsigned char *data = (const unsigned char *) image;
+  txn->readImages[blockNumber].assign(data, data + this->blockSize);
+}
+
+void Disk::discardBlocks(const vector<int> &blockNumbers) {
+  this->checkBlockNumbers(blockNumbers);
+  Transaction *txn = this->currentTransaction();
+  if (txn != NULL) {
+    // A rollback has to be able to bring the old contents back
+    pthread_mutex_lock(&this->discardLock);
+    if (!txn->aborted) {
+      txn->discards.insert(txn->discards.end(), blockNumbers.begin(), blockNumbers.end());
+    }
+    pthread_mutex_unlock(&this->discardLock);
+    return;
+  }
+  this->punchHoles(blockNumbers);
+}
+
+// A block freed in a transaction can be allocated and written again,
+// by it or by another thread, before the transaction commits. It is in
+// use then, so it must not be punched.
+void Disk::cancelDiscards(const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->discardLock);
+  pthread_mutex_lock(&this->txnLock);
+  map<pthread_t, Transaction *>::iterator iter;
+  for (iter = this->threadTransactions.begin(); iter != this->threadTransactions.end(); iter++) {
+    vector<int> *discards = &iter->second->discards;
+    for (size_t idx = 0; idx < blockNumbers.size() && !discards->empty(); idx++) {
+      discards->erase(remove(discards->begin(), discards->end(), blockNumbers[idx]), discards->end());
+    }
+  }
+  pthread_mutex_unlock(&this->txnLock);
+  pthread_mutex_unlock(&this->discardLock);
+}
+
+// One fallocate per run of adjacent blocks
+void Disk::punchHoles(const vector<int> &blockNumbers) {
+  if (!this->canPunchHoles || blockNumbers.empty()) {
+    return;
+  }
+  vector<int> sorted(blockNumbers);
+  sort(sorted.begin(), sorted.end());
+  for (size_t idx = 0; idx < sorted.size(); idx++) {
+    this->readahead->invalidate(sorted[idx]);
+  }
+
+  size_t runStart = 0;
+  while (runStart < sorted.size()) {
+    size_t runEnd = runStart + 1;
+    while (runEnd < sorted.size() && sorted[runEnd] <= sorted[runEnd - 1] + 1) {
+      runEnd++;
+    }
+    off_t offset = (off_t) sorted[runStart] * this->blockSize;
+    off_t length = (off_t) (sorted[runEnd - 1] - sorted[runStart] + 1) * this->blockSize;
+    if (fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) != 0) {
+      if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        this->canPunchHoles = false;
+        return;
+      }
+      cerr << "Could not discard blocks" << endl;
+      exit(1);
+    }
+    runStart = runEnd;
+  }
+}
+
+bool Disk::isMergeable(int blockNumber) {
+  for (size_t idx = 0; idx < this->mergeableRanges.size(); idx++) {
+    if (blockNumber >= this->mergeableRanges[idx].first &&
+        blockNumber < this->mergeableRanges[idx].first + this->mergeableRanges[idx].second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Wait until no other transaction owns any of the ordinary blocks, taking
+// ownership of them for txn if acquire is set. Conflicts are resolved with
+// wait-die: an older transaction waits and a younger one is aborted. A
+// write that gets aborted is dropped right away, a read still waits for
+// the blocks like a reader without a transaction. Returns false if txn
+// was aborted.
+bool Disk::waitForBlocks(Transaction *txn, const vector<int> &blockNumbers, bool acquire) {
+  bool canDie = txn != NULL && !txn->aborted;
+  bool died = false;
+
+  pthread_mutex_lock(&this->txnLock);
+  while (true) {
+    Transaction *owner = NULL;
+    for (size_t idx = 0; idx < blockNumbers.size() && owner == NULL; idx++) {
+      if (this->isMergeable(blockNumbers[idx])) {
+        continue;
+      }
+      map<int, Transaction *>::iterator iter = this->blockOwners.find(blockNumbers[idx]);
+      if (iter != this->blockOwners.end() && iter->second != txn) {
+        owner = iter->second;
+      }
+    }
+    if (owner == NULL) {
+      break;
+    }
+
+    if (canDie && txn->id > owner->id) {
+      pthread_mutex_unlock(&this->txnLock);
+      this->abortTransaction(txn);
+      if (acquire) {
+        return false;
+      }
+      pthread_mutex_lock(&this->txnLock);
+      canDie = false;
+      died = true;
+      continue;
+    }
+    pthread_cond_wait(&this->txnReleased, &this->txnLock);
+  }
+
+  if (acquire && canDie) {
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      if (!this->isMergeable(blockNumbers[idx])) {
+        this->blockOwners[blockNumbers[idx]] = txn;
+        txn->writeSet.insert(blockNumbers[idx]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&this->txnLock);
+  return !died;
+}
+
+// Save the old contents of every block with one coalesced read
+void Disk::saveUndoImages(Transaction *txn, const vector<int> &blockNumbers) {
+  vector<struct iovec> undoIovecs(blockNumbers.size());
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    undoIovecs[idx].iov_base = new unsigned char[blockSize];
+    undoIovecs[idx].iov_len = blockSize;
+  }
+  this->complete(this->submitBlocksV(DISK_OP_UNDO, blockNumbers, undoIovecs.data(), true));
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    struct UndoRecord undoRecord;
+    undoRecord.blockNumber = blockNumbers[idx];
+    undoRecord.blockData = (unsigned char *)undoIovecs[idx].iov_base;
+    txn->undoLog.push_front(undoRecord);
+  }
+}
+
+// Apply only the bits txn changed since it last read the block. If some
+// other transaction changed one of the same bits in the meantime, like two
+// transactions allocating the same inode, txn is aborted instead.
+void Disk::writeMergeable(Transaction *txn, int blockNumber, void *buffer) {
+  pthread_mutex_lock(&this->mergeLock);
+  if (txn == NULL) {
+    this->writeRaw(blockNumber, buffer);
+    pthread_mutex_unlock(&this->mergeLock);
+    return;
+  }
+
+  vector<unsigned char> current(this->blockSize);
+  this->readRaw(blockNumber, current.data());
+
+  // A write without an earlier read replaces the block as it is now
+  unsigned char *data = (unsigned char *) buffer;
+  map<int, vector<unsigned char> >::iterator image = txn->readImages.find(blockNumber);
+  const unsigned char *base = image != txn->readImages.end() ? image->second.data() : current.data();
+
+  unsigned char *delta = new unsigned char[this->blockSize];
+  bool conflict = false;
+  for (int idx = 0; idx < this->blockSize; idx++) {
+    delta[idx] = data[idx] ^ base[idx];
+    if ((current[idx] ^ base[idx]) & delta[idx]) {
+      conflict = true;
+    }
+    current[idx] ^= delta[idx];
+  }
+  if (conflict) {
+    pthread_mutex_unlock(&this->mergeLock);
+    delete [] delta;
+    this->abortTransaction(txn);
+    return;
+  }
+
+  this->writeRaw(blockNumber, current.data());
+  struct UndoRecord undoRecord;
+  undoRecord.blockNumber = blockNumber;
+  undoRecord.blockData = delta;
+  txn->mergeUndoLog.push_front(undoRecord);
+  txn->readImages[blockNumber].assign(data, data + this->blockSize);
+  this->diskStats->record(DISK_OP_UNDO, vector<int>(1, blockNumber), txn->id);
+  pthread_mutex_unlock(&this->mergeLock);
+}
+
+// Undo txn now and let other transactions have its blocks. It stays the
+// thread's transaction until commit() or rollback().
+void Disk::abortTransaction(Transaction *txn) {
+  this->diskStats->record(DISK_OP_ROLLBACK, txn->id);
+  this->undoTransaction(txn);
+
+  pthread_mutex_lock(&this->txnLock);
+  txn->aborted = true;
+  set<int>::iterator iter;
+  for (iter = txn->writeSet.begin(); iter != txn->writeSet.end(); iter++) {
+    this->blockOwners.erase(*iter);
+  }
+  txn->writeSet.clear();
+  pthread_cond_broadcast(&this->txnReleased);
+  pthread_mutex_unlock(&this->txnLock);
+}
+
+void Disk::undoTransaction(Transaction *txn) {
   deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    this->writeBlock(iter->blockNumber, iter->blockData);
+  for (iter = txn->undoLog.begin(); iter != txn->undoLog.end(); iter++) {
+    this->writeRaw(iter->blockNumber, iter->blockData);
+    delete [] iter->blockData;
+  }
+  txn->undoLog.clear();
+
+  pthread_mutex_lock(&this->mergeLock);
+  vector<unsigned char> current(this->blockSize);
+  for (iter = txn->mergeUndoLog.begin(); iter != txn->mergeUndoLog.end(); iter++) {
+    this->readRaw(iter->blockNumber, current.data());
+    for (int idx = 0; idx < this->blockSize; idx++) {
+      current[idx] ^= iter->blockData[idx];
+    }
+    this->writeRaw(iter->blockNumber, current.data());
     delete [] iter->blockData;
   }
-  undoLog.clear();
+  txn->mergeUndoLog.clear();
+  txn->readImages.clear();
+  pthread_mutex_unlock(&this->mergeLock);
+
+  pthread_mutex_lock(&this->txnLock);
+  this->undoCount++;
+  pthread_mutex_unlock(&this->txnLock);
+}
+
+void Disk::endTransaction(Transaction *txn) {
+  pthread_mutex_lock(&this->txnLock);
+  set<int>::iterator iter;
+  for (iter = txn->writeSet.begin(); iter != txn->writeSet.end(); iter++) {
+    this->blockOwners.erase(*iter);
+  }
+  this->threadTransactions.erase(pthread_self());
+  // Writes dropped after an abort may still be in callers' caches
+  if (txn->aborted) {
+    this->undoCount++;
+  }
+  pthread_cond_broadcast(&this->txnReleased);
+  pthread_mutex_unlock(&this->txnLock);
+  delete txn;
+}
+
+// Block I/O that skips transaction bookkeeping, for undo and merging
+void Disk::writeRaw(int blockNumber, void *buffer) {
+  vector<int> blockNumbers(1, blockNumber);
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = this->blockSize;
+  this->complete(this->submitBlocksV(DISK_OP_WRITE, blockNumbers, &iov, true));
+}
+
+void Disk::readRaw(int blockNumber, void *buffer) {
+  vector<int> blockNumbers(1, blockNumber);
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = this->blockSize;
+  this->complete(this->submitBlocksV(DISK_OP_READ, blockNumbers, &iov, true));
+}
+
+DiskStats *Disk::stats() {
+  return this->diskStats;
+}
+
+void Disk::setLatencyModel(LatencyModel *latencyModel) {
+  this->latencyModel = latencyModel;
+  this->diskStats->setLatencyModel(latencyModel);
+}
+
+Snapshot *Disk::getSnapshot() {
+  return this->snapshot;
+}
+
+LatencyModel *Disk::getLatencyModel() {
+  return this->latencyModel;
 }
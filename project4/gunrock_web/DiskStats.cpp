@@ -0,0 +1,236 @@
+#include <iostream>
+#include <iomanip>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include "DiskStats.h"
+#include "LatencyModel.h"
+
+using namespace std;
+
+DiskStats::DiskStats() {
+  pthread_mutex_init(&this->lock, NULL);
+  this->hasLayout = false;
+  this->traceFd = -1;
+  this->latencyModel = NULL;
+  this->reset();
+}
+
+DiskStats::~DiskStats() {
+  if (this->traceFd >= 0) {
+    close(this->traceFd);
+  }
+  pthread_mutex_destroy(&this->lock);
+}
+
+void DiskStats::setLayout(const super_t *super) {
+  pthread_mutex_lock(&this->lock);
+  this->super = *super;
+  this->hasLayout = true;
+  pthread_mutex_unlock(&this->lock);
+}
+
+int DiskStats::regionForBlock(int blockNumber) {
+  if (blockNumber == 0) {
+    return REGION_SUPER;
+  }
+  if (!this->hasLayout) {
+    return REGION_UNKNOWN;
+  }
+
+  struct {
+    int addr;
+    int len;
+    int region;
+  } regions[] = {
+    { super.inode_bitmap_addr, super.inode_bitmap_len, REGION_INODE_BITMAP },
+    { super.data_bitmap_addr, super.data_bitmap_len, REGION_DATA_BITMAP },
+    { super.inode_region_addr, super.inode_region_len, REGION_INODES },
+    { super.data_region_addr, super.data_region_len, REGION_DATA },
+  };
+  for (size_t idx = 0; idx < sizeof(regions) / sizeof(regions[0]); idx++) {
+    if (blockNumber >= regions[idx].addr && blockNumber < regions[idx].addr + regions[idx].len) {
+      return regions[idx].region;
+    }
+  }
+  return REGION_UNKNOWN;
+}
+
+void DiskStats::record(int op, const vector<int> &blockNumbers, uint64_t txnId) {
+  vector<struct DiskTraceRecord> records;
+  uint64_t timestamp = this->traceFd >= 0 ? DiskStats::now() : 0;
+
+  pthread_mutex_lock(&this->lock);
+  bool regionSeen[NUM_REGIONS] = { false };
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    int region = this->regionForBlock(blockNumbers[idx]);
+    RegionCounters *counters = &this->regionCounters[region];
+    if (op == DISK_OP_READ) {
+      counters->reads++;
+    } else if (op == DISK_OP_WRITE) {
+      counters->writes++;
+    } else if (op == DISK_OP_UNDO) {
+      counters->undoRecords++;
+    } else if (op == DISK_OP_FSYNC && !regionSeen[region]) {
+      // One fsync covers every block of the batch, count it once per region
+      counters->fsyncs++;
+    }
+    regionSeen[region] = true;
+
+    if (this->traceFd >= 0 && (op != DISK_OP_FSYNC || idx == 0)) {
+      struct DiskTraceRecord record;
+      record.timestamp = timestamp;
+      record.op = op;
+      record.block = op == DISK_OP_FSYNC ? -1 : blockNumbers[idx];
+      record.txnId = txnId;
+      records.push_back(record);
+    }
+  }
+  this->appendTrace(records);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DiskStats::record(int op, uint64_t txnId) {
+  if (this->traceFd < 0) {
+    return;
+  }
+  vector<struct DiskTraceRecord> records(1);
+  records[0].timestamp = DiskStats::now();
+  records[0].op = op;
+  records[0].block = -1;
+  records[0].txnId = txnId;
+
+  pthread_mutex_lock(&this->lock);
+  this->appendTrace(records);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DiskStats::recordLatency(int op, uint64_t nanoseconds) {
+  uint64_t microseconds = nanoseconds / 1000;
+  int bucket = 0;
+  while (microseconds > 0 && bucket < LATENCY_BUCKETS - 1) {
+    microseconds >>= 1;
+    bucket++;
+  }
+
+  pthread_mutex_lock(&this->lock);
+  this->latencies[op][bucket]++;
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DiskStats::setLatencyModel(LatencyModel *latencyModel) {
+  pthread_mutex_lock(&this->lock);
+  this->latencyModel = latencyModel;
+  pthread_mutex_unlock(&this->lock);
+}
+
+bool DiskStats::openTrace(string traceFile) {
+  int fd = open(traceFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  pthread_mutex_lock(&this->lock);
+  if (this->traceFd >= 0) {
+    close(this->traceFd);
+  }
+  this->traceFd = fd;
+  pthread_mutex_unlock(&this->lock);
+  return true;
+}
+
+// Called with lock held
+void DiskStats::appendTrace(const vector<struct DiskTraceRecord> &records) {
+  if (this->traceFd < 0 || records.empty()) {
+    return;
+  }
+  ssize_t size = records.size() * sizeof(struct DiskTraceRecord);
+  if (write(this->traceFd, records.data(), size) != size) {
+    cerr << "Could not write disk trace, disabling it" << endl;
+    close(this->traceFd);
+    this->traceFd = -1;
+  }
+}
+
+RegionCounters DiskStats::counters(int region) {
+  pthread_mutex_lock(&this->lock);
+  RegionCounters result = this->regionCounters[region];
+  pthread_mutex_unlock(&this->lock);
+  return result;
+}
+
+unsigned long DiskStats::latencyBucket(int op, int bucket) {
+  pthread_mutex_lock(&this->lock);
+  unsigned long result = this->latencies[op][bucket];
+  pthread_mutex_unlock(&this->lock);
+  return result;
+}
+
+void DiskStats::recordAvoided(const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->lock);
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    this->regionCounters[this->regionForBlock(blockNumbers[idx])].bytesAvoided += UFS_BLOCK_SIZE;
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DiskStats::print(ostream &out) {
+  pthread_mutex_lock(&this->lock);
+  out << left << setw(14) << "region" << right
+      << setw(10) << "reads" << setw(10) << "writes"
+      << setw(10) << "fsyncs" << setw(10) << "undo" << setw(14) << "avoided" << endl;
+  for (int region = 0; region < NUM_REGIONS; region++) {
+    RegionCounters *counters = &this->regionCounters[region];
+    out << left << setw(14) << DiskStats::regionName(region) << right
+        << setw(10) << counters->reads << setw(10) << counters->writes
+        << setw(10) << counters->fsyncs << setw(10) << counters->undoRecords
+        << setw(14) << counters->bytesAvoided << endl;
+  }
+  if (this->latencyModel != NULL) {
+    out << endl << "simulated " << this->latencyModel->name() << " time " << this->latencyModel->elapsed() / 1e9
+        << " s" << endl;
+  }
+
+  int latencyOps[] = { DISK_OP_READ, DISK_OP_WRITE, DISK_OP_FSYNC };
+  for (size_t idx = 0; idx < sizeof(latencyOps) / sizeof(latencyOps[0]); idx++) {
+    int op = latencyOps[idx];
+    bool printedHeader = false;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+      if (this->latencies[op][bucket] == 0) {
+        continue;
+      }
+      if (!printedHeader) {
+        out << endl << DiskStats::opName(op) << " latency" << endl;
+        printedHeader = true;
+      }
+      unsigned long upper = 1UL << bucket;
+      out << "  < " << setw(9) << upper << " us  " << this->latencies[op][bucket] << endl;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void DiskStats::reset() {
+  pthread_mutex_lock(&this->lock);
+  memset(this->regionCounters, 0, sizeof(this->regionCounters));
+  memset(this->latencies, 0, sizeof(this->latencies));
+  pthread_mutex_unlock(&this->lock);
+}
+
+uint64_t DiskStats::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *DiskStats::regionName(int region) {
+  static const char *names[] = { "super", "inode bitmap", "data bitmap", "inodes", "data", "unknown" };
+  return names[region];
+}
+
+const char *DiskStats::opName(int op) {
+  static const char *names[] = { "read", "write", "fsync", "undo", "begin", "commit", "rollback" };
+  return names[op];
+}
@@ -2,6 +2,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
+#include <limits.h>
 #include <sstream>
 #include <iostream>
 #include <map>
@@ -10,23 +12,691 @@
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
+#include "Snapshot.h"
+#include "StringUtils.h"
 #include "ufs.h"
 #include "WwwFormEncodedDict.h"
 
 using namespace std;
 
+// Memory for each file system's directory entry cache
+#define DS3_DIRECTORY_CACHE_BYTES (4 * 1024 * 1024)
+// Paths remembered by each file system's path cache
+#define DS3_PATH_CACHE_ENTRIES (64 * 1024)
+// Data block hashes remembered for delta overwrites, 512 MB of data
+#define DS3_BLOCK_HASH_ENTRIES (128 * 1024)
+// Directory entries in a listing page when max-keys isn't given
+#define DS3_LISTING_PAGE_SIZE (1000)
+// Times a request's transaction runs before a lost conflict is a 409
+#define DS3_TRANSACTION_ATTEMPTS (8)
+
+// The client error for a failed LocalFileSystem call
+static ClientError clientError(int ret) {
+  switch (-ret) {
+  case ENOTENOUGHSPACE:
+    return ClientError::insufficientStorage();
+  case ENOTFOUND:
+  case EINVALIDINODE:
+    return ClientError::notFound();
+  case EINVALIDTYPE:
+    return ClientError::conflict();
+  default:
+    return ClientError::badRequest();
+  }
+}
+
+// Called when a request's transaction lost a conflict on its attempt-th
+// try. The caller runs it again until DS3_TRANSACTION_ATTEMPTS have
+// failed, then the request is a 409 Conflict.
+static void retryTransaction(int attempt) {
+  if (attempt >= DS3_TRANSACTION_ATTEMPTS) {
+    throw ClientError::conflict();
+  }
+}
+
+// A non-negative integer query parameter, or defaultValue when it's missing
+static int intParam(map<string, string> &params, string name, int defaultValue) {
+  map<string, string>::iterator iter = params.find(name);
+  if (iter == params.end()) {
+    return defaultValue;
+  }
+  char *end;
+  long value = strtol(iter->second.c_str(), &end, 10);
+  if (iter->second.empty() || *end != '\0' || value < 0 || value > MAX_FILE_SIZE_V2) {
+    throw ClientError::badRequest();
+  }
+  return value;
+}
+
+// A file or directory in a tar archive. File data is `size` bytes at
+// `offset` in the archive.
+struct TarMember {
+  string path;
+  bool isDirectory;
+  size_t offset;
+  size_t size;
+};
+
+#define TAR_BLOCK_SIZE (512)
+
+// An octal number field of a tar header
+static bool tarNumber(const char *field, int length, size_t *value) {
+  *value = 0;
+  int idx = 0;
+  while (idx < length && field[idx] == ' ') {
+    idx++;
+  }
+  for (; idx < length && field[idx] >= '0' && field[idx] <= '7'; idx++) {
+    *value = *value * 8 + (field[idx] - '0');
+  }
+  return idx == length || field[idx] == ' ' || field[idx] == '\0';
+}
+
+// Parse a ustar archive as written by tar. Besides files and
+// directories, only the GNU long name and pax header members that tar
+// uses for long paths are understood.
+static bool parseTar(const string &archive, vector<TarMember> &members) {
+  string longPath;
+  size_t position = 0;
+  while (position + TAR_BLOCK_SIZE <= archive.size()) {
+    const char *header = archive.data() + position;
+    if (header[0] == '\0') {
+      // The archive ends with zero blocks
+      return true;
+    }
+
+    size_t checksum;
+    if (!tarNumber(header + 148, 8, &checksum)) {
+      return false;
+    }
+    size_t sum = 0;
+    for (int idx = 0; idx < TAR_BLOCK_SIZE; idx++) {
+      sum += idx >= 148 && idx < 156 ? ' ' : (unsigned char) header[idx];
+    }
+    size_t size;
+    if (sum != checksum || !tarNumber(header + 124, 12, &size)) {
+      return false;
+    }
+    size_t offset = position + TAR_BLOCK_SIZE;
+    if (offset + size > archive.size()) {
+      return false;
+    }
+    position = offset + (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    char type = header[156];
+    if (type == 'L') {
+      longPath = string(archive.data() + offset, strnlen(archive.data() + offset, size));
+      continue;
+    }
+    if (type == 'x') {
+      // Records are "<length> <key>=<value>\n"
+      string records = archive.substr(offset, size);
+      size_t start = 0;
+      while (start < records.size()) {
+        size_t length = strtoul(records.c_str() + start, NULL, 10);
+        size_t space = records.find(' ', start);
+        if (length == 0 || space == string::npos || start + length > records.size()) {
+          return false;
+        }
+        string record = records.substr(space + 1, start + length - space - 2);
+        if (record.compare(0, 5, "path=") == 0) {
+          longPath = record.substr(5);
+        }
+        start += length;
+      }
+      continue;
+    }
+    if (type == 'g') {
+      continue;
+    }
+    if (type != '0' && type != '\0' && type != '5') {
+      return false;
+    }
+
+    TarMember member;
+    if (!longPath.empty()) {
+      member.path = longPath;
+      longPath.clear();
+    } else {
+      member.path = string(header, strnlen(header, 100));
+      if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+        member.path = string(header + 345, strnlen(header + 345, 155)) + "/" + member.path;
+      }
+    }
+    member.isDirectory = type == '5';
+    member.offset = offset;
+    member.size = member.isDirectory ? 0 : size;
+    members.push_back(member);
+  }
+  // Some writers leave out the trailing zero blocks
+  return position == archive.size();
+}
+
 DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+  Disk *disk = new Disk(diskFile, UFS_BLOCK_SIZE);
+  this->fileSystem = new LocalFileSystem(disk);
+  this->fileSystem->setMetadataCache(true);
+  this->fileSystem->setDirectoryCache(DS3_DIRECTORY_CACHE_BYTES);
+  this->fileSystem->setBlockHashCache(DS3_BLOCK_HASH_ENTRIES);
+  this->pathCache = new PathCache(this->fileSystem, DS3_PATH_CACHE_ENTRIES);
+  this->snapshotFileSystem = NULL;
+  this->snapshotPathCache = NULL;
+  if (disk->getSnapshot() != NULL) {
+    this->snapshotFileSystem = new LocalFileSystem(new Disk(disk->getSnapshot()->baseImage(), UFS_BLOCK_SIZE));
+    this->snapshotFileSystem->setMetadataCache(true);
+    this->snapshotFileSystem->setDirectoryCache(DS3_DIRECTORY_CACHE_BYTES);
+    this->snapshotPathCache = new PathCache(this->snapshotFileSystem, DS3_PATH_CACHE_ENTRIES);
+  }
 }  
 
+// Path components below /ds3/
+vector<string> DistributedFileSystemService::pathComponents(HTTPRequest *request) {
+  vector<string> components = request->getPathComponents();
+  components.erase(components.begin());
+  return components;
+}
+
+// Inode number of the first `length` components of path
+int DistributedFileSystemService::resolve(PathCache *pathCache, const vector<string> &path, size_t length) {
+  int inodeNumber = pathCache->resolve(path, length);
+  if (inodeNumber < 0) {
+    throw ClientError::notFound();
+  }
+  return inodeNumber;
+}
+
+// Create the directories for the first `length` components of path,
+// keeping the ones that exist. Call in a transaction. Returns the last
+// directory and appends the inode number of each one to inodeNumbers.
+int DistributedFileSystemService::createDirectories(const vector<string> &path, size_t length,
+                                                    vector<int> &inodeNumbers) {
+  int parent = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (size_t idx = 0; idx < length; idx++) {
+    int ret = this->fileSystem->create(parent, UFS_DIRECTORY, path[idx]);
+    if (ret < 0) {
+      throw clientError(ret);
+    }
+    parent = ret;
+    inodeNumbers.push_back(parent);
+  }
+  return parent;
+}
+
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
-  response->setBody("");
+  LocalFileSystem *fileSystem = this->fileSystem;
+  PathCache *pathCache = this->pathCache;
+  map<string, string> params = request->getParams();
+  if (params.find("snapshot") != params.end()) {
+    if (this->snapshotFileSystem == NULL) {
+      throw ClientError::badRequest();
+    }
+    fileSystem = this->snapshotFileSystem;
+    pathCache = this->snapshotPathCache;
+  }
+  if (params.find("stats") != params.end()) {
+    this->stats(response);
+    return;
+  }
+
+  vector<string> path = this->pathComponents(request);
+  int inodeNumber = this->resolve(pathCache, path, path.size());
+  inode_t inode;
+  if (fileSystem->stat(inodeNumber, &inode) < 0) {
+    throw ClientError::notFound();
+  }
+
+  // Ranged reads of a file only read the blocks they need
+  if (params.find("offset") != params.end() || params.find("length") != params.end()) {
+    if (inode.type != UFS_REGULAR_FILE) {
+      throw ClientError::badRequest();
+    }
+    int offset = intParam(params, "offset", 0);
+    // Nothing past the end of the file is read, whatever length asks for
+    int length = min(intParam(params, "length", inode.size), max(inode.size - offset, 0));
+    vector<char> buffer(length);
+    int ret = fileSystem->readAt(inodeNumber, offset, buffer.data(), length);
+    if (ret < 0) {
+      throw clientError(ret);
+    }
+    response->setBody(string(buffer.data(), ret));
+    return;
+  }
+
+  if (inode.type == UFS_REGULAR_FILE) {
+    vector<char> buffer(inode.size);
+    int ret = fileSystem->read(inodeNumber, buffer.data(), inode.size);
+    if (ret < 0) {
+      throw clientError(ret);
+    }
+    response->setBody(string(buffer.data(), ret));
+    return;
+  }
+
+  // Directories list one entry per line in name order, subdirectories
+  // with a trailing /. prefix keeps the names that start with it. With
+  // marker or max-keys the listing is a page of at most max-keys entries
+  // after the name marker, and X-DS3-Next-Marker is set when there may
+  // be more.
+  string prefix = params.find("prefix") != params.end() ? params["prefix"] : "";
+  string after = params.find("marker") != params.end() ? params["marker"] : "";
+  if (!after.empty() && after[after.length() - 1] == '/') {
+    after.erase(after.length() - 1);
+  }
+  bool paged = params.find("marker") != params.end() || params.find("max-keys") != params.end();
+  int maxKeys = paged ? intParam(params, "max-keys", DS3_LISTING_PAGE_SIZE) : INT_MAX;
+  if (maxKeys == 0) {
+    throw ClientError::badRequest();
+  }
+  vector<string> names;
+  vector<dir_ent_t> entries;
+  while ((int) names.size() < maxKeys) {
+    int ret = fileSystem->readdirSorted(inodeNumber, after, prefix, entries,
+                                        min(DS3_LISTING_PAGE_SIZE, maxKeys - (int) names.size()));
+    if (ret < 0) {
+      throw clientError(ret);
+    }
+    if (ret == 0) {
+      break;
+    }
+    for (int idx = 0; idx < ret; idx++) {
+      if (strcmp(entries[idx].name, ".") == 0 || strcmp(entries[idx].name, "..") == 0) {
+        continue;
+      }
+      inode_t entry;
+      if (fileSystem->stat(entries[idx].inum, &entry) < 0) {
+        continue;
+      }
+      names.push_back(string(entries[idx].name) + (entry.type == UFS_DIRECTORY ? "/" : ""));
+    }
+    after = entries[ret - 1].name;
+  }
+  if (paged && (int) names.size() == maxKeys) {
+    response->setHeader("X-DS3-Next-Marker", after);
+  }
+
+  string body;
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    body += names[idx] + "\n";
+  }
+  response->setBody(body);
 }
 
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = this->pathComponents(request);
+  map<string, string> params = request->getParams();
+  if (params.find("bulk") != params.end()) {
+    if (params["bulk"] != "tar") {
+      throw ClientError::badRequest();
+    }
+    this->putBulk(path, request->getBody());
+    response->setBody("");
+    return;
+  }
+  if (path.empty()) {
+    throw ClientError::badRequest();
+  }
+  string body = request->getBody();
+  this->checkSpace(path, 0, body.size());
+
+  Disk *disk = this->fileSystem->disk;
+  vector<int> inodeNumbers;
+  for (int attempt = 1; ; attempt++) {
+    inodeNumbers.clear();
+    Transaction *txn = disk->beginTransaction();
+    try {
+      // Directories along the way are created implicitly
+      int parent = this->createDirectories(path, path.size() - 1, inodeNumbers);
+      int inodeNumber = this->fileSystem->create(parent, UFS_REGULAR_FILE, path.back());
+      if (inodeNumber < 0) {
+        throw clientError(inodeNumber);
+      }
+      inodeNumbers.push_back(inodeNumber);
+      int written = this->fileSystem->write(inodeNumber, body.data(), body.size());
+      if (written < 0) {
+        throw clientError(written);
+      }
+      if (written < (int) body.size()) {
+        throw ClientError::insufficientStorage();
+      }
+    } catch (ClientError &error) {
+      // An aborted transaction may have failed on what it couldn't write
+      bool lost = txn->aborted;
+      disk->rollback();
+      if (!lost) {
+        throw;
+      }
+      retryTransaction(attempt);
+      continue;
+    }
+    if (disk->commit()) {
+      break;
+    }
+    retryTransaction(attempt);
+  }
+  for (size_t idx = 0; idx < inodeNumbers.size(); idx++) {
+    this->pathCache->insert(path, idx + 1, inodeNumbers[idx]);
+  }
+  response->setBody("");
+}
+
+// Unpack a tar archive below path with one LocalFileSystem::batch
+void DistributedFileSystemService::putBulk(const vector<string> &path, const string &archive) {
+  vector<TarMember> members;
+  if (!parseTar(archive, members)) {
+    throw ClientError::badRequest();
+  }
+
+  vector<BatchOperation> operations;
+  vector<vector<string> > paths;
+  map<string, int> directories;
+  this->bulkDirectory(path, path.size(), operations, paths, directories);
+  for (size_t idx = 0; idx < members.size(); idx++) {
+    vector<string> memberPath = path;
+    vector<string> components = StringUtils::split(members[idx].path, '/');
+    for (size_t component = 0; component < components.size(); component++) {
+      if (components[component] == "..") {
+        throw ClientError::badRequest();
+      }
+      if (!components[component].empty() && components[component] != ".") {
+        memberPath.push_back(components[component]);
+      }
+    }
+    if (memberPath.size() == path.size()) {
+      continue;
+    }
+    if (members[idx].isDirectory) {
+      this->bulkDirectory(memberPath, memberPath.size(), operations, paths, directories);
+      continue;
+    }
+
+    BatchOperation operation;
+    operation.op = BATCH_CREATE;
+    operation.parentInodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    operation.parentOperation = this->bulkDirectory(memberPath, memberPath.size() - 1, operations, paths,
+                                                    directories);
+    operation.name = memberPath.back();
+    operation.type = UFS_REGULAR_FILE;
+    operation.data = archive.data() + members[idx].offset;
+    operation.size = members[idx].size;
+    operations.push_back(operation);
+    paths.push_back(memberPath);
+  }
+
+  Disk *disk = this->fileSystem->disk;
+  for (int attempt = 1; ; attempt++) {
+    Transaction *txn = disk->beginTransaction();
+    int ret = this->fileSystem->batch(operations);
+    if (ret < 0) {
+      bool lost = txn->aborted;
+      disk->rollback();
+      if (!lost) {
+        throw clientError(ret);
+      }
+    } else if (disk->commit()) {
+      break;
+    }
+    retryTransaction(attempt);
+  }
+  for (size_t idx = 0; idx < operations.size(); idx++) {
+    this->pathCache->insert(paths[idx], paths[idx].size(), operations[idx].result);
+  }
+}
+
+// The index of the batch operation that creates the directory for the
+// first `length` components of path, adding it and its parents the first
+// time. -1 for the root.
+int DistributedFileSystemService::bulkDirectory(const vector<string> &path, size_t length,
+                                                vector<BatchOperation> &operations,
+                                                vector<vector<string> > &paths, map<string, int> &directories) {
+  if (length == 0) {
+    return -1;
+  }
+  string key;
+  for (size_t idx = 0; idx < length; idx++) {
+    key += "/" + path[idx];
+  }
+  map<string, int>::iterator iter = directories.find(key);
+  if (iter != directories.end()) {
+    return iter->second;
+  }
+
+  BatchOperation operation;
+  operation.op = BATCH_CREATE;
+  operation.parentInodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  operation.parentOperation = this->bulkDirectory(path, length - 1, operations, paths, directories);
+  operation.name = path[length - 1];
+  operation.type = UFS_DIRECTORY;
+  operation.data = NULL;
+  operation.size = 0;
+  operations.push_back(operation);
+  paths.push_back(vector<string>(path.begin(), path.begin() + length));
+  directories[key] = operations.size() - 1;
+  return operations.size() - 1;
+}
+
+void DistributedFileSystemService::post(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = this->pathComponents(request);
+  map<string, string> params = request->getParams();
+  if (params.find("defrag") != params.end()) {
+    this->defragment(path, response);
+    return;
+  }
+  if (path.empty()) {
+    throw ClientError::badRequest();
+  }
+  bool truncate = params.find("truncate") != params.end();
+  int size = intParam(params, "truncate", 0);
+  bool atOffset = params.find("offset") != params.end();
+  int offset = intParam(params, "offset", 0);
+  string body = request->getBody();
+  if (truncate) {
+    this->checkSpace(path, size, 0);
+  } else {
+    this->checkSpace(path, atOffset ? offset : -1, body.size());
+  }
+
+  Disk *disk = this->fileSystem->disk;
+  vector<int> inodeNumbers;
+  for (int attempt = 1; ; attempt++) {
+    inodeNumbers.clear();
+    Transaction *txn = disk->beginTransaction();
+    try {
+      int inodeNumber;
+      if (truncate) {
+        // Only existing files can be truncated
+        inodeNumber = this->resolve(this->pathCache, path, path.size());
+      } else {
+        // Like PUT, the file and the directories along the way are created
+        int parent = this->createDirectories(path, path.size() - 1, inodeNumbers);
+        inodeNumber = this->fileSystem->create(parent, UFS_REGULAR_FILE, path.back());
+        if (inodeNumber < 0) {
+          throw clientError(inodeNumber);
+        }
+        inodeNumbers.push_back(inodeNumber);
+      }
+
+      int ret;
+      if (truncate) {
+        ret = this->fileSystem->truncate(inodeNumber, size);
+      } else if (atOffset) {
+        ret = this->fileSystem->writeAt(inodeNumber, offset, body.data(), body.size());
+      } else {
+        ret = this->fileSystem->append(inodeNumber, body.data(), body.size());
+      }
+      if (ret < 0) {
+        throw clientError(ret);
+      }
+      if (!truncate && ret < (int) body.size()) {
+        throw ClientError::insufficientStorage();
+      }
+    } catch (ClientError &error) {
+      bool lost = txn->aborted;
+      disk->rollback();
+      if (!lost) {
+        throw;
+      }
+      retryTransaction(attempt);
+      continue;
+    }
+    if (disk->commit()) {
+      break;
+    }
+    retryTransaction(attempt);
+  }
+  for (size_t idx = 0; idx < inodeNumbers.size(); idx++) {
+    this->pathCache->insert(path, idx + 1, inodeNumbers[idx]);
+  }
   response->setBody("");
 }
 
+// Turn a PUT or POST away before it starts a transaction when the free
+// counts already show that writing size bytes at offset of the file at
+// path, -1 for its end, can't fit. Anything closer is left to the write.
+void DistributedFileSystemService::checkSpace(const vector<string> &path, int offset, int size) {
+  int inodeNumber = this->pathCache->resolve(path, path.size());
+  if (inodeNumber < 0 && this->fileSystem->freeInodes() == 0) {
+    throw ClientError::insufficientStorage();
+  }
+  if (this->fileSystem->blocksNeeded(inodeNumber < 0 ? -1 : inodeNumber, offset, size) >
+      this->fileSystem->freeDataBlocks()) {
+    throw ClientError::insufficientStorage();
+  }
+}
+
+void DistributedFileSystemService::stats(HTTPResponse *response) {
+  super_t super;
+  this->fileSystem->readSuperBlock(&super);
+  response->setBody("inodes " + to_string(super.num_inodes) + "\n" +
+                    "free inodes " + to_string(this->fileSystem->freeInodes()) + "\n" +
+                    "data blocks " + to_string(super.num_data) + "\n" +
+                    "free data blocks " + to_string(this->fileSystem->freeDataBlocks()) + "\n" +
+                    this->pathCacheStats());
+}
+
+// How well the path cache saves lookups, per path it resolved
+string DistributedFileSystemService::pathCacheStats() {
+  PathCacheStats stats = this->pathCache->stats();
+  stringstream body;
+  body.setf(ios::fixed);
+  body.precision(2);
+  body << "path resolves " << stats.resolves << "\n"
+       << "path cache hits " << stats.hits << "\n"
+       << "path cache partial hits " << stats.partialHits << "\n"
+       << "path cache hit rate " << (stats.resolves > 0 ? 100.0 * stats.hits / stats.resolves : 0.0) << "%\n"
+       << "lookups " << stats.lookups << "\n"
+       << "lookups avoided " << stats.lookupsAvoided << "\n"
+       << "lookups avoided per resolve "
+       << (stats.resolves > 0 ? (double) stats.lookupsAvoided / stats.resolves : 0.0) << "\n";
+  return body.str();
+}
+
+// Each directory and file is its own transaction, and inode numbers
+// don't change, so the path cache stays valid
+void DistributedFileSystemService::defragment(const vector<string> &path, HTTPResponse *response) {
+  int inodeNumber = this->resolve(this->pathCache, path, path.size());
+  DefragStats stats = { 0, 0, 0, 0, 0, 0 };
+  int ret = this->fileSystem->defragment(inodeNumber, &stats);
+  if (ret < 0) {
+    throw clientError(ret);
+  }
+  response->setBody("directories compacted " + to_string(stats.directoriesCompacted) + "\n" +
+                    "entries removed " + to_string(stats.entriesRemoved) + "\n" +
+                    "directory blocks freed " + to_string(stats.directoryBlocksFreed) + "\n" +
+                    "files relocated " + to_string(stats.filesRelocated) + "\n" +
+                    "extents before " + to_string(stats.extentsBefore) + "\n" +
+                    "extents after " + to_string(stats.extentsAfter) + "\n");
+}
+
 void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = this->pathComponents(request);
+  if (path.empty()) {
+    throw ClientError::badRequest();
+  }
+  int parent = this->resolve(this->pathCache, path, path.size() - 1);
+  if (this->fileSystem->lookup(parent, path.back()) < 0) {
+    throw ClientError::notFound();
+  }
+
+  Disk *disk = this->fileSystem->disk;
+  for (int attempt = 1; ; attempt++) {
+    Transaction *txn = disk->beginTransaction();
+    int ret = this->fileSystem->unlink(parent, path.back());
+    if (ret < 0) {
+      bool lost = txn->aborted;
+      disk->rollback();
+      if (!lost) {
+        throw clientError(ret);
+      }
+    } else if (disk->commit()) {
+      break;
+    }
+    retryTransaction(attempt);
+  }
+  this->pathCache->invalidate(path, path.size());
+  response->setBody("");
+}
+
+void DistributedFileSystemService::move(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = this->pathComponents(request);
+  string destination;
+  try {
+    destination = request->getHeader("Destination");
+  } catch (...) {
+    try {
+      destination = request->getHeader("destination");
+    } catch (...) {
+      throw ClientError::badRequest();
+    }
+  }
+  // Accept a full URL as well as a path
+  size_t start = destination.find(this->pathPrefix());
+  if (start == string::npos) {
+    throw ClientError::badRequest();
+  }
+  vector<string> newPath = StringUtils::split(destination.substr(start + this->pathPrefix().length()), '/');
+  if (path.empty() || newPath.empty()) {
+    throw ClientError::badRequest();
+  }
+
+  int parent = this->resolve(this->pathCache, path, path.size() - 1);
+  int inodeNumber = this->fileSystem->lookup(parent, path.back());
+  if (inodeNumber < 0) {
+    throw ClientError::notFound();
+  }
+
+  Disk *disk = this->fileSystem->disk;
+  vector<int> inodeNumbers;
+  for (int attempt = 1; ; attempt++) {
+    inodeNumbers.clear();
+    Transaction *txn = disk->beginTransaction();
+    try {
+      // Like PUT, directories along the way are created implicitly
+      int newParent = this->createDirectories(newPath, newPath.size() - 1, inodeNumbers);
+      if (this->fileSystem->lookup(newParent, newPath.back()) >= 0) {
+        throw ClientError::conflict();
+      }
+      int ret = this->fileSystem->rename(parent, path.back(), newParent, newPath.back());
+      if (ret < 0) {
+        throw clientError(ret);
+      }
+      inodeNumbers.push_back(inodeNumber);
+    } catch (ClientError &error) {
+      bool lost = txn->aborted;
+      disk->rollback();
+      if (!lost) {
+        throw;
+      }
+      retryTransaction(attempt);
+      continue;
+    }
+    if (disk->commit()) {
+      break;
+    }
+    retryTransaction(attempt);
+  }
+  this->pathCache->invalidate(path, path.size());
+  for (size_t idx = 0; idx < inodeNumbers.size(); idx++) {
+    this->pathCache->insert(newPath, idx + 1, inodeNumbers[idx]);
+  }
   response->setBody("");
 }
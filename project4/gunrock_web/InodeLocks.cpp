@@ -0,0 +1,69 @@
+#include "InodeLocks.h"
+
+using namespace std;
+
+InodeLocks::InodeLocks(int count) {
+  this->locks.resize(count);
+  for (int idx = 0; idx < count; idx++) {
+    initLock(&this->locks[idx]);
+  }
+  initLock(&this->namespaceLock);
+}
+
+InodeLocks::~InodeLocks() {
+  for (size_t idx = 0; idx < this->locks.size(); idx++) {
+    pthread_rwlock_destroy(&this->locks[idx]);
+  }
+  pthread_rwlock_destroy(&this->namespaceLock);
+}
+
+bool InodeLocks::tryLock(int inodeNumber, bool exclusive) {
+  if (inodeNumber < 0 || inodeNumber >= (int) this->locks.size()) {
+    return true;
+  }
+  return tryLock(&this->locks[inodeNumber], exclusive);
+}
+
+void InodeLocks::lock(int inodeNumber, bool exclusive) {
+  if (inodeNumber >= 0 && inodeNumber < (int) this->locks.size()) {
+    lock(&this->locks[inodeNumber], exclusive);
+  }
+}
+
+void InodeLocks::unlock(int inodeNumber) {
+  if (inodeNumber >= 0 && inodeNumber < (int) this->locks.size()) {
+    pthread_rwlock_unlock(&this->locks[inodeNumber]);
+  }
+}
+
+bool InodeLocks::tryLockNamespace(bool exclusive) {
+  return tryLock(&this->namespaceLock, exclusive);
+}
+
+void InodeLocks::lockNamespace(bool exclusive) {
+  lock(&this->namespaceLock, exclusive);
+}
+
+void InodeLocks::unlockNamespace() {
+  pthread_rwlock_unlock(&this->namespaceLock);
+}
+
+void InodeLocks::initLock(pthread_rwlock_t *lock) {
+  pthread_rwlockattr_t attributes;
+  pthread_rwlockattr_init(&attributes);
+  pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(lock, &attributes);
+  pthread_rwlockattr_destroy(&attributes);
+}
+
+bool InodeLocks::tryLock(pthread_rwlock_t *lock, bool exclusive) {
+  return (exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) == 0;
+}
+
+void InodeLocks::lock(pthread_rwlock_t *lock, bool exclusive) {
+  if (exclusive) {
+    pthread_rwlock_wrlock(lock);
+  } else {
+    pthread_rwlock_rdlock(lock);
+  }
+}
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <unistd.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "IoUring.h"
+
+using namespace std;
+
+IoUring::IoUring(unsigned entries) {
+  this->sqRing = MAP_FAILED;
+  this->cqRing = MAP_FAILED;
+  this->sqes = (struct io_uring_sqe *) MAP_FAILED;
+  this->sqLocalTail = 0;
+
+  memset(&this->params, 0, sizeof(this->params));
+  this->ringFd = syscall(__NR_io_uring_setup, entries, &this->params);
+  if (this->ringFd < 0) {
+    return;
+  }
+
+  struct io_sqring_offsets *sqOff = &this->params.sq_off;
+  struct io_cqring_offsets *cqOff = &this->params.cq_off;
+  this->sqRingSize = sqOff->array + this->params.sq_entries * sizeof(unsigned);
+  this->cqRingSize = cqOff->cqes + this->params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMmap = (this->params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMmap && this->cqRingSize > this->sqRingSize) {
+    this->sqRingSize = this->cqRingSize;
+  }
+
+  this->sqRing = mmap(NULL, this->sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+  if (singleMmap) {
+    this->cqRing = this->sqRing;
+  } else if (this->sqRing != MAP_FAILED) {
+    this->cqRing = mmap(NULL, this->cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_CQ_RING);
+  }
+  this->sqesSize = this->params.sq_entries * sizeof(struct io_uring_sqe);
+  if (this->cqRing != MAP_FAILED) {
+    this->sqes = (struct io_uring_sqe *) mmap(NULL, this->sqesSize, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+  }
+  if (this->sqRing == MAP_FAILED || this->cqRing == MAP_FAILED || this->sqes == MAP_FAILED) {
+    perror("io_uring::mmap");
+    this->teardown();
+    return;
+  }
+
+  unsigned char *sq = (unsigned char *) this->sqRing;
+  this->sqHead = (unsigned *) (sq + sqOff->head);
+  this->sqTail = (unsigned *) (sq + sqOff->tail);
+  this->sqMask = (unsigned *) (sq + sqOff->ring_mask);
+  this->sqArray = (unsigned *) (sq + sqOff->array);
+  this->sqLocalTail = *this->sqTail;
+
+  unsigned char *cq = (unsigned char *) this->cqRing;
+  this->cqHead = (unsigned *) (cq + cqOff->head);
+  this->cqTail = (unsigned *) (cq + cqOff->tail);
+  this->cqMask = (unsigned *) (cq + cqOff->ring_mask);
+  this->cqes = (struct io_uring_cqe *) (cq + cqOff->cqes);
+}
+
+IoUring::~IoUring() {
+  this->teardown();
+}
+
+void IoUring::teardown() {
+  if (this->sqes != MAP_FAILED) {
+    munmap(this->sqes, this->sqesSize);
+    this->sqes = (struct io_uring_sqe *) MAP_FAILED;
+  }
+  if (this->cqRing != MAP_FAILED && this->cqRing != this->sqRing) {
+    munmap(this->cqRing, this->cqRingSize);
+  }
+  this->cqRing = MAP_FAILED;
+  if (this->sqRing != MAP_FAILED) {
+    munmap(this->sqRing, this->sqRingSize);
+    this->sqRing = MAP_FAILED;
+  }
+  if (this->ringFd >= 0) {
+    close(this->ringFd);
+    this->ringFd = -1;
+  }
+}
+
+bool IoUring::isAvailable() {
+  return this->ringFd >= 0;
+}
+
+bool IoUring::registerBuffer(void *buffer, size_t size) {
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  int ret = syscall(__NR_io_uring_register, this->ringFd, IORING_REGISTER_BUFFERS, &iov, 1);
+  return ret == 0;
+}
+
+struct io_uring_sqe *IoUring::getSqe() {
+  unsigned head = __atomic_load_n(this->sqHead, __ATOMIC_ACQUIRE);
+  if (this->sqLocalTail - head >= this->params.sq_entries) {
+    return NULL;
+  }
+  unsigned index = this->sqLocalTail & *this->sqMask;
+  struct io_uring_sqe *sqe = &this->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  this->sqArray[index] = index;
+  this->sqLocalTail++;
+  return sqe;
+}
+
+int IoUring::submitAndWait(unsigned waitNr) {
+  unsigned toSubmit = this->sqLocalTail - *this->sqTail;
+  __atomic_store_n(this->sqTail, this->sqLocalTail, __ATOMIC_RELEASE);
+
+  unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, this->ringFd, toSubmit, waitNr, flags, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+bool IoUring::peekCqe(struct io_uring_cqe *cqe) {
+  unsigned head = *this->cqHead;
+  unsigned tail = __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return false;
+  }
+  *cqe = this->cqes[head & *this->cqMask];
+  __atomic_store_n(this->cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+unsigned IoUring::sqEntries() {
+  return this->params.sq_entries;
+}
+
+unsigned IoUring::cqEntries() {
+  return this->params.cq_entries;
+}
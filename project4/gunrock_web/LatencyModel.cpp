@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "LatencyModel.h"
+#include "DiskStats.h"
+
+using namespace std;
+
+LatencyModel::LatencyModel() {
+  pthread_mutex_init(&this->lock, NULL);
+  this->clock = 0;
+}
+
+LatencyModel::~LatencyModel() {
+  pthread_mutex_destroy(&this->lock);
+}
+
+void LatencyModel::access(int op, const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->lock);
+  this->clock += this->cost(op, blockNumbers, this->clock);
+  pthread_mutex_unlock(&this->lock);
+}
+
+uint64_t LatencyModel::elapsed() {
+  pthread_mutex_lock(&this->lock);
+  uint64_t result = this->clock;
+  pthread_mutex_unlock(&this->lock);
+  return result;
+}
+
+void LatencyModel::reset() {
+  pthread_mutex_lock(&this->lock);
+  this->clock = 0;
+  pthread_mutex_unlock(&this->lock);
+}
+
+LatencyModel *LatencyModel::create(string name, int numberOfBlocks) {
+  if (name == "hdd") {
+    // 7200 RPM, 1 MB tracks, 0.5 ms track-to-track and 15 ms full stroke
+    return new HddLatencyModel(numberOfBlocks, 256, 7200, 500000, 15000000);
+  } else if (name == "ssd") {
+    // 8 channels, 60 us reads, 250 us programs and 1 ms cache flushes
+    return new SsdLatencyModel(8, 60000, 250000, 1000000);
+  } else if (name == "flat") {
+    return new FlatLatencyModel(100000, 100000);
+  }
+  return NULL;
+}
+
+FlatLatencyModel::FlatLatencyModel(uint64_t blockNanoseconds, uint64_t fsyncNanoseconds) {
+  this->blockNanoseconds = blockNanoseconds;
+  this->fsyncNanoseconds = fsyncNanoseconds;
+}
+
+string FlatLatencyModel::name() {
+  return "flat";
+}
+
+uint64_t FlatLatencyModel::cost(int op, const vector<int> &blockNumbers, uint64_t clock) {
+  if (op == DISK_OP_FSYNC) {
+    return this->fsyncNanoseconds;
+  }
+  return blockNumbers.size() * this->blockNanoseconds;
+}
+
+HddLatencyModel::HddLatencyModel(int numberOfBlocks, int blocksPerTrack, int rpm,
+                                 uint64_t minSeekNanoseconds, uint64_t maxSeekNanoseconds) {
+  this->blocksPerTrack = blocksPerTrack;
+  this->numberOfTracks = max(1, (numberOfBlocks + blocksPerTrack - 1) / blocksPerTrack);
+  this->rotationNanoseconds = 60ULL * 1000000000ULL / rpm;
+  this->minSeekNanoseconds = minSeekNanoseconds;
+  this->maxSeekNanoseconds = maxSeekNanoseconds;
+  this->headTrack = 0;
+}
+
+string HddLatencyModel::name() {
+  return "hdd";
+}
+
+uint64_t HddLatencyModel::cost(int op, const vector<int> &blockNumbers, uint64_t clock) {
+  if (op == DISK_OP_FSYNC) {
+    // Flushing the write cache costs about one revolution
+    return this->rotationNanoseconds;
+  }
+
+  uint64_t blockNanoseconds = this->rotationNanoseconds / this->blocksPerTrack;
+  uint64_t now = clock;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    int track = blockNumbers[idx] / this->blocksPerTrack;
+    int sector = blockNumbers[idx] % this->blocksPerTrack;
+
+    int distance = abs(track - this->headTrack);
+    if (distance > 0) {
+      double fraction = sqrt((double) distance / this->numberOfTracks);
+      now += this->minSeekNanoseconds + (uint64_t) ((this->maxSeekNanoseconds - this->minSeekNanoseconds) * fraction);
+      this->headTrack = track;
+    }
+
+    // Wait for the sector to come around under the head
+    uint64_t angle = now % this->rotationNanoseconds;
+    uint64_t target = sector * blockNanoseconds;
+    now += (target + this->rotationNanoseconds - angle) % this->rotationNanoseconds;
+    now += blockNanoseconds;
+  }
+  return now - clock;
+}
+
+SsdLatencyModel::SsdLatencyModel(int channels, uint64_t readNanoseconds, uint64_t writeNanoseconds,
+                                 uint64_t fsyncNanoseconds) {
+  this->channels = channels;
+  this->readNanoseconds = readNanoseconds;
+  this->writeNanoseconds = writeNanoseconds;
+  this->fsyncNanoseconds = fsyncNanoseconds;
+}
+
+string SsdLatencyModel::name() {
+  return "ssd";
+}
+
+uint64_t SsdLatencyModel::cost(int op, const vector<int> &blockNumbers, uint64_t clock) {
+  if (op == DISK_OP_FSYNC) {
+    return this->fsyncNanoseconds;
+  }
+
+  // Blocks are striped over the channels, so a batch takes as many rounds
+  // as the busiest channel has blocks
+  vector<int> perChannel(this->channels, 0);
+  int rounds = 0;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    int channel = blockNumbers[idx] % this->channels;
+    perChannel[channel]++;
+    rounds = max(rounds, perChannel[channel]);
+  }
+  uint64_t opNanoseconds = op == DISK_OP_WRITE ? this->writeNanoseconds : this->readNanoseconds;
+  return rounds * opNanoseconds;
+}
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdlib.h>
 #include <assert.h>
 
 #include "LocalFileSystem.h"
@@ -11,57 +16,2470 @@ using namespace std;
 
 LocalFileSystem::LocalFileSystem(Disk *disk) {
   this->disk = disk;
+  this->punchHoles = getenv("DS3_PUNCH_HOLES") != NULL;
+  this->cacheMetadata = getenv("DS3_METADATA_CACHE") != NULL;
+  this->inodeBitmapCache.loaded = false;
+  this->dataBitmapCache.loaded = false;
+  this->inodeTableCache.loaded = false;
+  this->directoryCache = NULL;
+  this->blockHashes = NULL;
+
+  // The super block never changes, so it is read once
+  unsigned char block[UFS_BLOCK_SIZE];
+  this->disk->readBlock(0, block);
+  memcpy(&this->cachedSuper, block, sizeof(super_t));
+  super_t super = this->cachedSuper;
+  this->version = UFS_VERSION(&super);
+  this->inlineData = (UFS_FEATURES(&super) & UFS_INLINE_DATA) != 0;
+
+  this->inodeLocks = new InodeLocks(super.num_inodes);
+  // Recursive, so a call can hold a region's lock from reading it to
+  // writing it back while the helpers it calls take the lock again
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&this->inodeBitmapLock, &attributes);
+  pthread_mutex_init(&this->dataBitmapLock, &attributes);
+  pthread_mutex_init(&this->inodeTableLock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+
+  // Let the disk attribute its I/O to the regions of this file system
+  this->inodeAllocator = new BitmapAllocator(super.num_inodes);
+  this->dataAllocator = new BitmapAllocator(super.num_data);
+  this->setNextFitAllocation(getenv("DS3_NEXT_FIT") != NULL);
+  this->extentAllocation = getenv("DS3_EXTENT_ALLOCATION") != NULL;
+  this->disk->stats()->setLayout(&super);
+
+  // Concurrent transactions merge their bitmap and inode table updates
+  // bit by bit, so changing different inodes in one block is no conflict
+  this->disk->setMergeable(super.inode_bitmap_addr, super.inode_bitmap_len);
+  this->disk->setMergeable(super.data_bitmap_addr, super.data_bitmap_len);
+  this->disk->setMergeable(super.inode_region_addr, super.inode_region_len);
 }
 
-void LocalFileSystem::readSuperBlock(super_t *super) {
+LocalFileSystem::~LocalFileSystem() {
+  delete this->directoryCache;
+  delete this->blockHashes;
+  delete this->inodeAllocator;
+  delete this->dataAllocator;
+  delete this->inodeLocks;
+  pthread_mutex_destroy(&this->inodeBitmapLock);
+  pthread_mutex_destroy(&this->dataBitmapLock);
+  pthread_mutex_destroy(&this->inodeTableLock);
+}
 
+void LocalFileSystem::readSuperBlock(super_t *super) {
+  if (this->cacheMetadata) {
+    *super = this->cachedSuper;
+    return;
+  }
+  unsigned char block[UFS_BLOCK_SIZE];
+  this->disk->readBlock(0, block);
+  memcpy(super, block, sizeof(super_t));
 }
 
 void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-
+  pthread_mutex_lock(&this->inodeBitmapLock);
+  if (this->loadRegion(&this->inodeBitmapCache, super->inode_bitmap_addr, super->inode_bitmap_len,
+                       this->inodeAllocator, true)) {
+    memcpy(inodeBitmap, this->inodeBitmapCache.data.data(), (super->num_inodes + 7) / 8);
+  } else {
+    this->readRegion(super->inode_bitmap_addr, super->inode_bitmap_len, inodeBitmap, (super->num_inodes + 7) / 8);
+  }
+  pthread_mutex_unlock(&this->inodeBitmapLock);
 }
 
 void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-
+  pthread_mutex_lock(&this->inodeBitmapLock);
+  if (this->loadRegion(&this->inodeBitmapCache, super->inode_bitmap_addr, super->inode_bitmap_len,
+                       this->inodeAllocator, false)) {
+    this->inodeAllocator->update(this->inodeBitmapCache.data.data(), inodeBitmap);
+    this->writeCachedRegion(super->inode_bitmap_addr, this->inodeBitmapCache.data, 0, inodeBitmap,
+                            (super->num_inodes + 7) / 8, sizeof(uint64_t));
+  } else {
+    this->writeRegion(super->inode_bitmap_addr, super->inode_bitmap_len, inodeBitmap, (super->num_inodes + 7) / 8);
+  }
+  pthread_mutex_unlock(&this->inodeBitmapLock);
 }
 
 void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
-
+  pthread_mutex_lock(&this->dataBitmapLock);
+  if (this->loadRegion(&this->dataBitmapCache, super->data_bitmap_addr, super->data_bitmap_len,
+                       this->dataAllocator, true)) {
+    memcpy(dataBitmap, this->dataBitmapCache.data.data(), (super->num_data + 7) / 8);
+  } else {
+    this->readRegion(super->data_bitmap_addr, super->data_bitmap_len, dataBitmap, (super->num_data + 7) / 8);
+  }
+  pthread_mutex_unlock(&this->dataBitmapLock);
 }
 
 void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
-
+  pthread_mutex_lock(&this->dataBitmapLock);
+  if (this->loadRegion(&this->dataBitmapCache, super->data_bitmap_addr, super->data_bitmap_len,
+                       this->dataAllocator, false)) {
+    this->dataAllocator->update(this->dataBitmapCache.data.data(), dataBitmap);
+    this->writeCachedRegion(super->data_bitmap_addr, this->dataBitmapCache.data, 0, dataBitmap,
+                            (super->num_data + 7) / 8, sizeof(uint64_t));
+  } else {
+    this->writeRegion(super->data_bitmap_addr, super->data_bitmap_len, dataBitmap, (super->num_data + 7) / 8);
+  }
+  pthread_mutex_unlock(&this->dataBitmapLock);
 }
 
 void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
-
+  pthread_mutex_lock(&this->inodeTableLock);
+  if (this->loadRegion(&this->inodeTableCache, super->inode_region_addr, super->inode_region_len, NULL, true)) {
+    memcpy(inodes, this->inodeTableCache.data.data(), super->num_inodes * sizeof(inode_t));
+  } else {
+    this->readRegion(super->inode_region_addr, super->inode_region_len, inodes, super->num_inodes * sizeof(inode_t));
+  }
+  pthread_mutex_unlock(&this->inodeTableLock);
 }
 
 void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
+  pthread_mutex_lock(&this->inodeTableLock);
+  if (this->loadRegion(&this->inodeTableCache, super->inode_region_addr, super->inode_region_len, NULL, false)) {
+    this->writeCachedRegion(super->inode_region_addr, this->inodeTableCache.data, 0, inodes,
+                            super->num_inodes * sizeof(inode_t), sizeof(inode_t));
+  } else {
+    this->writeRegion(super->inode_region_addr, super->inode_region_len, inodes, super->num_inodes * sizeof(inode_t));
+  }
+  pthread_mutex_unlock(&this->inodeTableLock);
+}
+
+// Single inodes. With the metadata cache these touch only the cached
+// inode and the block holding it, otherwise they go through the whole
+// bitmap and table like the calls above.
+bool LocalFileSystem::inodeAllocated(super_t *super, int inodeNumber) {
+  pthread_mutex_lock(&this->inodeBitmapLock);
+  bool allocated;
+  if (this->loadRegion(&this->inodeBitmapCache, super->inode_bitmap_addr, super->inode_bitmap_len,
+                       this->inodeAllocator, true)) {
+    allocated = testBit(this->inodeBitmapCache.data.data(), inodeNumber);
+  } else {
+    vector<unsigned char> inodeBitmap((super->num_inodes + 7) / 8);
+    this->readInodeBitmap(super, inodeBitmap.data());
+    allocated = testBit(inodeBitmap.data(), inodeNumber);
+  }
+  pthread_mutex_unlock(&this->inodeBitmapLock);
+  return allocated;
+}
+
+void LocalFileSystem::readInode(super_t *super, int inodeNumber, inode_t *inode) {
+  pthread_mutex_lock(&this->inodeTableLock);
+  if (this->loadRegion(&this->inodeTableCache, super->inode_region_addr, super->inode_region_len, NULL, true)) {
+    memcpy(inode, this->inodeTableCache.data.data() + (size_t) inodeNumber * sizeof(inode_t), sizeof(inode_t));
+  } else {
+    vector<inode_t> inodes(super->num_inodes);
+    this->readInodeRegion(super, inodes.data());
+    *inode = inodes[inodeNumber];
+  }
+  pthread_mutex_unlock(&this->inodeTableLock);
+}
+
+void LocalFileSystem::writeInode(super_t *super, int inodeNumber, const inode_t *inode) {
+  pthread_mutex_lock(&this->inodeTableLock);
+  if (this->loadRegion(&this->inodeTableCache, super->inode_region_addr, super->inode_region_len, NULL, true)) {
+    this->writeCachedRegion(super->inode_region_addr, this->inodeTableCache.data,
+                            (size_t) inodeNumber * sizeof(inode_t), inode, sizeof(inode_t), sizeof(inode_t));
+  } else {
+    vector<inode_t> inodes(super->num_inodes);
+    this->readInodeRegion(super, inodes.data());
+    inodes[inodeNumber] = *inode;
+    this->writeInodeRegion(super, inodes.data());
+  }
+  pthread_mutex_unlock(&this->inodeTableLock);
+}
+
+int LocalFileSystem::formatVersion() {
+  return this->version;
+}
+
+int LocalFileSystem::maxFileSize() {
+  return this->version >= 2 ? MAX_FILE_SIZE_V2 : MAX_FILE_SIZE;
+}
+
+int LocalFileSystem::freeInodes() {
+  super_t super;
+  this->readSuperBlock(&super);
+  int free = this->cachedFreeCount(&this->inodeBitmapCache, super.inode_bitmap_addr, super.inode_bitmap_len,
+                                   this->inodeAllocator, &this->inodeBitmapLock);
+  if (free < 0) {
+    vector<unsigned char> inodeBitmap((super.num_inodes + 7) / 8);
+    this->readInodeBitmap(&super, inodeBitmap.data());
+    free = BitmapAllocator::countFree(inodeBitmap.data(), super.num_inodes);
+  }
+  return free;
+}
+
+int LocalFileSystem::freeDataBlocks() {
+  super_t super;
+  this->readSuperBlock(&super);
+  int free = this->cachedFreeCount(&this->dataBitmapCache, super.data_bitmap_addr, super.data_bitmap_len,
+                                   this->dataAllocator, &this->dataBitmapLock);
+  if (free < 0) {
+    vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+    this->readDataBitmap(&super, dataBitmap.data());
+    free = BitmapAllocator::countFree(dataBitmap.data(), super.num_data);
+  }
+  return free;
+}
+
+int LocalFileSystem::blocksNeeded(int inodeNumber, int offset, int size) {
+  inode_t inode;
+  inode.type = UFS_REGULAR_FILE;
+  inode.size = 0;
+  if (inodeNumber >= 0 && (this->stat(inodeNumber, &inode) < 0 || inode.type != UFS_REGULAR_FILE)) {
+    return 0;
+  }
+  if (offset < 0) {
+    offset = inode.size;
+  }
+  if (size < 0 || offset > this->maxFileSize() - size) {
+    return 0;
+  }
+  int oldBlocks = this->dataBlocks(&inode);
+  inode.size = max(inode.size, offset + size);
+  int newBlocks = this->dataBlocks(&inode);
+  return max(0, newBlocks + this->indirectBlockCount(newBlocks) - oldBlocks - this->indirectBlockCount(oldBlocks));
+}
+
+void LocalFileSystem::fileBlocks(inode_t *inode, vector<int> &blockNumbers, vector<int> &indirectBlocks) {
+  int blocks = this->dataBlocks(inode);
+  this->mapBlocks(inode, 0, blocks, blockNumbers);
+  this->indirectBlocks(inode, blocks, indirectBlocks);
+}
+
+// Write back the inodes a call changed, leaving the rest of the table as
+// other calls have left it
+void LocalFileSystem::updateInodes(super_t *super, const map<int, inode_t> &inodes) {
+  pthread_mutex_lock(&this->inodeTableLock);
+  if (this->cacheMetadata) {
+    for (map<int, inode_t>::const_iterator iter = inodes.begin(); iter != inodes.end(); iter++) {
+      this->writeInode(super, iter->first, &iter->second);
+    }
+  } else {
+    vector<inode_t> current(super->num_inodes);
+    this->readInodeRegion(super, current.data());
+    for (map<int, inode_t>::const_iterator iter = inodes.begin(); iter != inodes.end(); iter++) {
+      current[iter->first] = iter->second;
+    }
+    this->writeInodeRegion(super, current.data());
+  }
+  pthread_mutex_unlock(&this->inodeTableLock);
+}
+
+// Regions are contiguous, so each one is a single multi-block transfer.
+// Callers' buffers only cover the bytes in use, which can be smaller than
+// the region when the last block is partially filled.
+void LocalFileSystem::readRegion(int startBlock, int numBlocks, void *buffer, int size) {
+  if (size == numBlocks * UFS_BLOCK_SIZE) {
+    this->disk->readBlocks(startBlock, numBlocks, buffer);
+    return;
+  }
+  vector<unsigned char> region(numBlocks * UFS_BLOCK_SIZE);
+  this->disk->readBlocks(startBlock, numBlocks, region.data());
+  memcpy(buffer, region.data(), size);
+}
 
+void LocalFileSystem::writeRegion(int startBlock, int numBlocks, const void *buffer, int size) {
+  if (size == numBlocks * UFS_BLOCK_SIZE) {
+    this->disk->writeBlocks(startBlock, numBlocks, (void *)buffer);
+    return;
+  }
+  vector<unsigned char> region(numBlocks * UFS_BLOCK_SIZE, 0);
+  memcpy(region.data(), buffer, size);
+  this->disk->writeBlocks(startBlock, numBlocks, region.data());
 }
 
 int LocalFileSystem::lookup(int parentInodeNumber, string name) {
-  return 0;
+  this->lockNamespace(false);
+  this->lockInode(parentInodeNumber, false);
+  int ret = this->lookupLocked(parentInodeNumber, name);
+  this->inodeLocks->unlock(parentInodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::lookupLocked(int parentInodeNumber, string name) {
+  inode_t parent;
+  if (this->stat(parentInodeNumber, &parent) < 0 || parent.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -ENOTFOUND;
+  }
+
+  DirectoryCache *cache = this->currentDirectoryCache();
+  int inodeNumber;
+  if (cache != NULL && cache->lookup(parentInodeNumber, name, &inodeNumber)) {
+    return inodeNumber >= 0 ? inodeNumber : -ENOTFOUND;
+  }
+
+  vector<dir_ent_t> entries;
+  this->readDirectory(&parent, entries);
+  int entry = this->findEntry(entries, name);
+  if (cache != NULL) {
+    cache->fill(parentInodeNumber, entries);
+    cache->insert(parentInodeNumber, name, entry < 0 ? -1 : entries[entry].inum);
+  }
+  if (entry < 0) {
+    return -ENOTFOUND;
+  }
+  return entries[entry].inum;
 }
 
 int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+  super_t super;
+  this->readSuperBlock(&super);
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+
+  if (!this->inodeAllocated(&super, inodeNumber)) {
+    return -EINVALIDINODE;
+  }
+  this->readInode(&super, inodeNumber, inode);
   return 0;
 }
 
 int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
-  return 0;
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, false);
+  int ret = this->readAtLocked(inodeNumber, 0, buffer, size);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::readdir(int inodeNumber, int *cursor, dir_ent_t *entries, int maxEntries) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, false);
+  int ret = this->readdirLocked(inodeNumber, cursor, entries, maxEntries);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::readdirLocked(int inodeNumber, int *cursor, dir_ent_t *entries, int maxEntries) {
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0 || inode.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  if (*cursor < 0 || maxEntries < 0) {
+    return -EINVALIDSIZE;
+  }
+
+  const int perBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int slots = inode.size / sizeof(dir_ent_t);
+  dir_ent_t block[perBlock];
+  int found = 0;
+  // Blocks after the cursor's that this call will likely read
+  this->prefetchFile(&inode, *cursor / perBlock + 1, maxEntries / perBlock);
+  while (found < maxEntries && *cursor < slots) {
+    // The rest of the block the cursor is in
+    int first = *cursor;
+    int end = min(slots, (first / perBlock + 1) * perBlock);
+    this->readData(&inode, first * sizeof(dir_ent_t), block, (end - first) * sizeof(dir_ent_t));
+    int idx = 0;
+    for (; idx < end - first && found < maxEntries; idx++) {
+      if (block[idx].inum != -1) {
+        entries[found++] = block[idx];
+      }
+    }
+    *cursor = first + idx;
+  }
+  return found;
+}
+
+int LocalFileSystem::readdirSorted(int inodeNumber, string after, string prefix,
+                                   vector<dir_ent_t> &entries, int maxEntries) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, false);
+  int ret = this->readdirSortedLocked(inodeNumber, after, prefix, entries, maxEntries);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::readdirSortedLocked(int inodeNumber, string after, string prefix,
+                                         vector<dir_ent_t> &entries, int maxEntries) {
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0 || inode.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  if (maxEntries < 0) {
+    return -EINVALIDSIZE;
+  }
+
+  entries.clear();
+  DirectoryCache *cache = this->currentDirectoryCache();
+  if (cache != NULL && cache->list(inodeNumber, after, prefix, maxEntries, entries)) {
+    return entries.size();
+  }
+
+  vector<dir_ent_t> all;
+  this->readDirectory(&inode, all);
+  if (cache != NULL) {
+    cache->fill(inodeNumber, all);
+    if (cache->list(inodeNumber, after, prefix, maxEntries, entries)) {
+      return entries.size();
+    }
+  }
+
+  // Too big for the cache, or no cache
+  for (size_t idx = 0; idx < all.size(); idx++) {
+    string name(all[idx].name, strnlen(all[idx].name, DIR_ENT_NAME_SIZE));
+    if (all[idx].inum != -1 && name > after && name.compare(0, prefix.length(), prefix) == 0) {
+      entries.push_back(all[idx]);
+    }
+  }
+  sort(entries.begin(), entries.end(), compareEntries);
+  if ((int) entries.size() > maxEntries) {
+    entries.resize(maxEntries);
+  }
+  return entries.size();
 }
 
 int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
-  return 0;
+  this->lockNamespace(false);
+
+  // Creating a name that exists, like every directory on the way to a new
+  // file, only needs to look, so it can share the parent
+  this->lockInode(parentInodeNumber, false);
+  int existing = this->lookupLocked(parentInodeNumber, name);
+  inode_t inode;
+  if (existing >= 0 && this->stat(existing, &inode) == 0) {
+    this->inodeLocks->unlock(parentInodeNumber);
+    this->inodeLocks->unlockNamespace();
+    return inode.type == type ? existing : -EINVALIDTYPE;
+  }
+  this->inodeLocks->unlock(parentInodeNumber);
+
+  this->lockInode(parentInodeNumber, true);
+  int ret = this->createLocked(parentInodeNumber, type, name);
+  this->inodeLocks->unlock(parentInodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::createLocked(int parentInodeNumber, int type, string name) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t parent;
+  if (this->stat(parentInodeNumber, &parent) < 0 || parent.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+  if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+
+  vector<dir_ent_t> entries;
+  this->readDirectory(&parent, entries);
+  int existing = this->findEntry(entries, name);
+  if (existing >= 0) {
+    inode_t inode;
+    if (this->stat(entries[existing].inum, &inode) < 0) {
+      return -EINVALIDINODE;
+    }
+    return inode.type == type ? entries[existing].inum : -EINVALIDTYPE;
+  }
+
+  // The free counts turn away a create that can't fit without reading
+  // the bitmaps
+  if (this->cachedFreeCount(&this->inodeBitmapCache, super.inode_bitmap_addr, super.inode_bitmap_len,
+                            this->inodeAllocator, &this->inodeBitmapLock) == 0 ||
+      (type == UFS_DIRECTORY && this->cachedFreeCount(&this->dataBitmapCache, super.data_bitmap_addr,
+                                                      super.data_bitmap_len, this->dataAllocator,
+                                                      &this->dataBitmapLock) == 0)) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  // Allocate everything in memory first so that running out of space
+  // leaves the disk untouched
+  pthread_mutex_lock(&this->inodeBitmapLock);
+  pthread_mutex_lock(&this->dataBitmapLock);
+  vector<unsigned char> inodeBitmap((super.num_inodes + 7) / 8);
+  vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+  this->readInodeBitmap(&super, inodeBitmap.data());
+  this->readDataBitmap(&super, dataBitmap.data());
+
+  int inodeNumber = this->inodeAllocator->allocate(inodeBitmap.data());
+  int directoryBlock = -1;
+  if (inodeNumber >= 0 && type == UFS_DIRECTORY) {
+    int freeBlock = this->allocateDirectoryBlock(&super, &parent, dataBitmap.data());
+    directoryBlock = freeBlock < 0 ? -1 : super.data_region_addr + freeBlock;
+  }
+  bool newParentBlock = false;
+  int slot = -ENOTENOUGHSPACE;
+  if (inodeNumber >= 0 && (type != UFS_DIRECTORY || directoryBlock >= 0)) {
+    slot = this->reserveEntry(&super, &parent, entries, dataBitmap.data(), &newParentBlock);
+  }
+  if (slot >= 0) {
+    this->writeInodeBitmap(&super, inodeBitmap.data());
+    this->writeDataBitmap(&super, dataBitmap.data());
+  }
+  pthread_mutex_unlock(&this->dataBitmapLock);
+  pthread_mutex_unlock(&this->inodeBitmapLock);
+  if (slot < 0) {
+    return slot;
+  }
+
+  inode_t inode;
+  inode.type = type;
+  inode.size = 0;
+  this->clearPointers(&inode, 0);
+
+  if (type == UFS_DIRECTORY) {
+    dir_ent_t block[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+    initDirectoryBlock(block);
+    strcpy(block[0].name, ".");
+    block[0].inum = inodeNumber;
+    strcpy(block[1].name, "..");
+    block[1].inum = parentInodeNumber;
+    this->disk->writeBlock(directoryBlock, block);
+    inode.size = 2 * sizeof(dir_ent_t);
+    inode.direct[0] = directoryBlock;
+  }
+
+  this->writeEntry(&parent, slot, newParentBlock, name, inodeNumber);
+
+  map<int, inode_t> changed;
+  changed[parentInodeNumber] = parent;
+  changed[inodeNumber] = inode;
+  this->updateInodes(&super, changed);
+
+  DirectoryCache *cache = this->currentDirectoryCache();
+  if (cache != NULL) {
+    cache->insert(parentInodeNumber, name, inodeNumber);
+    if (type == UFS_DIRECTORY) {
+      // The inode number may have belonged to a directory that was removed
+      cache->invalidateDirectory(inodeNumber);
+      vector<dir_ent_t> newEntries(2);
+      strcpy(newEntries[0].name, ".");
+      newEntries[0].inum = inodeNumber;
+      strcpy(newEntries[1].name, "..");
+      newEntries[1].inum = parentInodeNumber;
+      cache->fill(inodeNumber, newEntries);
+    }
+  }
+  return inodeNumber;
 }
 
 int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, true);
+  int ret = this->writeLocked(inodeNumber, buffer, size);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::writeLocked(int inodeNumber, const void *buffer, int size) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (size < 0 || size > this->maxFileSize()) {
+    return -EINVALIDSIZE;
+  }
+
+  // Keep the blocks at the front of the file and grow or shrink the tail
+  int oldBlocks = this->dataBlocks(&inode);
+  int newBlocks = this->fitsInline(size) ? 0 : (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int oldSize = inode.size;
+  vector<int> released;
+  this->dropBlocks(&inode, oldBlocks, newBlocks, released);
+  if (this->isInline(&inode)) {
+    // The old contents are all being replaced
+    this->clearPointers(&inode, 0);
+    oldSize = 0;
+  }
+
+  int written = size;
+  if (this->fitsInline(size)) {
+    this->setInline(&inode, buffer, size);
+  } else {
+    // Out of space writes as much as fits. Only the blocks that change
+    // are written, and the old contents past the new end read back as
+    // zeros.
+    int blocks = this->allocateBlocks(&super, &inode, min(oldBlocks, newBlocks), newBlocks, false);
+    written = min(size, blocks * UFS_BLOCK_SIZE);
+    this->writeData(&inode, 0, buffer, written, min(oldSize, written));
+  }
+  inode.size = written;
+
+  map<int, inode_t> changed;
+  changed[inodeNumber] = inode;
+  this->updateInodes(&super, changed);
+  this->freeBlocks(&super, released);
+  return written;
+}
+
+int LocalFileSystem::readAt(int inodeNumber, int offset, void *buffer, int size) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, false);
+  int ret = this->readAtLocked(inodeNumber, offset, buffer, size);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::readAtLocked(int inodeNumber, int offset, void *buffer, int size) {
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (offset < 0 || size < 0) {
+    return -EINVALIDSIZE;
+  }
+
+  int bytes = max(0, min(size, inode.size - offset));
+  this->readData(&inode, offset, buffer, bytes);
+  // A sequential reader asks for a range as long as this one next
+  if (bytes > 0 && offset + bytes < inode.size) {
+    this->prefetchFile(&inode, (offset + bytes) / UFS_BLOCK_SIZE, (bytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+  }
+  return bytes;
+}
+
+int LocalFileSystem::writeAt(int inodeNumber, int offset, const void *buffer, int size) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, true);
+  int ret = this->writeRange(inodeNumber, offset, buffer, size, false);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::append(int inodeNumber, const void *buffer, int size) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, true);
+  inode_t inode;
+  int ret = -EINVALIDINODE;
+  if (this->stat(inodeNumber, &inode) == 0) {
+    ret = this->writeRange(inodeNumber, inode.size, buffer, size, false);
+  }
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::truncate(int inodeNumber, int size) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, true);
+  int ret = this->truncateLocked(inodeNumber, size);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::truncateLocked(int inodeNumber, int size) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (size < 0 || size > this->maxFileSize()) {
+    return -EINVALIDSIZE;
+  }
+  if (size > inode.size) {
+    // Growing zero fills, all or nothing
+    int ret = this->writeRange(inodeNumber, size, NULL, 0, true);
+    return ret < 0 ? ret : 0;
+  }
+
+  int oldBlocks = this->dataBlocks(&inode);
+  int newBlocks = this->fitsInline(size) ? 0 : (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  char contents[UFS_INLINE_SIZE];
+  if (this->fitsInline(size)) {
+    // What is left moves into the inode, or stays there
+    this->readData(&inode, 0, contents, size);
+  }
+  vector<int> released;
+  this->dropBlocks(&inode, oldBlocks, newBlocks, released);
+  if (this->fitsInline(size)) {
+    this->setInline(&inode, contents, size);
+  }
+  inode.size = size;
+
+  map<int, inode_t> changed;
+  changed[inodeNumber] = inode;
+  this->updateInodes(&super, changed);
+  this->freeBlocks(&super, released);
   return 0;
 }
 
 int LocalFileSystem::unlink(int parentInodeNumber, string name) {
+  this->lockNamespace(false);
+  this->lockInode(parentInodeNumber, true);
+  int ret = this->unlinkLocked(parentInodeNumber, name);
+  this->inodeLocks->unlock(parentInodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::unlinkLocked(int parentInodeNumber, string name) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t parent;
+  if (this->stat(parentInodeNumber, &parent) < 0 || parent.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  if (name == "." || name == "..") {
+    return -EUNLINKNOTALLOWED;
+  }
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+
+  vector<dir_ent_t> entries;
+  this->readDirectory(&parent, entries);
+  int slot = this->findEntry(entries, name);
+  if (slot < 0) {
+    return 0;
+  }
+
+  int inodeNumber = entries[slot].inum;
+  this->lockInode(inodeNumber, true);
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    this->inodeLocks->unlock(inodeNumber);
+    return -EINVALIDINODE;
+  }
+  if (inode.type == UFS_DIRECTORY) {
+    vector<dir_ent_t> children;
+    this->readDirectory(&inode, children);
+    for (size_t idx = 0; idx < children.size(); idx++) {
+      if (children[idx].inum != -1 && strcmp(children[idx].name, ".") != 0 &&
+          strcmp(children[idx].name, "..") != 0) {
+        this->inodeLocks->unlock(inodeNumber);
+        return -EDIRNOTEMPTY;
+      }
+    }
+  }
+
+  // Leave a hole in the directory for the next create to reuse
+  this->writeEntry(&parent, slot, false, name, -1);
+
+  vector<int> released;
+  vector<int> indirectBlocks;
+  this->fileBlocks(&inode, released, indirectBlocks);
+  released.insert(released.end(), indirectBlocks.begin(), indirectBlocks.end());
+  pthread_mutex_lock(&this->inodeBitmapLock);
+  vector<unsigned char> inodeBitmap((super.num_inodes + 7) / 8);
+  this->readInodeBitmap(&super, inodeBitmap.data());
+  clearBit(inodeBitmap.data(), inodeNumber);
+  this->writeInodeBitmap(&super, inodeBitmap.data());
+  pthread_mutex_unlock(&this->inodeBitmapLock);
+  this->freeBlocks(&super, released);
+  this->inodeLocks->unlock(inodeNumber);
+
+  DirectoryCache *cache = this->currentDirectoryCache();
+  if (cache != NULL) {
+    cache->insert(parentInodeNumber, name, -1);
+    if (inode.type == UFS_DIRECTORY) {
+      cache->invalidateDirectory(inodeNumber);
+    }
+  }
+  return 0;
+}
+
+// What a batch has changed so far. A directory is read whole the first
+// time the batch touches it, and the blocks as read are kept so that the
+// unused slots past its end are written back unchanged.
+struct BatchDirectory {
+  vector<dir_ent_t> entries;
+  vector<dir_ent_t> blocks;
+  set<int> dirtyBlocks;
+};
+
+// New contents for a file. diskSize is what its blocks held before the
+// batch, 0 for a new file or one stored inline. The blocks are all of
+// the file's, as fileBlocks lists them, and only go in its inode at
+// commit.
+struct BatchFile {
+  const void *data;
+  int size;
+  int diskSize;
+  vector<int> blockNumbers;
+  vector<int> indirectBlocks;
+};
+
+struct BatchState {
+  super_t super;
+  vector<unsigned char> inodeBitmap;
+  vector<unsigned char> dataBitmap;
+  vector<inode_t> inodes;
+  map<int, BatchDirectory> directories;
+  map<int, BatchFile> files;
+  vector<int> removedDirectories;
+  vector<int> released;
+};
+
+int LocalFileSystem::batch(vector<BatchOperation> &operations) {
+  this->lockNamespace(true);
+  int ret = this->batchLocked(operations);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::batchLocked(vector<BatchOperation> &operations) {
+  BatchState state;
+  this->readSuperBlock(&state.super);
+  state.inodeBitmap.resize((state.super.num_inodes + 7) / 8);
+  state.dataBitmap.resize((state.super.num_data + 7) / 8);
+  state.inodes.resize(state.super.num_inodes);
+  this->readInodeBitmap(&state.super, state.inodeBitmap.data());
+  this->readDataBitmap(&state.super, state.dataBitmap.data());
+  this->readInodeRegion(&state.super, state.inodes.data());
+
+  for (size_t idx = 0; idx < operations.size(); idx++) {
+    BatchOperation *operation = &operations[idx];
+    int parentInodeNumber = operation->parentInodeNumber;
+    if (operation->parentOperation >= 0) {
+      if (operation->parentOperation >= (int) idx || operations[operation->parentOperation].op != BATCH_CREATE) {
+        operation->result = -EINVALIDINODE;
+        return operation->result;
+      }
+      parentInodeNumber = operations[operation->parentOperation].result;
+    }
+
+    if (operation->op == BATCH_CREATE) {
+      operation->result = this->batchCreate(&state, parentInodeNumber, operation);
+    } else if (operation->op == BATCH_UNLINK) {
+      operation->result = this->batchUnlink(&state, parentInodeNumber, operation);
+    } else {
+      operation->result = -EINVALIDTYPE;
+    }
+    // Nothing has been written yet, so giving up leaves the disk as it was
+    if (operation->result < 0) {
+      return operation->result;
+    }
+  }
+
+  this->batchCommit(&state);
+  return 0;
+}
+
+int LocalFileSystem::batchCreate(BatchState *state, int parentInodeNumber, BatchOperation *operation) {
+  super_t *super = &state->super;
+  if (parentInodeNumber < 0 || parentInodeNumber >= super->num_inodes) {
+    return -EINVALIDINODE;
+  }
+  inode_t *parent = &state->inodes[parentInodeNumber];
+  if (!testBit(state->inodeBitmap.data(), parentInodeNumber) || parent->type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  string name = operation->name;
+  int type = operation->type;
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+  if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  BatchDirectory *directory = this->batchDirectory(state, parentInodeNumber);
+  int inodeNumber;
+  int existing = this->findEntry(directory->entries, name);
+  if (existing >= 0) {
+    inodeNumber = directory->entries[existing].inum;
+    if (state->inodes[inodeNumber].type != type) {
+      return -EINVALIDTYPE;
+    }
+  } else {
+    // Allocate in the same order as create
+    inodeNumber = this->inodeAllocator->allocate(state->inodeBitmap.data());
+    if (inodeNumber < 0) {
+      return -ENOTENOUGHSPACE;
+    }
+    int directoryBlock = -1;
+    if (type == UFS_DIRECTORY) {
+      int freeBlock = this->allocateDirectoryBlock(super, parent, state->dataBitmap.data());
+      if (freeBlock < 0) {
+        return -ENOTENOUGHSPACE;
+      }
+      directoryBlock = super->data_region_addr + freeBlock;
+    }
+    bool newParentBlock;
+    int slot = this->reserveEntry(super, parent, directory->entries, state->dataBitmap.data(), &newParentBlock);
+    if (slot < 0) {
+      return slot;
+    }
+    if (slot == (int) directory->entries.size()) {
+      directory->entries.resize(slot + 1);
+    }
+    dir_ent_t *entry = &directory->entries[slot];
+    memset(entry->name, 0, DIR_ENT_NAME_SIZE);
+    strcpy(entry->name, name.c_str());
+    entry->inum = inodeNumber;
+    directory->dirtyBlocks.insert(slot / entriesPerBlock);
+
+    inode_t *inode = &state->inodes[inodeNumber];
+    inode->type = type;
+    inode->size = 0;
+    this->clearPointers(inode, 0);
+    if (type == UFS_DIRECTORY) {
+      inode->size = 2 * sizeof(dir_ent_t);
+      inode->direct[0] = directoryBlock;
+      BatchDirectory *child = &state->directories[inodeNumber];
+      child->entries.assign(2, dir_ent_t());
+      child->blocks.clear();
+      child->dirtyBlocks.clear();
+      child->dirtyBlocks.insert(0);
+      strcpy(child->entries[0].name, ".");
+      child->entries[0].inum = inodeNumber;
+      strcpy(child->entries[1].name, "..");
+      child->entries[1].inum = parentInodeNumber;
+    }
+  }
+
+  if (type == UFS_REGULAR_FILE && operation->data != NULL) {
+    int ret = this->batchWrite(state, inodeNumber, operation->data, operation->size);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  return inodeNumber;
+}
+
+// Like write, but all or nothing and only in memory. The data itself is
+// written by batchCommit.
+int LocalFileSystem::batchWrite(BatchState *state, int inodeNumber, const void *data, int size) {
+  if (size < 0 || size > this->maxFileSize()) {
+    return -EINVALIDSIZE;
+  }
+  super_t *super = &state->super;
+  inode_t *inode = &state->inodes[inodeNumber];
+  BatchFile file;
+  map<int, BatchFile>::iterator iter = state->files.find(inodeNumber);
+  if (iter != state->files.end()) {
+    file = iter->second;
+  } else {
+    file.diskSize = this->isInline(inode) ? 0 : inode->size;
+    this->fileBlocks(inode, file.blockNumbers, file.indirectBlocks);
+  }
+  file.data = data;
+  file.size = size;
+
+  int oldBlocks = file.blockNumbers.size();
+  int newBlocks = this->fitsInline(size) ? 0 : (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int oldIndirect = file.indirectBlocks.size();
+  int newIndirect = this->indirectBlockCount(newBlocks);
+  for (int idx = newBlocks; idx < oldBlocks; idx++) {
+    clearBit(state->dataBitmap.data(), file.blockNumbers[idx] - super->data_region_addr);
+    this->dataAllocator->release(file.blockNumbers[idx] - super->data_region_addr);
+    state->released.push_back(file.blockNumbers[idx]);
+  }
+  for (int idx = newIndirect; idx < oldIndirect; idx++) {
+    clearBit(state->dataBitmap.data(), file.indirectBlocks[idx] - super->data_region_addr);
+    this->dataAllocator->release(file.indirectBlocks[idx] - super->data_region_addr);
+    state->released.push_back(file.indirectBlocks[idx]);
+  }
+  file.blockNumbers.resize(min(oldBlocks, newBlocks));
+  file.indirectBlocks.resize(min(oldIndirect, newIndirect));
+  if (oldBlocks < newBlocks) {
+    // The indirect blocks come after the data in the run
+    int wanted = newBlocks - oldBlocks + newIndirect - oldIndirect;
+    vector<int> freeBlocks;
+    int goal = oldBlocks > 0 ? file.blockNumbers.back() - super->data_region_addr + 1 : -1;
+    if (this->extentAllocation || this->usesExtents(inode)) {
+      this->dataAllocator->allocateRun(state->dataBitmap.data(), wanted, goal, freeBlocks);
+    } else {
+      this->dataAllocator->allocateN(state->dataBitmap.data(), wanted, freeBlocks);
+    }
+    if ((int) freeBlocks.size() < wanted) {
+      return -ENOTENOUGHSPACE;
+    }
+    if (this->usesExtents(inode) && extentsFit(countExtents(file.blockNumbers), goal, freeBlocks) < wanted) {
+      // Out of extents, so the whole file gets a new run and all of it is
+      // written
+      for (size_t idx = 0; idx < freeBlocks.size(); idx++) {
+        clearBit(state->dataBitmap.data(), freeBlocks[idx]);
+      }
+      for (size_t idx = 0; idx < file.blockNumbers.size(); idx++) {
+        clearBit(state->dataBitmap.data(), file.blockNumbers[idx] - super->data_region_addr);
+        this->dataAllocator->release(file.blockNumbers[idx] - super->data_region_addr);
+        state->released.push_back(file.blockNumbers[idx]);
+      }
+      file.blockNumbers.clear();
+      file.diskSize = 0;
+      oldBlocks = 0;
+      wanted = newBlocks;
+      freeBlocks.clear();
+      this->dataAllocator->allocateRun(state->dataBitmap.data(), wanted, -1, freeBlocks);
+      if ((int) freeBlocks.size() < wanted || extentsFit(0, -1, freeBlocks) < wanted) {
+        return -ENOTENOUGHSPACE;
+      }
+    }
+    for (int idx = 0; idx < wanted; idx++) {
+      if (idx < newBlocks - oldBlocks) {
+        file.blockNumbers.push_back(super->data_region_addr + freeBlocks[idx]);
+      } else {
+        file.indirectBlocks.push_back(super->data_region_addr + freeBlocks[idx]);
+      }
+    }
+  }
+  // Inline contents are not pointers, so batchCommit sets them all
+  this->clearPointers(inode, 0);
+  inode->size = size;
+
+  state->files[inodeNumber] = file;
+  return 0;
+}
+
+int LocalFileSystem::batchUnlink(BatchState *state, int parentInodeNumber, BatchOperation *operation) {
+  super_t *super = &state->super;
+  if (parentInodeNumber < 0 || parentInodeNumber >= super->num_inodes) {
+    return -EINVALIDINODE;
+  }
+  inode_t *parent = &state->inodes[parentInodeNumber];
+  if (!testBit(state->inodeBitmap.data(), parentInodeNumber) || parent->type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  string name = operation->name;
+  if (name == "." || name == "..") {
+    return -EUNLINKNOTALLOWED;
+  }
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  BatchDirectory *directory = this->batchDirectory(state, parentInodeNumber);
+  int slot = this->findEntry(directory->entries, name);
+  if (slot < 0) {
+    return 0;
+  }
+
+  int inodeNumber = directory->entries[slot].inum;
+  inode_t *inode = &state->inodes[inodeNumber];
+  if (inode->type == UFS_DIRECTORY) {
+    BatchDirectory *children = this->batchDirectory(state, inodeNumber);
+    for (size_t idx = 0; idx < children->entries.size(); idx++) {
+      if (children->entries[idx].inum != -1 && strcmp(children->entries[idx].name, ".") != 0 &&
+          strcmp(children->entries[idx].name, "..") != 0) {
+        return -EDIRNOTEMPTY;
+      }
+    }
+    state->directories.erase(inodeNumber);
+    state->removedDirectories.push_back(inodeNumber);
+  }
+
+  vector<int> blockNumbers;
+  vector<int> indirectBlocks;
+  map<int, BatchFile>::iterator file = state->files.find(inodeNumber);
+  if (file != state->files.end()) {
+    blockNumbers = file->second.blockNumbers;
+    indirectBlocks = file->second.indirectBlocks;
+  } else {
+    this->fileBlocks(inode, blockNumbers, indirectBlocks);
+  }
+  blockNumbers.insert(blockNumbers.end(), indirectBlocks.begin(), indirectBlocks.end());
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    clearBit(state->dataBitmap.data(), blockNumbers[idx] - super->data_region_addr);
+    this->dataAllocator->release(blockNumbers[idx] - super->data_region_addr);
+    state->released.push_back(blockNumbers[idx]);
+  }
+  clearBit(state->inodeBitmap.data(), inodeNumber);
+  this->inodeAllocator->release(inodeNumber);
+  state->files.erase(inodeNumber);
+
+  // Leave a hole in the directory for the next create to reuse
+  directory->entries[slot].inum = -1;
+  directory->dirtyBlocks.insert(slot / entriesPerBlock);
+  return 0;
+}
+
+// A directory as the batch has left it, read from disk the first time
+BatchDirectory *LocalFileSystem::batchDirectory(BatchState *state, int inodeNumber) {
+  map<int, BatchDirectory>::iterator iter = state->directories.find(inodeNumber);
+  if (iter != state->directories.end()) {
+    return &iter->second;
+  }
+  BatchDirectory *directory = &state->directories[inodeNumber];
+  inode_t *inode = &state->inodes[inodeNumber];
+  int blocks = (inode->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  directory->blocks.resize(blocks * (UFS_BLOCK_SIZE / sizeof(dir_ent_t)));
+  this->readData(inode, 0, directory->blocks.data(), blocks * UFS_BLOCK_SIZE);
+  directory->entries.assign(directory->blocks.begin(), directory->blocks.begin() + inode->size / sizeof(dir_ent_t));
+  return directory;
+}
+
+// Write out what a batch changed. Data for new files and every changed
+// directory block are submitted as one batch, which is in flight while
+// the inode table and bitmaps are written. Files that already had data
+// only rewrite the blocks that changed, but their indirect blocks are
+// written whole.
+void LocalFileSystem::batchCommit(BatchState *state) {
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  // Partial last blocks and directory blocks are put together here
+  size_t staged = 0;
+  for (map<int, BatchFile>::iterator iter = state->files.begin(); iter != state->files.end(); iter++) {
+    if (iter->second.diskSize == 0 && iter->second.size % UFS_BLOCK_SIZE != 0 && !this->fitsInline(iter->second.size)) {
+      staged++;
+    }
+  }
+  for (map<int, BatchDirectory>::iterator iter = state->directories.begin(); iter != state->directories.end(); iter++) {
+    staged += iter->second.dirtyBlocks.size();
+  }
+  vector<unsigned char> staging(staged * UFS_BLOCK_SIZE, 0);
+  unsigned char *next = staging.data();
+
+  vector<int> blockNumbers;
+  vector<struct iovec> iovecs;
+  for (map<int, BatchFile>::iterator iter = state->files.begin(); iter != state->files.end(); iter++) {
+    BatchFile *file = &iter->second;
+    inode_t *inode = &state->inodes[iter->first];
+    this->clearPointers(inode, 0);
+    if (this->isInline(inode)) {
+      this->setInline(inode, file->data, file->size);
+      continue;
+    }
+    this->setBlocks(inode, 0, file->blockNumbers, file->indirectBlocks);
+    if (file->diskSize > 0) {
+      this->writeData(inode, 0, file->data, file->size, min(file->diskSize, file->size));
+      continue;
+    }
+    const unsigned char *data = (const unsigned char *) file->data;
+    for (int offset = 0; offset < file->size; offset += UFS_BLOCK_SIZE) {
+      struct iovec iovec;
+      iovec.iov_len = UFS_BLOCK_SIZE;
+      if (file->size - offset >= UFS_BLOCK_SIZE) {
+        iovec.iov_base = (void *) (data + offset);
+      } else {
+        memcpy(next, data + offset, file->size - offset);
+        iovec.iov_base = next;
+        next += UFS_BLOCK_SIZE;
+      }
+      blockNumbers.push_back(file->blockNumbers[offset / UFS_BLOCK_SIZE]);
+      iovecs.push_back(iovec);
+      if (this->blockHashes != NULL) {
+        this->blockHashes->insert(blockNumbers.back(), BlockHashCache::hash(iovec.iov_base));
+      }
+    }
+  }
+
+  for (map<int, BatchDirectory>::iterator iter = state->directories.begin(); iter != state->directories.end(); iter++) {
+    BatchDirectory *directory = &iter->second;
+    inode_t *inode = &state->inodes[iter->first];
+    set<int>::iterator block;
+    for (block = directory->dirtyBlocks.begin(); block != directory->dirtyBlocks.end(); block++) {
+      dir_ent_t *entries = (dir_ent_t *) next;
+      int first = *block * entriesPerBlock;
+      if (first < (int) directory->blocks.size()) {
+        memcpy(entries, &directory->blocks[first], UFS_BLOCK_SIZE);
+      } else {
+        initDirectoryBlock(entries);
+      }
+      int count = min((int) directory->entries.size() - first, entriesPerBlock);
+      memcpy(entries, &directory->entries[first], count * sizeof(dir_ent_t));
+
+      struct iovec iovec;
+      iovec.iov_base = next;
+      iovec.iov_len = UFS_BLOCK_SIZE;
+      blockNumbers.push_back(inode->direct[*block]);
+      iovecs.push_back(iovec);
+      next += UFS_BLOCK_SIZE;
+    }
+  }
+  DiskBatch *batch = this->disk->submitWriteBlocksV(blockNumbers, iovecs.data());
+
+  this->writeInodeRegion(&state->super, state->inodes.data());
+  this->writeInodeBitmap(&state->super, state->inodeBitmap.data());
+  this->writeDataBitmap(&state->super, state->dataBitmap.data());
+  this->disk->complete(batch);
+
+  // A later operation may have reused a freed block
+  vector<int> released;
+  sort(state->released.begin(), state->released.end());
+  for (size_t idx = 0; idx < state->released.size(); idx++) {
+    int blockNumber = state->released[idx];
+    if ((idx == 0 || state->released[idx - 1] != blockNumber) &&
+        !testBit(state->dataBitmap.data(), blockNumber - state->super.data_region_addr)) {
+      released.push_back(blockNumber);
+    }
+  }
+  this->releaseBlocks(released);
+
+  DirectoryCache *cache = this->currentDirectoryCache();
+  if (cache != NULL) {
+    for (size_t idx = 0; idx < state->removedDirectories.size(); idx++) {
+      cache->invalidateDirectory(state->removedDirectories[idx]);
+    }
+    for (map<int, BatchDirectory>::iterator iter = state->directories.begin(); iter != state->directories.end(); iter++) {
+      if (!iter->second.dirtyBlocks.empty()) {
+        cache->invalidateDirectory(iter->first);
+        cache->fill(iter->first, iter->second.entries);
+      }
+    }
+  }
+}
+
+int LocalFileSystem::rename(int parentInodeNumber, string name, int newParentInodeNumber, string newName) {
+  this->lockNamespace(true);
+  int ret = this->renameLocked(parentInodeNumber, name, newParentInodeNumber, newName);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::renameLocked(int parentInodeNumber, string name, int newParentInodeNumber, string newName) {
+  super_t super;
+  this->readSuperBlock(&super);
+  if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes ||
+      newParentInodeNumber < 0 || newParentInodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+  // Both parents share one copy when they are the same directory
+  map<int, inode_t> changed;
+  if (this->stat(parentInodeNumber, &changed[parentInodeNumber]) < 0 ||
+      this->stat(newParentInodeNumber, &changed[newParentInodeNumber]) < 0) {
+    return -EINVALIDINODE;
+  }
+  inode_t *parent = &changed[parentInodeNumber];
+  inode_t *newParent = &changed[newParentInodeNumber];
+  if (parent->type != UFS_DIRECTORY || newParent->type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+  if (name == "." || name == ".." || newName == "." || newName == "..") {
+    return -EUNLINKNOTALLOWED;
+  }
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE ||
+      newName.empty() || newName.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+
+  vector<dir_ent_t> entries;
+  this->readDirectory(parent, entries);
+  int slot = this->findEntry(entries, name);
+  if (slot < 0) {
+    return -ENOTFOUND;
+  }
+  int inodeNumber = entries[slot].inum;
+  if (parentInodeNumber == newParentInodeNumber && name == newName) {
+    return 0;
+  }
+
+  vector<dir_ent_t> newEntries;
+  this->readDirectory(newParent, newEntries);
+  if (this->findEntry(newEntries, newName) >= 0) {
+    return -EINVALIDNAME;
+  }
+
+  // A directory can't move below itself
+  inode_t moved;
+  if (this->stat(inodeNumber, &moved) < 0) {
+    return -EINVALIDINODE;
+  }
+  inode_t *inode = &moved;
+  bool moveDirectory = inode->type == UFS_DIRECTORY && parentInodeNumber != newParentInodeNumber;
+  if (moveDirectory) {
+    int ancestor = newParentInodeNumber;
+    while (ancestor != UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+      if (ancestor == inodeNumber) {
+        return -EINVALIDNAME;
+      }
+      ancestor = this->lookupLocked(ancestor, "..");
+      if (ancestor < 0) {
+        return -EINVALIDINODE;
+      }
+    }
+  }
+
+  vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+  this->readDataBitmap(&super, dataBitmap.data());
+  bool newBlock;
+  int newSlot = this->reserveEntry(&super, newParent, newEntries, dataBitmap.data(), &newBlock);
+  if (newSlot < 0) {
+    return newSlot;
+  }
+  this->writeEntry(newParent, newSlot, newBlock, newName, inodeNumber);
+  // writeEntry reads the block back, so both entries may share it
+  this->writeEntry(parent, slot, false, name, -1);
+
+  if (moveDirectory) {
+    vector<dir_ent_t> children;
+    this->readDirectory(inode, children);
+    int dotDot = this->findEntry(children, "..");
+    if (dotDot >= 0) {
+      this->writeEntry(inode, dotDot, false, "..", newParentInodeNumber);
+    }
+  }
+
+  this->updateInodes(&super, changed);
+  if (newBlock) {
+    this->writeDataBitmap(&super, dataBitmap.data());
+  }
+
+  DirectoryCache *cache = this->currentDirectoryCache();
+  if (cache != NULL) {
+    cache->insert(parentInodeNumber, name, -1);
+    cache->insert(newParentInodeNumber, newName, inodeNumber);
+    if (moveDirectory) {
+      cache->insert(inodeNumber, "..", newParentInodeNumber);
+    }
+  }
+  return 0;
+}
+
+int LocalFileSystem::compactDirectory(int inodeNumber, DefragStats *stats) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, true);
+  int ret = this->compactDirectoryLocked(inodeNumber, stats);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::compactDirectoryLocked(int inodeNumber, DefragStats *stats) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_DIRECTORY) {
+    return -EINVALIDTYPE;
+  }
+  vector<dir_ent_t> entries;
+  this->readDirectory(&inode, entries);
+  vector<dir_ent_t> live;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    if (entries[idx].inum != -1) {
+      live.push_back(entries[idx]);
+    }
+  }
+  if (live.size() == entries.size()) {
+    return 0;
+  }
+
+  // Whole blocks are written, so the slots past the end are unused
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int oldBlocks = this->dataBlocks(&inode);
+  int newBlocks = (live.size() + entriesPerBlock - 1) / entriesPerBlock;
+  vector<dir_ent_t> blocks(newBlocks * entriesPerBlock);
+  for (int block = 0; block < newBlocks; block++) {
+    initDirectoryBlock(&blocks[block * entriesPerBlock]);
+  }
+  copy(live.begin(), live.end(), blocks.begin());
+  this->writeData(&inode, 0, blocks.data(), newBlocks * UFS_BLOCK_SIZE, inode.size);
+  vector<int> released;
+  this->dropBlocks(&inode, oldBlocks, newBlocks, released);
+  inode.size = live.size() * sizeof(dir_ent_t);
+  map<int, inode_t> changed;
+  changed[inodeNumber] = inode;
+  this->updateInodes(&super, changed);
+  this->freeBlocks(&super, released);
+
+  DirectoryCache *cache = this->currentDirectoryCache();
+  if (cache != NULL) {
+    cache->invalidateDirectory(inodeNumber);
+  }
+  stats->directoriesCompacted++;
+  stats->entriesRemoved += entries.size() - live.size();
+  stats->directoryBlocksFreed += released.size();
   return 0;
 }
 
+int LocalFileSystem::relocate(int inodeNumber, DefragStats *stats) {
+  this->lockNamespace(false);
+  this->lockInode(inodeNumber, true);
+  int ret = this->relocateLocked(inodeNumber, stats);
+  this->inodeLocks->unlock(inodeNumber);
+  this->inodeLocks->unlockNamespace();
+  return ret;
+}
+
+int LocalFileSystem::relocateLocked(int inodeNumber, DefragStats *stats) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  vector<int> blockNumbers;
+  vector<int> indirectBlocks;
+  this->fileBlocks(&inode, blockNumbers, indirectBlocks);
+  int extents = countExtents(blockNumbers);
+  if (extents <= 1) {
+    return 0;
+  }
+
+  // The new blocks come from the smallest free run that holds the whole
+  // file, indirect blocks after the data, and are only taken if they are
+  // in fewer runs than the old ones
+  int wanted = blockNumbers.size() + indirectBlocks.size();
+  pthread_mutex_lock(&this->dataBitmapLock);
+  vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+  this->readDataBitmap(&super, dataBitmap.data());
+  vector<int> freeBlocks;
+  this->dataAllocator->allocateRun(dataBitmap.data(), wanted, -1, freeBlocks);
+  vector<int> newBlocks;
+  vector<int> newIndirectBlocks;
+  for (size_t idx = 0; idx < freeBlocks.size(); idx++) {
+    if (idx < blockNumbers.size()) {
+      newBlocks.push_back(super.data_region_addr + freeBlocks[idx]);
+    } else {
+      newIndirectBlocks.push_back(super.data_region_addr + freeBlocks[idx]);
+    }
+  }
+  int newExtents = countExtents(newBlocks);
+  bool better = (int) freeBlocks.size() == wanted && newExtents < extents;
+  if (better) {
+    this->writeDataBitmap(&super, dataBitmap.data());
+  }
+  pthread_mutex_unlock(&this->dataBitmapLock);
+  if (!better) {
+    return 0;
+  }
+
+  this->copyBlocks(blockNumbers, newBlocks);
+  this->clearPointers(&inode, 0);
+  this->setBlocks(&inode, 0, newBlocks, newIndirectBlocks);
+  map<int, inode_t> changed;
+  changed[inodeNumber] = inode;
+  this->updateInodes(&super, changed);
+  blockNumbers.insert(blockNumbers.end(), indirectBlocks.begin(), indirectBlocks.end());
+  this->freeBlocks(&super, blockNumbers);
+  stats->filesRelocated++;
+  stats->extentsBefore += extents;
+  stats->extentsAfter += newExtents;
+  return 0;
+}
+
+// Copy the contents of each block in from to the block at the same index
+// of to, DEFRAG_COPY_BLOCKS at a time
+void LocalFileSystem::copyBlocks(const vector<int> &from, const vector<int> &to) {
+  vector<unsigned char> buffer(DEFRAG_COPY_BLOCKS * UFS_BLOCK_SIZE);
+  for (size_t first = 0; first < from.size(); first += DEFRAG_COPY_BLOCKS) {
+    size_t count = min(from.size() - first, (size_t) DEFRAG_COPY_BLOCKS);
+    vector<int> source(from.begin() + first, from.begin() + first + count);
+    vector<int> destination(to.begin() + first, to.begin() + first + count);
+    vector<struct iovec> iovecs(count);
+    for (size_t idx = 0; idx < count; idx++) {
+      iovecs[idx].iov_base = &buffer[idx * UFS_BLOCK_SIZE];
+      iovecs[idx].iov_len = UFS_BLOCK_SIZE;
+    }
+    this->disk->readBlocksV(source, iovecs.data());
+    this->disk->writeBlocksV(destination, iovecs.data());
+    if (this->blockHashes != NULL) {
+      for (size_t idx = 0; idx < count; idx++) {
+        this->blockHashes->insert(destination[idx], BlockHashCache::hash(iovecs[idx].iov_base));
+      }
+    }
+  }
+}
+
+int LocalFileSystem::defragment(int inodeNumber, DefragStats *stats) {
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  vector<int> pending(1, inodeNumber);
+  while (!pending.empty()) {
+    int next = pending.back();
+    pending.pop_back();
+    if (this->stat(next, &inode) < 0) {
+      // Removed since its directory was listed
+      continue;
+    }
+    bool isDirectory = inode.type == UFS_DIRECTORY;
+    for (int attempt = 0; attempt < DEFRAG_ATTEMPTS; attempt++) {
+      DefragStats step = { 0, 0, 0, 0, 0, 0 };
+      this->disk->beginTransaction();
+      int ret = isDirectory ? this->compactDirectory(next, &step) : this->relocate(next, &step);
+      if (ret < 0) {
+        // Replaced by something of the other type in the meantime
+        this->disk->rollback();
+        break;
+      }
+      if (this->disk->commit()) {
+        stats->directoriesCompacted += step.directoriesCompacted;
+        stats->entriesRemoved += step.entriesRemoved;
+        stats->directoryBlocksFreed += step.directoryBlocksFreed;
+        stats->filesRelocated += step.filesRelocated;
+        stats->extentsBefore += step.extentsBefore;
+        stats->extentsAfter += step.extentsAfter;
+        break;
+      }
+    }
+    if (!isDirectory) {
+      continue;
+    }
+
+    int cursor = 0;
+    dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+    int count;
+    while ((count = this->readdir(next, &cursor, entries, UFS_BLOCK_SIZE / sizeof(dir_ent_t))) > 0) {
+      for (int idx = 0; idx < count; idx++) {
+        if (strcmp(entries[idx].name, ".") != 0 && strcmp(entries[idx].name, "..") != 0) {
+          pending.push_back(entries[idx].inum);
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+void LocalFileSystem::setPunchHoles(bool punchHoles) {
+  this->punchHoles = punchHoles;
+}
+
+void LocalFileSystem::setMetadataCache(bool cacheMetadata) {
+  this->cacheMetadata = cacheMetadata;
+  this->inodeBitmapCache.loaded = false;
+  this->dataBitmapCache.loaded = false;
+  this->inodeTableCache.loaded = false;
+  // Without the cache nothing tells the allocators about bitmap writes
+  this->inodeAllocator->forget();
+  this->dataAllocator->forget();
+}
+
+void LocalFileSystem::setNextFitAllocation(bool nextFit) {
+  this->inodeAllocator->setNextFit(nextFit);
+  this->dataAllocator->setNextFit(nextFit);
+}
+
+void LocalFileSystem::setExtentAllocation(bool extentAllocation) {
+  this->extentAllocation = extentAllocation;
+}
+
+void LocalFileSystem::setDirectoryCache(size_t budgetBytes) {
+  delete this->directoryCache;
+  this->directoryCache = budgetBytes > 0 ? new DirectoryCache(budgetBytes) : NULL;
+  if (this->directoryCache != NULL) {
+    this->directoryCache->checkGeneration(this->disk->undoGeneration());
+  }
+}
+
+void LocalFileSystem::setBlockHashCache(size_t maxEntries) {
+  delete this->blockHashes;
+  this->blockHashes = maxEntries > 0 ? new BlockHashCache(maxEntries) : NULL;
+}
+
+DirectoryCacheStats LocalFileSystem::directoryCacheStats() {
+  DirectoryCacheStats stats;
+  memset(&stats, 0, sizeof(stats));
+  return this->directoryCache != NULL ? this->directoryCache->stats() : stats;
+}
+
+// The directory cache, emptied first if a rollback may have undone some
+// of the changes it has seen, or NULL when it is off
+DirectoryCache *LocalFileSystem::currentDirectoryCache() {
+  if (this->directoryCache == NULL) {
+    return NULL;
+  }
+  this->directoryCache->checkGeneration(this->disk->undoGeneration());
+  return this->directoryCache;
+}
+
+// Make sure a region is cached, reading it again when asked to if a
+// rollback may have changed it. The region's mutex must be held. Returns
+// false when caching is off.
+bool LocalFileSystem::loadRegion(CachedRegion *region, int startBlock, int numBlocks,
+                                 BitmapAllocator *allocator, bool reload) {
+  if (!this->cacheMetadata) {
+    return false;
+  }
+  uint64_t generation = this->disk->undoGeneration();
+  if (region->loaded && (!reload || generation == region->generation)) {
+    return true;
+  }
+
+  // Whole blocks, so write back never has to fill in a partial block
+  region->data.resize(numBlocks * UFS_BLOCK_SIZE);
+  this->disk->readBlocks(startBlock, numBlocks, region->data.data());
+  if (allocator != NULL) {
+    allocator->reset(region->data.data());
+  }
+  region->loaded = true;
+  region->generation = generation;
+  return true;
+}
+
+// Free entries in a bitmap from the count its allocator keeps, reloading
+// the bitmap after a rollback, or -1 without the metadata cache
+int LocalFileSystem::cachedFreeCount(CachedRegion *region, int startBlock, int numBlocks,
+                                     BitmapAllocator *allocator, pthread_mutex_t *lock) {
+  pthread_mutex_lock(lock);
+  int free = -1;
+  if (this->loadRegion(region, startBlock, numBlocks, allocator, true)) {
+    free = allocator->freeCount();
+  }
+  pthread_mutex_unlock(lock);
+  return free;
+}
+
+// Inode locks, waiting for them without holding on to blocks
+void LocalFileSystem::lockNamespace(bool exclusive) {
+  if (!this->inodeLocks->tryLockNamespace(exclusive)) {
+    this->abortBeforeWaiting();
+    this->inodeLocks->lockNamespace(exclusive);
+  }
+}
+
+void LocalFileSystem::lockInode(int inodeNumber, bool exclusive) {
+  if (!this->inodeLocks->tryLock(inodeNumber, exclusive)) {
+    this->abortBeforeWaiting();
+    this->inodeLocks->lock(inodeNumber, exclusive);
+  }
+}
+
+void LocalFileSystem::abortBeforeWaiting() {
+  Transaction *txn = this->disk->currentTransaction();
+  if (txn != NULL && !txn->writeSet.empty()) {
+    this->disk->abort();
+  }
+}
+
+// Give the file inode blocks to go after its first `blocks`, up to
+// newBlocks, along with the indirect blocks they need. Returns how many
+// blocks the file has now, fewer than newBlocks when the disk is full, in
+// which case allOrNothing takes none.
+int LocalFileSystem::allocateBlocks(super_t *super, inode_t *inode, int blocks, int newBlocks,
+                                    bool allOrNothing) {
+  if (blocks >= newBlocks) {
+    return blocks;
+  }
+  // Finding the last block may read an indirect block, so it is done
+  // before taking the bitmap's lock. Extent-mapped files always get runs.
+  bool runs = this->extentAllocation || this->usesExtents(inode);
+  int goal = -1;
+  if (runs && blocks > 0) {
+    // Grow the file in place if the blocks after it are free
+    vector<int> last;
+    this->mapBlocks(inode, blocks - 1, 1, last);
+    goal = last[0] - super->data_region_addr + 1;
+  }
+  int indirect = this->indirectBlockCount(newBlocks) - this->indirectBlockCount(blocks);
+
+  pthread_mutex_lock(&this->dataBitmapLock);
+  vector<unsigned char> dataBitmap((super->num_data + 7) / 8);
+  this->readDataBitmap(super, dataBitmap.data());
+  vector<int> freeBlocks;
+  if (runs) {
+    this->dataAllocator->allocateRun(dataBitmap.data(), newBlocks - blocks + indirect, goal, freeBlocks);
+  } else {
+    this->dataAllocator->allocateN(dataBitmap.data(), newBlocks - blocks + indirect, freeBlocks);
+  }
+  // Short of blocks, keep as many data blocks as there are indirect
+  // blocks for and give back the rest. Short of extents, move the file's
+  // last extents into one run with the new blocks, starting at its block
+  // first, and only give back blocks when no such run fits either.
+  int added = newBlocks - blocks;
+  int first = blocks;
+  if (this->usesExtents(inode)) {
+    int fit = extentsFit(this->extentCount(inode, blocks), goal, freeBlocks);
+    if (fit < added && fit < (int) freeBlocks.size()) {
+      for (size_t idx = 0; idx < freeBlocks.size(); idx++) {
+        clearBit(dataBitmap.data(), freeBlocks[idx]);
+      }
+      vector<int> run;
+      first = this->mergeExtents(super, inode, blocks, newBlocks, dataBitmap.data(), run);
+      if (first >= 0) {
+        freeBlocks = run;
+      } else {
+        first = blocks;
+        freeBlocks.clear();
+        this->dataAllocator->allocateRun(dataBitmap.data(), added, goal, freeBlocks);
+        fit = extentsFit(this->extentCount(inode, blocks), goal, freeBlocks);
+      }
+    }
+    if (first == blocks) {
+      added = min(added, fit);
+    }
+  }
+  // A merged run also holds the blocks that move
+  int moved = blocks - first;
+  indirect = this->indirectBlockCount(blocks + added) - this->indirectBlockCount(blocks);
+  while (added > 0 && moved + added + indirect > (int) freeBlocks.size()) {
+    added--;
+    indirect = this->indirectBlockCount(blocks + added) - this->indirectBlockCount(blocks);
+  }
+  if (allOrNothing && added < newBlocks - blocks) {
+    added = 0;
+    indirect = 0;
+  }
+  if (added == 0) {
+    moved = 0;
+  }
+  for (size_t idx = moved + added + indirect; idx < freeBlocks.size(); idx++) {
+    clearBit(dataBitmap.data(), freeBlocks[idx]);
+  }
+  freeBlocks.resize(moved + added + indirect);
+  if (!freeBlocks.empty()) {
+    this->writeDataBitmap(super, dataBitmap.data());
+  }
+  pthread_mutex_unlock(&this->dataBitmapLock);
+  if (freeBlocks.empty()) {
+    return blocks;
+  }
+
+  if (moved > 0) {
+    vector<int> run;
+    for (size_t idx = 0; idx < freeBlocks.size(); idx++) {
+      run.push_back(super->data_region_addr + freeBlocks[idx]);
+    }
+    vector<int> moved;
+    this->mapBlocks(inode, first, blocks - first, moved);
+    this->copyBlocks(moved, run);
+    this->clearPointers(inode, first);
+    this->setBlocks(inode, first, run, vector<int>());
+    this->freeBlocks(super, moved);
+    return newBlocks;
+  }
+
+  // The indirect blocks come after the data in the run
+  vector<int> blockNumbers;
+  vector<int> indirectBlocks;
+  this->indirectBlocks(inode, blocks, indirectBlocks);
+  for (size_t idx = 0; idx < freeBlocks.size(); idx++) {
+    if ((int) idx < added) {
+      blockNumbers.push_back(super->data_region_addr + freeBlocks[idx]);
+    } else {
+      indirectBlocks.push_back(super->data_region_addr + freeBlocks[idx]);
+    }
+  }
+  this->setBlocks(inode, blocks, blockNumbers, indirectBlocks);
+  return blocks + added;
+}
+
+// Clear the bits of data blocks nothing points at any more. They are
+// released first, as once their bits are clear another call can reuse
+// them.
+void LocalFileSystem::freeBlocks(super_t *super, const vector<int> &blockNumbers) {
+  if (blockNumbers.empty()) {
+    return;
+  }
+  this->releaseBlocks(blockNumbers);
+  pthread_mutex_lock(&this->dataBitmapLock);
+  vector<unsigned char> dataBitmap((super->num_data + 7) / 8);
+  this->readDataBitmap(super, dataBitmap.data());
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    clearBit(dataBitmap.data(), blockNumbers[idx] - super->data_region_addr);
+  }
+  this->writeDataBitmap(super, dataBitmap.data());
+  pthread_mutex_unlock(&this->dataBitmapLock);
+}
+
+// Regular files on version 3 images, directories keep direct pointers
+bool LocalFileSystem::usesExtents(inode_t *inode) {
+  return this->version >= 3 && inode->type == UFS_REGULAR_FILE;
+}
+
+// Regular files of up to UFS_INLINE_SIZE bytes live in their inode on
+// images with UFS_INLINE_DATA
+bool LocalFileSystem::fitsInline(int size) {
+  return this->inlineData && size <= UFS_INLINE_SIZE;
+}
+
+bool LocalFileSystem::isInline(inode_t *inode) {
+  return inode->type == UFS_REGULAR_FILE && this->fitsInline(inode->size);
+}
+
+// Data blocks a file has, none when it is inline
+int LocalFileSystem::dataBlocks(inode_t *inode) {
+  return this->isInline(inode) ? 0 : (inode->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+}
+
+// Store the contents of an inline file, zero filling the rest of the
+// pointers so the inode never holds stale bytes
+void LocalFileSystem::setInline(inode_t *inode, const void *data, int size) {
+  memset(inode->direct, 0, sizeof(inode->direct));
+  if (size > 0) {
+    memcpy(inode->direct, data, size);
+  }
+}
+
+// Pointers held in the inode itself
+int LocalFileSystem::directPointers() {
+  return this->version == 2 ? DIRECT_PTRS_V2 : DIRECT_PTRS;
+}
+
+// How many indirect blocks a file of `blocks` data blocks needs
+int LocalFileSystem::indirectBlockCount(int blocks) {
+  int beyond = blocks - this->directPointers();
+  if (this->version != 2 || beyond <= 0) {
+    return 0;
+  }
+  if (beyond <= UFS_PTRS_PER_BLOCK) {
+    return 1;
+  }
+  beyond -= UFS_PTRS_PER_BLOCK;
+  return 2 + (beyond + UFS_PTRS_PER_BLOCK - 1) / UFS_PTRS_PER_BLOCK;
+}
+
+// The disk blocks holding blocks first to first + count - 1 of a file.
+// Past the direct pointers they come from the indirect blocks covering
+// the range, which are read together.
+void LocalFileSystem::mapBlocks(inode_t *inode, int first, int count, vector<int> &blockNumbers) {
+  blockNumbers.resize(count);
+  if (this->usesExtents(inode)) {
+    extent_t *extents = (extent_t *) inode->direct;
+    int start = 0;
+    int idx = 0;
+    for (int extent = 0; extent < UFS_EXTENTS && idx < count; extent++) {
+      int length = extents[extent].length;
+      for (; idx < count && first + idx < start + length; idx++) {
+        blockNumbers[idx] = extents[extent].start + (first + idx - start);
+      }
+      start += length;
+    }
+    return;
+  }
+  int direct = this->directPointers();
+  int idx = 0;
+  for (; idx < count && first + idx < direct; idx++) {
+    blockNumbers[idx] = inode->direct[first + idx];
+  }
+  if (idx == count) {
+    return;
+  }
+
+  // Counting from the first block past the direct pointers, the pointer
+  // blocks read cover base onwards
+  int start = first + idx - direct;
+  int end = first + count - direct;
+  int base = 0;
+  vector<int> pointerBlocks;
+  if (start < UFS_PTRS_PER_BLOCK) {
+    pointerBlocks.push_back(inode->direct[INDIRECT_PTR]);
+  }
+  if (end > UFS_PTRS_PER_BLOCK) {
+    unsigned int root[UFS_PTRS_PER_BLOCK];
+    this->disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], root);
+    int from = max(start - UFS_PTRS_PER_BLOCK, 0) / UFS_PTRS_PER_BLOCK;
+    int to = (end - UFS_PTRS_PER_BLOCK - 1) / UFS_PTRS_PER_BLOCK;
+    if (pointerBlocks.empty()) {
+      base = UFS_PTRS_PER_BLOCK + from * UFS_PTRS_PER_BLOCK;
+    }
+    for (int slot = from; slot <= to; slot++) {
+      pointerBlocks.push_back(root[slot]);
+    }
+  }
+  vector<unsigned int> pointers(pointerBlocks.size() * UFS_PTRS_PER_BLOCK);
+  vector<struct iovec> iovecs(pointerBlocks.size());
+  for (size_t block = 0; block < pointerBlocks.size(); block++) {
+    iovecs[block].iov_base = &pointers[block * UFS_PTRS_PER_BLOCK];
+    iovecs[block].iov_len = UFS_BLOCK_SIZE;
+  }
+  this->disk->readBlocksV(pointerBlocks, iovecs.data());
+  for (; idx < count; idx++) {
+    blockNumbers[idx] = pointers[first + idx - direct - base];
+  }
+}
+
+// Have the disk read ahead count blocks of a file from block first, up
+// to PREFETCH_BLOCKS and the end of the file. Readahead only spots runs
+// of adjacent blocks, this follows the file's own order.
+void LocalFileSystem::prefetchFile(inode_t *inode, int first, int count) {
+  count = min(min(count, PREFETCH_BLOCKS), this->dataBlocks(inode) - first);
+  if (count <= 0) {
+    return;
+  }
+  vector<int> blockNumbers;
+  this->mapBlocks(inode, first, count, blockNumbers);
+  this->disk->prefetchBlocks(blockNumbers);
+}
+
+// The indirect blocks of a file of `blocks` data blocks, in the order
+// fileBlocks lists them
+void LocalFileSystem::indirectBlocks(inode_t *inode, int blocks, vector<int> &indirectBlocks) {
+  int count = this->indirectBlockCount(blocks);
+  indirectBlocks.clear();
+  if (count == 0) {
+    return;
+  }
+  indirectBlocks.push_back(inode->direct[INDIRECT_PTR]);
+  if (count == 1) {
+    return;
+  }
+  indirectBlocks.push_back(inode->direct[DOUBLE_INDIRECT_PTR]);
+  unsigned int root[UFS_PTRS_PER_BLOCK];
+  this->disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], root);
+  for (int slot = 0; slot < count - 2; slot++) {
+    indirectBlocks.push_back(root[slot]);
+  }
+}
+
+// Point the blocks of a file from first on at blockNumbers. The file's
+// indirect blocks afterwards are indirectBlocks, in the order fileBlocks
+// lists them. The ones a file of `first` blocks already had are read and
+// updated, the rest are new and written from scratch.
+void LocalFileSystem::setBlocks(inode_t *inode, int first, const vector<int> &blockNumbers,
+                                const vector<int> &indirectBlocks) {
+  if (this->usesExtents(inode)) {
+    // Blocks that carry on from the last extent lengthen it, the caller
+    // makes sure the rest fit
+    extent_t *extents = (extent_t *) inode->direct;
+    int extent = this->extentCount(inode, first);
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      if (extent > 0 && (int) (extents[extent - 1].start + extents[extent - 1].length) == blockNumbers[idx]) {
+        extents[extent - 1].length++;
+      } else {
+        extents[extent].start = blockNumbers[idx];
+        extents[extent].length = 1;
+        extent++;
+      }
+    }
+    return;
+  }
+  int direct = this->directPointers();
+  int existing = this->indirectBlockCount(first);
+  map<int, vector<unsigned int> > pointerBlocks;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    int logical = first + idx;
+    if (logical < direct) {
+      inode->direct[logical] = blockNumbers[idx];
+      continue;
+    }
+    logical -= direct;
+    if (logical < UFS_PTRS_PER_BLOCK) {
+      this->setPointer(pointerBlocks, indirectBlocks, existing, 0, logical, blockNumbers[idx]);
+      continue;
+    }
+    logical -= UFS_PTRS_PER_BLOCK;
+    int index = 2 + logical / UFS_PTRS_PER_BLOCK;
+    this->setPointer(pointerBlocks, indirectBlocks, existing, 1, index - 2, indirectBlocks[index]);
+    this->setPointer(pointerBlocks, indirectBlocks, existing, index, logical % UFS_PTRS_PER_BLOCK,
+                     blockNumbers[idx]);
+  }
+  if (indirectBlocks.size() > 0) {
+    inode->direct[INDIRECT_PTR] = indirectBlocks[0];
+  }
+  if (indirectBlocks.size() > 1) {
+    inode->direct[DOUBLE_INDIRECT_PTR] = indirectBlocks[1];
+  }
+
+  vector<int> writeNumbers;
+  vector<struct iovec> iovecs;
+  map<int, vector<unsigned int> >::iterator iter;
+  for (iter = pointerBlocks.begin(); iter != pointerBlocks.end(); iter++) {
+    struct iovec iovec;
+    iovec.iov_base = iter->second.data();
+    iovec.iov_len = UFS_BLOCK_SIZE;
+    writeNumbers.push_back(indirectBlocks[iter->first]);
+    iovecs.push_back(iovec);
+  }
+  if (!writeNumbers.empty()) {
+    this->disk->writeBlocksV(writeNumbers, iovecs.data());
+  }
+}
+
+// Set one pointer in the indirect block at index, reading the block the
+// first time if it is not new
+void LocalFileSystem::setPointer(map<int, vector<unsigned int> > &pointerBlocks, const vector<int> &indirectBlocks,
+                                 int existing, int index, int slot, int blockNumber) {
+  map<int, vector<unsigned int> >::iterator iter = pointerBlocks.find(index);
+  if (iter == pointerBlocks.end()) {
+    iter = pointerBlocks.insert(make_pair(index, vector<unsigned int>(UFS_PTRS_PER_BLOCK, (unsigned int) -1))).first;
+    if (index < existing) {
+      this->disk->readBlock(indirectBlocks[index], iter->second.data());
+    }
+  }
+  iter->second[slot] = blockNumber;
+}
+
+// Take the blocks of a file from newBlocks on out of its inode, adding
+// them to released along with the indirect blocks left pointing at none
+void LocalFileSystem::dropBlocks(inode_t *inode, int blocks, int newBlocks, vector<int> &released) {
+  if (newBlocks >= blocks) {
+    return;
+  }
+  vector<int> dropped;
+  this->mapBlocks(inode, newBlocks, blocks - newBlocks, dropped);
+  released.insert(released.end(), dropped.begin(), dropped.end());
+  vector<int> indirectBlocks;
+  this->indirectBlocks(inode, blocks, indirectBlocks);
+  released.insert(released.end(), indirectBlocks.begin() + this->indirectBlockCount(newBlocks),
+                  indirectBlocks.end());
+  this->clearPointers(inode, newBlocks);
+}
+
+// Reset the pointers in an inode that a file of `blocks` blocks doesn't
+// use. Indirect blocks keep whatever they held past the end.
+void LocalFileSystem::clearPointers(inode_t *inode, int blocks) {
+  if (this->usesExtents(inode)) {
+    extent_t *extents = (extent_t *) inode->direct;
+    int covered = 0;
+    for (int extent = 0; extent < UFS_EXTENTS; extent++) {
+      int length = covered < blocks ? min((int) extents[extent].length, blocks - covered) : 0;
+      if (length == 0) {
+        extents[extent].start = -1;
+      }
+      extents[extent].length = length;
+      covered += length;
+    }
+    return;
+  }
+  for (int idx = blocks; idx < this->directPointers(); idx++) {
+    inode->direct[idx] = -1;
+  }
+  if (this->version == 2) {
+    int count = this->indirectBlockCount(blocks);
+    if (count < 1) {
+      inode->direct[INDIRECT_PTR] = -1;
+    }
+    if (count < 2) {
+      inode->direct[DOUBLE_INDIRECT_PTR] = -1;
+    }
+  }
+}
+
+// How many extents hold the first `blocks` blocks of an extent-mapped file
+int LocalFileSystem::extentCount(inode_t *inode, int blocks) {
+  extent_t *extents = (extent_t *) inode->direct;
+  int covered = 0;
+  int extent = 0;
+  while (extent < UFS_EXTENTS && covered < blocks) {
+    covered += extents[extent++].length;
+  }
+  return extent;
+}
+
+// Runs of consecutive blocks in blockNumbers
+int LocalFileSystem::countExtents(const vector<int> &blockNumbers) {
+  int extents = 0;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (idx == 0 || blockNumbers[idx] != blockNumbers[idx - 1] + 1) {
+      extents++;
+    }
+  }
+  return extents;
+}
+
+// Take blocks for the last extents of an extent-mapped file of `blocks`
+// blocks together with its new blocks, up to newBlocks, as few extents as
+// possible from the end so that the file fits in UFS_EXTENTS extents
+// again. The blocks are set in dataBitmap and returned in run. Returns
+// the file block the run starts at, or -1 when no run fits.
+int LocalFileSystem::mergeExtents(super_t *super, inode_t *inode, int blocks, int newBlocks,
+                                  unsigned char *dataBitmap, vector<int> &run) {
+  extent_t *extents = (extent_t *) inode->direct;
+  int first = blocks;
+  for (int kept = this->extentCount(inode, blocks) - 1; kept >= 0; kept--) {
+    first -= extents[kept].length;
+    int goal = kept > 0 ? extents[kept - 1].start + extents[kept - 1].length - super->data_region_addr : -1;
+    run.clear();
+    this->dataAllocator->allocateRun(dataBitmap, newBlocks - first, goal, run);
+    if ((int) run.size() == newBlocks - first && extentsFit(kept, goal, run) == newBlocks - first) {
+      return first;
+    }
+    for (size_t idx = 0; idx < run.size(); idx++) {
+      clearBit(dataBitmap, run[idx]);
+    }
+  }
+  run.clear();
+  return -1;
+}
+
+// How many of freeBlocks, in order, an extent-mapped file with `extents`
+// extents can take before it runs out, when its next block would be goal
+int LocalFileSystem::extentsFit(int extents, int goal, const vector<int> &freeBlocks) {
+  for (size_t idx = 0; idx < freeBlocks.size(); idx++) {
+    int next = idx > 0 ? freeBlocks[idx - 1] + 1 : goal;
+    if (freeBlocks[idx] != next) {
+      if (extents == UFS_EXTENTS) {
+        return idx;
+      }
+      extents++;
+    }
+  }
+  return freeBlocks.size();
+}
+
+// Compare the new contents of the size bytes at first with the cache one
+// unit (a bitmap word or an inode) at a time and write back only the
+// blocks holding changed units
+void LocalFileSystem::writeCachedRegion(int startBlock, vector<unsigned char> &cache, size_t first,
+                                        const void *buffer, int size, int unitSize) {
+  const unsigned char *data = (const unsigned char *) buffer;
+  vector<int> dirtyBlocks;
+  for (int position = 0; position < size; position += unitSize) {
+    int length = min(unitSize, size - position);
+    size_t offset = first + position;
+    if (memcmp(cache.data() + offset, data + position, length) == 0) {
+      continue;
+    }
+    int blockNumber = startBlock + offset / UFS_BLOCK_SIZE;
+    if (dirtyBlocks.empty() || dirtyBlocks.back() != blockNumber) {
+      // The disk merges a transaction's writes against what it last read,
+      // but this read came from the cache
+      this->disk->setReadImage(blockNumber, cache.data() + (offset / UFS_BLOCK_SIZE) * UFS_BLOCK_SIZE);
+      dirtyBlocks.push_back(blockNumber);
+    }
+    memcpy(cache.data() + offset, data + position, length);
+  }
+
+  vector<struct iovec> iovecs(dirtyBlocks.size());
+  for (size_t idx = 0; idx < dirtyBlocks.size(); idx++) {
+    iovecs[idx].iov_base = cache.data() + (size_t) (dirtyBlocks[idx] - startBlock) * UFS_BLOCK_SIZE;
+    iovecs[idx].iov_len = UFS_BLOCK_SIZE;
+  }
+  this->disk->writeBlocksV(dirtyBlocks, iovecs.data());
+}
+
+// writeAt, append and growing truncate. Allocates blocks at the end of
+// the file as needed, only touches the blocks in the range and zero fills
+// any gap between the end of the file and offset. When the disk fills
+// up, writes what fits and returns the number of bytes from buffer
+// written, or with allOrNothing returns -ENOTENOUGHSPACE without
+// changing anything.
+int LocalFileSystem::writeRange(int inodeNumber, int offset, const void *buffer, int size, bool allOrNothing) {
+  super_t super;
+  this->readSuperBlock(&super);
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) < 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (offset < 0 || size < 0 || offset > this->maxFileSize() - size) {
+    return -EINVALIDSIZE;
+  }
+
+  int oldSize = inode.size;
+  int oldBlocks = this->dataBlocks(&inode);
+  int end = offset + size;
+  map<int, inode_t> changed;
+  if (this->fitsInline(max(oldSize, end))) {
+    char contents[UFS_INLINE_SIZE];
+    this->readData(&inode, 0, contents, oldSize);
+    memset(contents + oldSize, 0, max(offset - oldSize, 0));
+    if (size > 0) {
+      memcpy(contents + offset, buffer, size);
+    }
+    this->setInline(&inode, contents, max(oldSize, end));
+    inode.size = max(oldSize, end);
+    changed[inodeNumber] = inode;
+    this->updateInodes(&super, changed);
+    return size;
+  }
+
+  // A file that outgrows its inode moves its contents to its first block
+  vector<char> inlineContents;
+  if (this->isInline(&inode)) {
+    inlineContents.resize(oldSize);
+    this->readData(&inode, 0, inlineContents.data(), oldSize);
+    this->clearPointers(&inode, 0);
+  }
+  int newBlocks = max(oldBlocks, (end + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
+  if (allOrNothing) {
+    // Nothing is allocated when the free count already shows it can't fit
+    int free = this->cachedFreeCount(&this->dataBitmapCache, super.data_bitmap_addr, super.data_bitmap_len,
+                                     this->dataAllocator, &this->dataBitmapLock);
+    int needed = newBlocks + this->indirectBlockCount(newBlocks) - oldBlocks - this->indirectBlockCount(oldBlocks);
+    if (free >= 0 && needed > free) {
+      return -ENOTENOUGHSPACE;
+    }
+  }
+  int blocks = this->allocateBlocks(&super, &inode, oldBlocks, newBlocks, allOrNothing);
+  if (blocks < newBlocks && allOrNothing) {
+    return -ENOTENOUGHSPACE;
+  }
+  if (blocks == 0 && oldSize > 0) {
+    // Not even room to move, nothing changed
+    return 0;
+  }
+  if (!inlineContents.empty()) {
+    this->writeData(&inode, 0, inlineContents.data(), oldSize, 0);
+  }
+
+  // Out of space, the file may not even reach offset
+  end = min(end, blocks * UFS_BLOCK_SIZE);
+  int dataStart = min(offset, end);
+  this->writeData(&inode, dataStart, buffer, end - dataStart, oldSize);
+  inode.size = max(oldSize, end);
+
+  changed[inodeNumber] = inode;
+  this->updateInodes(&super, changed);
+  return max(0, end - offset);
+}
+
+// Read size bytes from offset, which must be inside the file. Whole
+// blocks go straight into buffer, the partial ones at either end through
+// a bounce buffer.
+void LocalFileSystem::readData(inode_t *inode, int offset, void *buffer, int size) {
+  if (size <= 0) {
+    return;
+  }
+  if (this->isInline(inode)) {
+    memcpy(buffer, (char *) inode->direct + offset, size);
+    return;
+  }
+  int end = offset + size;
+  int first = offset / UFS_BLOCK_SIZE;
+  int blocks = (end - 1) / UFS_BLOCK_SIZE - first + 1;
+  vector<int> blockNumbers;
+  this->mapBlocks(inode, first, blocks, blockNumbers);
+  vector<struct iovec> iovecs(blocks);
+  unsigned char edges[2][UFS_BLOCK_SIZE];
+  for (int idx = 0; idx < blocks; idx++) {
+    int blockStart = (first + idx) * UFS_BLOCK_SIZE;
+    iovecs[idx].iov_len = UFS_BLOCK_SIZE;
+    if (blockStart >= offset && blockStart + UFS_BLOCK_SIZE <= end) {
+      iovecs[idx].iov_base = (unsigned char *) buffer + (blockStart - offset);
+    } else {
+      iovecs[idx].iov_base = edges[idx == 0 ? 0 : 1];
+    }
+  }
+  this->disk->readBlocksV(blockNumbers, iovecs.data());
+
+  for (int idx = 0; idx < blocks; idx += max(1, blocks - 1)) {
+    int blockStart = (first + idx) * UFS_BLOCK_SIZE;
+    if (iovecs[idx].iov_base == edges[idx == 0 ? 0 : 1]) {
+      int from = max(blockStart, offset);
+      int to = min(blockStart + UFS_BLOCK_SIZE, end);
+      memcpy((unsigned char *) buffer + (from - offset), edges[idx == 0 ? 0 : 1] + (from - blockStart), to - from);
+    }
+  }
+}
+
+// Write size bytes at offset. The blocks must already be allocated.
+// Bytes between the old end of the file and offset become zeros, and so
+// does anything left in the last block past the old end, so the file
+// never shows stale data. Blocks the write only partly covers are read
+// first if they held file data.
+//
+// Blocks that held file data are only written if their contents change,
+// so rewriting a file with a small edit only writes the edited blocks.
+// A block hash that differs from the new contents marks a block as
+// changed without reading it, otherwise the block is read and compared.
+void LocalFileSystem::writeData(inode_t *inode, int offset, const void *buffer, int size, int oldSize) {
+  int start = min(offset, oldSize);
+  int end = offset + size;
+  if (end <= start) {
+    return;
+  }
+  int first = start / UFS_BLOCK_SIZE;
+  int blocks = (end - 1) / UFS_BLOCK_SIZE - first + 1;
+  int oldBlocks = (oldSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  vector<int> blockNumbers;
+  this->mapBlocks(inode, first, blocks, blockNumbers);
+  vector<struct iovec> iovecs(blocks);
+  vector<int> partial;
+  for (int idx = 0; idx < blocks; idx++) {
+    int blockStart = (first + idx) * UFS_BLOCK_SIZE;
+    iovecs[idx].iov_len = UFS_BLOCK_SIZE;
+    if (blockStart >= offset && blockStart + UFS_BLOCK_SIZE <= end) {
+      iovecs[idx].iov_base = (unsigned char *) buffer + (blockStart - offset);
+    } else {
+      partial.push_back(idx);
+    }
+  }
+
+  vector<unsigned char> bounce(partial.size() * UFS_BLOCK_SIZE, 0);
+  vector<int> readNumbers;
+  vector<struct iovec> readIovecs;
+  for (size_t idx = 0; idx < partial.size(); idx++) {
+    iovecs[partial[idx]].iov_base = bounce.data() + idx * UFS_BLOCK_SIZE;
+    if (first + partial[idx] < oldBlocks) {
+      readNumbers.push_back(blockNumbers[partial[idx]]);
+      readIovecs.push_back(iovecs[partial[idx]]);
+    }
+  }
+  if (!readNumbers.empty()) {
+    this->disk->readBlocksV(readNumbers, readIovecs.data());
+  }
+  // What the partial blocks held, they were just read
+  vector<unsigned char> before(bounce);
+
+  for (size_t idx = 0; idx < partial.size(); idx++) {
+    int blockStart = (first + partial[idx]) * UFS_BLOCK_SIZE;
+    unsigned char *block = bounce.data() + idx * UFS_BLOCK_SIZE;
+    if (oldSize < blockStart + UFS_BLOCK_SIZE) {
+      int from = max(oldSize - blockStart, 0);
+      memset(block + from, 0, UFS_BLOCK_SIZE - from);
+    }
+    int from = max(blockStart, offset);
+    int to = min(blockStart + UFS_BLOCK_SIZE, end);
+    if (to > from) {
+      memcpy(block + (from - blockStart), (const unsigned char *) buffer + (from - offset), to - from);
+    }
+  }
+
+  vector<bool> unchanged(blocks, false);
+  vector<uint64_t> hashes(blocks);
+  vector<int> compare;
+  size_t nextPartial = 0;
+  for (int idx = 0; idx < blocks; idx++) {
+    bool isPartial = nextPartial < partial.size() && partial[nextPartial] == idx;
+    if (isPartial) {
+      nextPartial++;
+    }
+    if (this->blockHashes != NULL) {
+      hashes[idx] = BlockHashCache::hash(iovecs[idx].iov_base);
+    }
+    if (first + idx >= oldBlocks) {
+      continue;
+    }
+    uint64_t oldHash;
+    if (isPartial) {
+      unchanged[idx] = memcmp(before.data() + (nextPartial - 1) * UFS_BLOCK_SIZE,
+                              iovecs[idx].iov_base, UFS_BLOCK_SIZE) == 0;
+    } else if (this->blockHashes == NULL || !this->blockHashes->lookup(blockNumbers[idx], &oldHash) ||
+               oldHash == hashes[idx]) {
+      compare.push_back(idx);
+    }
+  }
+
+  if (!compare.empty()) {
+    vector<unsigned char> current(compare.size() * UFS_BLOCK_SIZE);
+    vector<int> compareNumbers(compare.size());
+    vector<struct iovec> compareIovecs(compare.size());
+    for (size_t idx = 0; idx < compare.size(); idx++) {
+      compareNumbers[idx] = blockNumbers[compare[idx]];
+      compareIovecs[idx].iov_base = current.data() + idx * UFS_BLOCK_SIZE;
+      compareIovecs[idx].iov_len = UFS_BLOCK_SIZE;
+    }
+    this->disk->readBlocksV(compareNumbers, compareIovecs.data());
+    for (size_t idx = 0; idx < compare.size(); idx++) {
+      unchanged[compare[idx]] = memcmp(current.data() + idx * UFS_BLOCK_SIZE,
+                                       iovecs[compare[idx]].iov_base, UFS_BLOCK_SIZE) == 0;
+    }
+  }
+
+  vector<int> writeNumbers;
+  vector<struct iovec> writeIovecs;
+  vector<int> avoided;
+  for (int idx = 0; idx < blocks; idx++) {
+    if (unchanged[idx]) {
+      avoided.push_back(blockNumbers[idx]);
+    } else {
+      writeNumbers.push_back(blockNumbers[idx]);
+      writeIovecs.push_back(iovecs[idx]);
+    }
+    if (this->blockHashes != NULL) {
+      this->blockHashes->insert(blockNumbers[idx], hashes[idx]);
+    }
+  }
+  if (!writeNumbers.empty()) {
+    this->disk->writeBlocksV(writeNumbers, writeIovecs.data());
+  }
+  if (!avoided.empty()) {
+    this->disk->stats()->recordAvoided(avoided);
+  }
+}
+
+void LocalFileSystem::readDirectory(inode_t *inode, vector<dir_ent_t> &entries) {
+  entries.resize(inode->size / sizeof(dir_ent_t));
+  this->readData(inode, 0, entries.data(), entries.size() * sizeof(dir_ent_t));
+}
+
+// Index of the live entry called name, or -1
+int LocalFileSystem::findEntry(const vector<dir_ent_t> &entries, string name) {
+  if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -1;
+  }
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    if (entries[idx].inum != -1 && strncmp(entries[idx].name, name.c_str(), DIR_ENT_NAME_SIZE) == 0) {
+      return idx;
+    }
+  }
+  return -1;
+}
+
+// Data blocks a write or unlink gave back to the free list
+void LocalFileSystem::releaseBlocks(const vector<int> &blockNumbers) {
+  if (this->blockHashes != NULL) {
+    this->blockHashes->forget(blockNumbers);
+  }
+  if (this->punchHoles && !blockNumbers.empty()) {
+    this->disk->discardBlocks(blockNumbers);
+  }
+}
+
+bool LocalFileSystem::compareEntries(const dir_ent_t &first, const dir_ent_t &second) {
+  return strncmp(first.name, second.name, DIR_ENT_NAME_SIZE) < 0;
+}
+
+bool LocalFileSystem::testBit(const unsigned char *bitmap, int index) {
+  return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+void LocalFileSystem::clearBit(unsigned char *bitmap, int index) {
+  bitmap[index / 8] &= ~(1 << (index % 8));
+}
+
+// Find a slot for a new entry in a directory, reusing the first unused
+// entry or adding one at the end. Growing the directory only updates the
+// parent inode and data bitmap in memory, the caller writes them.
+int LocalFileSystem::reserveEntry(super_t *super, inode_t *parent, const vector<dir_ent_t> &entries,
+                                  unsigned char *dataBitmap, bool *newBlock) {
+  *newBlock = false;
+  int slot = 0;
+  while (slot < (int) entries.size() && entries[slot].inum != -1) {
+    slot++;
+  }
+  if (slot == (int) entries.size()) {
+    if (parent->size % UFS_BLOCK_SIZE == 0) {
+      if (parent->size / UFS_BLOCK_SIZE >= this->directPointers()) {
+        return -ENOTENOUGHSPACE;
+      }
+      int freeBlock = this->allocateDirectoryBlock(super, parent, dataBitmap);
+      if (freeBlock < 0) {
+        return -ENOTENOUGHSPACE;
+      }
+      parent->direct[parent->size / UFS_BLOCK_SIZE] = super->data_region_addr + freeBlock;
+      *newBlock = true;
+    }
+    parent->size += sizeof(dir_ent_t);
+  }
+  return slot;
+}
+
+// A data block for a new directory or for a directory that grows, next to
+// the last block of parent with extent allocation
+int LocalFileSystem::allocateDirectoryBlock(super_t *super, inode_t *parent, unsigned char *dataBitmap) {
+  if (!this->extentAllocation || parent->size == 0) {
+    return this->dataAllocator->allocate(dataBitmap);
+  }
+  int lastBlock = parent->direct[(parent->size - 1) / UFS_BLOCK_SIZE];
+  return this->dataAllocator->allocateNear(dataBitmap, lastBlock - super->data_region_addr + 1);
+}
+
+// Point one directory entry at inodeNumber, -1 leaves a hole. newBlock
+// starts the block from scratch instead of reading it.
+void LocalFileSystem::writeEntry(inode_t *directory, int slot, bool newBlock, string name, int inodeNumber) {
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int blockNumber = directory->direct[slot / entriesPerBlock];
+  dir_ent_t block[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+  if (newBlock) {
+    initDirectoryBlock(block);
+  } else {
+    this->disk->readBlock(blockNumber, block);
+  }
+  dir_ent_t *entry = &block[slot % entriesPerBlock];
+  if (inodeNumber >= 0) {
+    memset(entry->name, 0, DIR_ENT_NAME_SIZE);
+    strcpy(entry->name, name.c_str());
+  }
+  entry->inum = inodeNumber;
+  this->disk->writeBlock(blockNumber, block);
+}
+
+void LocalFileSystem::initDirectoryBlock(dir_ent_t *block) {
+  memset(block, 0, UFS_BLOCK_SIZE);
+  for (size_t idx = 0; idx < UFS_BLOCK_SIZE / sizeof(dir_ent_t); idx++) {
+    block[idx].inum = -1;
+  }
+}
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "PathCache.h"
+
+using namespace std;
+
+PathCache::PathCache(LocalFileSystem *fileSystem, size_t maxEntries) {
+  this->fileSystem = fileSystem;
+  this->maxEntries = maxEntries;
+  pthread_rwlock_init(&this->lock, NULL);
+  pthread_mutex_init(&this->statsLock, NULL);
+  this->generation = fileSystem->disk->undoGeneration();
+  this->version = 0;
+  memset(&this->counters, 0, sizeof(this->counters));
+}
+
+PathCache::~PathCache() {
+  pthread_mutex_destroy(&this->statsLock);
+  pthread_rwlock_destroy(&this->lock);
+}
+
+int PathCache::resolve(const vector<string> &path, size_t length) {
+  if (length == 0) {
+    pthread_mutex_lock(&this->statsLock);
+    this->counters.resolves++;
+    this->counters.hits++;
+    pthread_mutex_unlock(&this->statsLock);
+    return UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  }
+  this->checkGeneration();
+
+  vector<string> keys(length);
+  keys[0] = path[0];
+  for (size_t idx = 1; idx < length; idx++) {
+    keys[idx] = keys[idx - 1] + "/" + path[idx];
+  }
+
+  // Start from the longest prefix we already know
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  size_t cached = length;
+  pthread_rwlock_rdlock(&this->lock);
+  uint64_t version = this->version;
+  for (; cached > 0; cached--) {
+    map<string, Entry>::iterator iter = this->entries.find(keys[cached - 1]);
+    if (iter != this->entries.end()) {
+      inodeNumber = iter->second.inodeNumber;
+      __atomic_store_n(&iter->second.referenced, true, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&this->lock);
+
+  vector<int> found;
+  for (size_t idx = cached; idx < length && inodeNumber >= 0; idx++) {
+    inodeNumber = this->fileSystem->lookup(inodeNumber, path[idx]);
+    found.push_back(inodeNumber);
+  }
+
+  pthread_mutex_lock(&this->statsLock);
+  this->counters.resolves++;
+  if (cached == length) {
+    this->counters.hits++;
+  } else if (cached > 0) {
+    this->counters.partialHits++;
+  } else {
+    this->counters.misses++;
+  }
+  this->counters.lookups += found.size();
+  this->counters.lookupsAvoided += cached;
+  pthread_mutex_unlock(&this->statsLock);
+
+  if (inodeNumber < 0 || found.empty()) {
+    return inodeNumber;
+  }
+
+  // Anything invalidated while we were looking may be what we found
+  pthread_rwlock_wrlock(&this->lock);
+  if (version == this->version) {
+    for (size_t idx = 0; idx < found.size(); idx++) {
+      this->insertLocked(keys[cached + idx], found[idx]);
+    }
+  }
+  pthread_rwlock_unlock(&this->lock);
+  return inodeNumber;
+}
+
+void PathCache::insert(const vector<string> &path, size_t length, int inodeNumber) {
+  if (length == 0) {
+    return;
+  }
+  this->checkGeneration();
+  pthread_rwlock_wrlock(&this->lock);
+  this->insertLocked(PathCache::key(path, length), inodeNumber);
+  pthread_rwlock_unlock(&this->lock);
+}
+
+void PathCache::invalidate(const vector<string> &path, size_t length) {
+  string prefix = PathCache::key(path, length);
+  pthread_rwlock_wrlock(&this->lock);
+  if (length == 0) {
+    this->entries.clear();
+  } else {
+    // Children sort after prefix + "/", but other names can sort between
+    // prefix and its children so it is erased on its own
+    this->entries.erase(prefix);
+    prefix += "/";
+    map<string, Entry>::iterator iter = this->entries.lower_bound(prefix);
+    while (iter != this->entries.end() && iter->first.compare(0, prefix.length(), prefix) == 0) {
+      this->entries.erase(iter++);
+    }
+  }
+  this->version++;
+  pthread_rwlock_unlock(&this->lock);
+
+  pthread_mutex_lock(&this->statsLock);
+  this->counters.invalidations++;
+  pthread_mutex_unlock(&this->statsLock);
+}
+
+void PathCache::clear() {
+  pthread_rwlock_wrlock(&this->lock);
+  this->entries.clear();
+  this->version++;
+  pthread_rwlock_unlock(&this->lock);
+}
+
+PathCacheStats PathCache::stats() {
+  pthread_mutex_lock(&this->statsLock);
+  PathCacheStats result = this->counters;
+  pthread_mutex_unlock(&this->statsLock);
+
+  pthread_rwlock_rdlock(&this->lock);
+  result.entries = this->entries.size();
+  pthread_rwlock_unlock(&this->lock);
+  return result;
+}
+
+string PathCache::key(const vector<string> &path, size_t length) {
+  string result;
+  for (size_t idx = 0; idx < length; idx++) {
+    if (idx > 0) {
+      result += "/";
+    }
+    result += path[idx];
+  }
+  return result;
+}
+
+// Empty the cache if a rollback may have undone paths it holds
+void PathCache::checkGeneration() {
+  uint64_t generation = this->fileSystem->disk->undoGeneration();
+  pthread_rwlock_rdlock(&this->lock);
+  bool stale = generation != this->generation;
+  pthread_rwlock_unlock(&this->lock);
+  if (!stale) {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&this->lock);
+  if (generation != this->generation) {
+    this->entries.clear();
+    this->generation = generation;
+    this->version++;
+  }
+  pthread_rwlock_unlock(&this->lock);
+}
+
+// Called with lock held for writing
+void PathCache::insertLocked(const string &key, int inodeNumber) {
+  if (this->entries.find(key) == this->entries.end() && this->entries.size() >= this->maxEntries) {
+    this->evict();
+  }
+  Entry entry = { inodeNumber, false };
+  this->entries[key] = entry;
+}
+
+// Called with lock held for writing. Second chance: drop the entries
+// that weren't used since the last sweep, and if every entry was, drop
+// the first quarter.
+void PathCache::evict() {
+  size_t before = this->entries.size();
+  map<string, Entry>::iterator iter = this->entries.begin();
+  while (iter != this->entries.end()) {
+    if (iter->second.referenced) {
+      iter->second.referenced = false;
+      iter++;
+    } else {
+      this->entries.erase(iter++);
+    }
+  }
+  if (this->entries.size() < before) {
+    return;
+  }
+  iter = this->entries.begin();
+  while (iter != this->entries.end() && this->entries.size() > this->maxEntries * 3 / 4) {
+    this->entries.erase(iter++);
+  }
+}
@@ -0,0 +1,198 @@
+#include <iostream>
+#include <algorithm>
+
+#include <string.h>
+
+#include "Readahead.h"
+#include "Disk.h"
+
+using namespace std;
+
+#define READAHEAD_MIN_WINDOW (4)
+
+Readahead::Readahead(Disk *disk, int blockSize, int capacity) {
+  this->disk = disk;
+  this->blockSize = blockSize;
+  this->capacity = capacity;
+  pthread_mutex_init(&this->lock, NULL);
+
+  this->nextExpected = -1;
+  this->prefetchedUpTo = -1;
+  this->window = READAHEAD_MIN_WINDOW;
+  this->hitsInWindow = 0;
+  this->counters.prefetched = 0;
+  this->counters.hits = 0;
+  this->counters.wasted = 0;
+}
+
+Readahead::~Readahead() {
+  while (!this->fifo.empty()) {
+    this->evict(this->fifo.front());
+  }
+  pthread_mutex_destroy(&this->lock);
+}
+
+bool Readahead::lookup(int blockNumber, void *buffer) {
+  pthread_mutex_lock(&this->lock);
+  map<int, CachedBlock>::iterator iter = this->cache.find(blockNumber);
+  if (iter == this->cache.end()) {
+    pthread_mutex_unlock(&this->lock);
+    return false;
+  }
+  if (iter->second.batch != NULL) {
+    this->waitFor(iter->second.batch);
+  }
+  memcpy(buffer, iter->second.buffer, this->blockSize);
+
+  // A prefetched block is read once, so hand its buffer back right away
+  this->disk->freeBuffer(iter->second.buffer);
+  this->cache.erase(iter);
+  this->fifo.erase(find(this->fifo.begin(), this->fifo.end(), blockNumber));
+
+  this->counters.hits++;
+  this->hitsInWindow++;
+  if (this->hitsInWindow >= this->window) {
+    this->window = min(this->window * 2, this->capacity / 2);
+    this->hitsInWindow = 0;
+  }
+  pthread_mutex_unlock(&this->lock);
+  return true;
+}
+
+void Readahead::access(int startBlock, int count) {
+  pthread_mutex_lock(&this->lock);
+  int endBlock = startBlock + count;
+  if (startBlock == this->nextExpected) {
+    int from = max(endBlock, this->prefetchedUpTo);
+    int to = min(endBlock + this->window, this->disk->numberOfBlocks());
+    vector<int> blockNumbers;
+    for (int blockNumber = from; blockNumber < to; blockNumber++) {
+      blockNumbers.push_back(blockNumber);
+    }
+    this->prefetch(blockNumbers);
+    this->prefetchedUpTo = max(from, to);
+  } else {
+    this->prefetchedUpTo = endBlock;
+  }
+  this->nextExpected = endBlock;
+  pthread_mutex_unlock(&this->lock);
+}
+
+void Readahead::hint(const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->lock);
+  this->prefetch(blockNumbers);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void Readahead::invalidate(int blockNumber) {
+  pthread_mutex_lock(&this->lock);
+  if (this->cache.count(blockNumber) > 0) {
+    this->evict(blockNumber);
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void Readahead::beginWrite(const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->lock);
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (this->cache.count(blockNumbers[idx]) > 0) {
+      this->evict(blockNumbers[idx]);
+    }
+    this->writing[blockNumbers[idx]]++;
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void Readahead::endWrite(const vector<int> &blockNumbers) {
+  pthread_mutex_lock(&this->lock);
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    map<int, int>::iterator iter = this->writing.find(blockNumbers[idx]);
+    if (iter != this->writing.end() && --iter->second == 0) {
+      this->writing.erase(iter);
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+ReadaheadStats Readahead::stats() {
+  pthread_mutex_lock(&this->lock);
+  ReadaheadStats result = this->counters;
+  result.window = this->window;
+  pthread_mutex_unlock(&this->lock);
+  return result;
+}
+
+// Submit reads for the blocks that are not already cached as one batch.
+// Called with lock held.
+void Readahead::prefetch(const vector<int> &blockNumbers) {
+  vector<int> toRead;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    int blockNumber = blockNumbers[idx];
+    if (blockNumber >= 0 && blockNumber < this->disk->numberOfBlocks() &&
+        this->cache.count(blockNumber) == 0 && this->writing.count(blockNumber) == 0 &&
+        find(toRead.begin(), toRead.end(), blockNumber) == toRead.end()) {
+      toRead.push_back(blockNumber);
+    }
+  }
+  if (toRead.size() > (size_t) this->capacity) {
+    toRead.resize(this->capacity);
+  }
+  if (toRead.empty()) {
+    return;
+  }
+
+  // Making room throws away blocks nobody read, so read ahead less
+  bool evicted = false;
+  while (this->cache.size() + toRead.size() > (size_t) this->capacity) {
+    this->evict(this->fifo.front());
+    evicted = true;
+  }
+  if (evicted) {
+    this->window = max(this->window / 2, READAHEAD_MIN_WINDOW);
+    this->hitsInWindow = 0;
+  }
+
+  // The iovecs must outlive the batch, they are freed in waitFor()
+  vector<struct iovec> *iovecs = new vector<struct iovec>(toRead.size());
+  for (size_t idx = 0; idx < toRead.size(); idx++) {
+    (*iovecs)[idx].iov_base = this->disk->allocateBuffer();
+    (*iovecs)[idx].iov_len = this->blockSize;
+  }
+  DiskBatch *batch = this->disk->submitReadBlocksV(toRead, iovecs->data());
+  this->batchIovecs[batch] = iovecs;
+
+  for (size_t idx = 0; idx < toRead.size(); idx++) {
+    CachedBlock cachedBlock;
+    cachedBlock.buffer = (*iovecs)[idx].iov_base;
+    cachedBlock.batch = batch;
+    this->cache[toRead[idx]] = cachedBlock;
+    this->fifo.push_back(toRead[idx]);
+  }
+  this->counters.prefetched += toRead.size();
+}
+
+// Reap an in-flight prefetch batch and mark its blocks readable.
+// Called with lock held.
+void Readahead::waitFor(DiskBatch *batch) {
+  this->disk->complete(batch);
+  map<int, CachedBlock>::iterator iter;
+  for (iter = this->cache.begin(); iter != this->cache.end(); iter++) {
+    if (iter->second.batch == batch) {
+      iter->second.batch = NULL;
+    }
+  }
+  delete this->batchIovecs[batch];
+  this->batchIovecs.erase(batch);
+}
+
+// Drop a cached block that was never read. Called with lock held.
+void Readahead::evict(int blockNumber) {
+  map<int, CachedBlock>::iterator iter = this->cache.find(blockNumber);
+  if (iter->second.batch != NULL) {
+    this->waitFor(iter->second.batch);
+  }
+  this->disk->freeBuffer(iter->second.buffer);
+  this->cache.erase(iter);
+  this->fifo.erase(find(this->fifo.begin(), this->fifo.end(), blockNumber));
+  this->counters.wasted++;
+}
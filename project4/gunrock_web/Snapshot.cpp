@@ -0,0 +1,219 @@
+#include <iostream>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Snapshot.h"
+
+using namespace std;
+
+Snapshot::Snapshot(string deltaFile, int fd) {
+  this->fd = fd;
+  pthread_mutex_init(&this->lock, NULL);
+  if (pread(fd, &this->header, sizeof(this->header), 0) != sizeof(this->header) ||
+      this->header.version != SNAPSHOT_VERSION) {
+    cerr << "Could not read snapshot " << deltaFile << endl;
+    exit(1);
+  }
+
+  this->baseFd = open(this->header.baseImage, O_RDONLY);
+  if (this->baseFd < 0) {
+    cerr << "could not open " << this->header.baseImage << endl;
+    exit(1);
+  }
+
+  int bitsPerBlock = 8 * this->header.blockSize;
+  this->bitmapBlocks = (this->header.numberOfBlocks + bitsPerBlock - 1) / bitsPerBlock;
+  this->bitmap.resize((size_t) this->bitmapBlocks * this->header.blockSize);
+  off_t bitmapOffset = this->header.blockSize;
+  if (pread(fd, this->bitmap.data(), this->bitmap.size(), bitmapOffset) != (ssize_t) this->bitmap.size()) {
+    cerr << "Could not read snapshot " << deltaFile << endl;
+    exit(1);
+  }
+}
+
+Snapshot::~Snapshot() {
+  close(this->baseFd);
+  pthread_mutex_destroy(&this->lock);
+}
+
+bool Snapshot::isSnapshot(int fd) {
+  char magic[8];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+    memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+void Snapshot::create(string deltaFile, string baseImage, int blockSize) {
+  // The base path is stored absolute so the delta can be opened from anywhere
+  char basePath[PATH_MAX];
+  if (realpath(baseImage.c_str(), basePath) == NULL) {
+    cerr << "could not open " << baseImage << endl;
+    exit(1);
+  }
+
+  struct SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.blockSize = blockSize;
+  if (strlen(basePath) >= sizeof(header.baseImage)) {
+    cerr << "Base image path is too long" << endl;
+    exit(1);
+  }
+  strcpy(header.baseImage, basePath);
+
+  int baseFd = open(basePath, O_RDONLY);
+  off_t baseSize = baseFd < 0 ? -1 : lseek(baseFd, 0, SEEK_END);
+  if (baseFd < 0 || baseSize < 0 || baseSize % blockSize != 0 || Snapshot::isSnapshot(baseFd)) {
+    cerr << "Base image must be a disk image" << endl;
+    exit(1);
+  }
+  close(baseFd);
+  header.numberOfBlocks = baseSize / blockSize;
+
+  int fd = open(deltaFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    cerr << "Could not create " << deltaFile << endl;
+    exit(1);
+  }
+
+  // Header, an empty bitmap and a hole for every block
+  int bitsPerBlock = 8 * blockSize;
+  int bitmapBlocks = (header.numberOfBlocks + bitsPerBlock - 1) / bitsPerBlock;
+  off_t size = (off_t) (1 + bitmapBlocks + header.numberOfBlocks) * blockSize;
+  if (ftruncate(fd, size) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) != 0) {
+    cerr << "Could not write " << deltaFile << endl;
+    exit(1);
+  }
+  close(fd);
+}
+
+int Snapshot::numberOfBlocks() {
+  return this->header.numberOfBlocks;
+}
+
+string Snapshot::baseImage() {
+  return this->header.baseImage;
+}
+
+int Snapshot::changedBlocks() {
+  pthread_mutex_lock(&this->lock);
+  int changed = 0;
+  for (int blockNumber = 0; blockNumber < this->header.numberOfBlocks; blockNumber++) {
+    changed += this->isChanged(blockNumber);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return changed;
+}
+
+// Called with lock held
+bool Snapshot::isChanged(int blockNumber) {
+  return (this->bitmap[blockNumber / 8] >> (blockNumber % 8)) & 1;
+}
+
+void Snapshot::transferBlocksV(bool isWrite, const vector<int> &blockNumbers, struct iovec *iovecs) {
+  off_t dataOffset = (off_t) (1 + this->bitmapBlocks) * this->header.blockSize;
+
+  if (isWrite) {
+    // Data first, then the bitmap blocks that gained a bit, so a crash
+    // never marks a block whose contents aren't in the delta yet
+    vector<int> bitmapDirty(this->bitmapBlocks, 0);
+    pthread_mutex_lock(&this->lock);
+    size_t runStart = 0;
+    while (runStart < blockNumbers.size()) {
+      size_t runEnd = runStart + 1;
+      while (runEnd < blockNumbers.size() && blockNumbers[runEnd] == blockNumbers[runEnd - 1] + 1 &&
+             runEnd - runStart < IOV_MAX) {
+        runEnd++;
+      }
+      this->transfer(this->fd, true, dataOffset + (off_t) blockNumbers[runStart] * this->header.blockSize,
+                     iovecs + runStart, runEnd - runStart);
+      runStart = runEnd;
+    }
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      if (!this->isChanged(blockNumbers[idx])) {
+        this->bitmap[blockNumbers[idx] / 8] |= 1 << (blockNumbers[idx] % 8);
+        bitmapDirty[blockNumbers[idx] / (8 * this->header.blockSize)] = 1;
+      }
+    }
+    for (int idx = 0; idx < this->bitmapBlocks; idx++) {
+      if (bitmapDirty[idx]) {
+        struct iovec iov;
+        iov.iov_base = this->bitmap.data() + (size_t) idx * this->header.blockSize;
+        iov.iov_len = this->header.blockSize;
+        this->transfer(this->fd, true, (off_t) (1 + idx) * this->header.blockSize, &iov, 1);
+      }
+    }
+    pthread_mutex_unlock(&this->lock);
+    return;
+  }
+
+  // Runs of adjacent blocks that all come from the same file
+  pthread_mutex_lock(&this->lock);
+  size_t runStart = 0;
+  while (runStart < blockNumbers.size()) {
+    bool changed = this->isChanged(blockNumbers[runStart]);
+    size_t runEnd = runStart + 1;
+    while (runEnd < blockNumbers.size() && blockNumbers[runEnd] == blockNumbers[runEnd - 1] + 1 &&
+           this->isChanged(blockNumbers[runEnd]) == changed && runEnd - runStart < IOV_MAX) {
+      runEnd++;
+    }
+    off_t offset = (off_t) blockNumbers[runStart] * this->header.blockSize;
+    if (changed) {
+      this->transfer(this->fd, false, dataOffset + offset, iovecs + runStart, runEnd - runStart);
+    } else {
+      this->transfer(this->baseFd, false, offset, iovecs + runStart, runEnd - runStart);
+    }
+    runStart = runEnd;
+  }
+  pthread_mutex_unlock(&this->lock);
+}
+
+void Snapshot::sync() {
+  fsync(this->fd);
+}
+
+void Snapshot::merge() {
+  int baseFd = open(this->header.baseImage, O_RDWR);
+  if (baseFd < 0) {
+    cerr << "could not open " << this->header.baseImage << endl;
+    exit(1);
+  }
+
+  off_t dataOffset = (off_t) (1 + this->bitmapBlocks) * this->header.blockSize;
+  vector<unsigned char> block(this->header.blockSize);
+  struct iovec iov;
+  iov.iov_base = block.data();
+  iov.iov_len = this->header.blockSize;
+
+  pthread_mutex_lock(&this->lock);
+  for (int blockNumber = 0; blockNumber < this->header.numberOfBlocks; blockNumber++) {
+    if (this->isChanged(blockNumber)) {
+      off_t offset = (off_t) blockNumber * this->header.blockSize;
+      this->transfer(this->fd, false, dataOffset + offset, &iov, 1);
+      this->transfer(baseFd, true, offset, &iov, 1);
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+
+  if (fsync(baseFd) != 0) {
+    cerr << "Could not write file" << endl;
+    exit(1);
+  }
+  close(baseFd);
+}
+
+void Snapshot::transfer(int fd, bool isWrite, off_t offset, struct iovec *iovecs, int iovcnt) {
+  ssize_t expected = (ssize_t) iovcnt * this->header.blockSize;
+  ssize_t ret = isWrite ? pwritev(fd, iovecs, iovcnt, offset) : preadv(fd, iovecs, iovcnt, offset);
+  if (ret != expected) {
+    if (ret < 0) {
+      perror(isWrite ? "write::pwritev" : "read::preadv");
+    }
+    cerr << (isWrite ? "Could not write file" : "Could not read file") << endl;
+    exit(1);
+  }
+}
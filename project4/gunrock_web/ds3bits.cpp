@@ -1,7 +1,6 @@
 #include <iostream>
 #include <string>
-#include <algorithm>
-#include <cstring>
+#include <vector>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -9,18 +8,61 @@
 
 using namespace std;
 
+// Prints the super block and both bitmaps of a disk image. With
+// --summary it prints how many inodes and data blocks are free instead,
+// the counts the server checks writes against and returns for
+// GET /ds3/?stats=1.
+//
+//    $ ./ds3bits tests/disk_images/a.img
+//    $ ./ds3bits --summary tests/disk_images/a.img
+
+void printBitmap(const vector<unsigned char> &bitmap) {
+  for (size_t idx = 0; idx < bitmap.size(); idx++) {
+    cout << (unsigned int) bitmap[idx] << " ";
+  }
+  cout << endl;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    cerr << argv[0] << ": diskImageFile" << endl;
+  bool summary = argc == 3 && string(argv[1]) == "--summary";
+  if (argc != 2 && !summary) {
+    cerr << argv[0] << ": [--summary] diskImageFile" << endl;
     return 1;
   }
 
-  // Parse command line arguments
-  /*
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = new Disk(argv[argc - 1], UFS_BLOCK_SIZE);
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
-  */
-  
+  super_t super;
+  fileSystem->readSuperBlock(&super);
+
+  if (summary) {
+    cout << "inodes " << super.num_inodes << endl;
+    cout << "free inodes " << fileSystem->freeInodes() << endl;
+    cout << "data blocks " << super.num_data << endl;
+    cout << "free data blocks " << fileSystem->freeDataBlocks() << endl;
+  } else {
+    cout << "Super" << endl;
+    cout << "inode_region_addr " << super.inode_region_addr << endl;
+    cout << "inode_region_len " << super.inode_region_len << endl;
+    cout << "num_inodes " << super.num_inodes << endl;
+    cout << "data_region_addr " << super.data_region_addr << endl;
+    cout << "data_region_len " << super.data_region_len << endl;
+    cout << "num_data " << super.num_data << endl;
+    cout << endl;
+
+    vector<unsigned char> inodeBitmap((super.num_inodes + 7) / 8);
+    fileSystem->readInodeBitmap(&super, inodeBitmap.data());
+    cout << "Inode bitmap" << endl;
+    printBitmap(inodeBitmap);
+    cout << endl;
+
+    vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+    fileSystem->readDataBitmap(&super, dataBitmap.data());
+    cout << "Data bitmap" << endl;
+    printBitmap(dataBitmap);
+  }
+
+  delete fileSystem;
+  delete disk;
   return 0;
 }
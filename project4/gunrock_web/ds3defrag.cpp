@@ -0,0 +1,46 @@
+#include <iostream>
+#include <string>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Defragments a disk image, or the file or directory tree at one inode:
+// directories are compacted and fragmented files moved into contiguous
+// runs, each in a transaction of its own. The server does the same
+// online for POST /ds3/<path>?defrag=1. ds3frag shows the difference.
+//
+//    $ ./ds3defrag tests/disk_images/a.img
+//    $ ./ds3defrag tests/disk_images/a.img 2
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    cerr << argv[0] << ": diskImageFile [inodeNumber]" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  int inodeNumber = argc == 3 ? stoi(argv[2]) : UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  DefragStats stats = { 0, 0, 0, 0, 0, 0 };
+  int ret = 0;
+  if (fileSystem->defragment(inodeNumber, &stats) < 0) {
+    cerr << "Could not defragment inode " << inodeNumber << endl;
+    ret = 1;
+  } else {
+    cout << "directories compacted   " << stats.directoriesCompacted << endl;
+    cout << "entries removed         " << stats.entriesRemoved << endl;
+    cout << "directory blocks freed  " << stats.directoryBlocksFreed << endl;
+    cout << "files relocated         " << stats.filesRelocated << endl;
+    cout << "extents before          " << stats.extentsBefore << endl;
+    cout << "extents after           " << stats.extentsAfter << endl;
+  }
+
+  delete fileSystem;
+  delete disk;
+  return ret;
+}
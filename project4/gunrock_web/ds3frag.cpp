@@ -0,0 +1,109 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BitmapAllocator.h"
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Reports how many extents, runs of consecutive data blocks, files and
+// directories are split into, and how fragmented the free space is. Use
+// it to compare allocation policies, e.g. by copying the same files into
+// images with and without DS3_EXTENT_ALLOCATION set.
+
+struct FragStats {
+  int inodes;
+  int blocks;
+  int extents;
+  int singleExtent;
+};
+
+void printStats(string name, FragStats *stats) {
+  cout << name << endl;
+  cout << "  with data      " << stats->inodes << endl;
+  cout << "  blocks         " << stats->blocks << endl;
+  cout << "  extents        " << stats->extents << endl;
+  if (stats->inodes > 0) {
+    cout << "  extents each   " << fixed << setprecision(2) << (double) stats->extents / stats->inodes << endl;
+    cout << "  one extent     " << fixed << setprecision(1) << 100.0 * stats->singleExtent / stats->inodes << "%" << endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cerr << argv[0] << ": diskImageFile" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  super_t super;
+  fileSystem->readSuperBlock(&super);
+  vector<unsigned char> inodeBitmap((super.num_inodes + 7) / 8);
+  vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+  vector<inode_t> inodes(super.num_inodes);
+  fileSystem->readInodeBitmap(&super, inodeBitmap.data());
+  fileSystem->readDataBitmap(&super, dataBitmap.data());
+  fileSystem->readInodeRegion(&super, inodes.data());
+
+  FragStats files = { 0, 0, 0, 0 };
+  FragStats directories = { 0, 0, 0, 0 };
+  for (int inodeNumber = 0; inodeNumber < super.num_inodes; inodeNumber++) {
+    if (!((inodeBitmap[inodeNumber / 8] >> (inodeNumber % 8)) & 1)) {
+      continue;
+    }
+    inode_t *inode = &inodes[inodeNumber];
+    if (inode->size <= 0 || inode->size > fileSystem->maxFileSize()) {
+      continue;
+    }
+    // Indirect blocks don't hold file data, so they don't break extents
+    vector<int> blockNumbers;
+    vector<int> indirectBlocks;
+    fileSystem->fileBlocks(inode, blockNumbers, indirectBlocks);
+    int blocks = blockNumbers.size();
+    if (blocks == 0) {
+      // Stored inline
+      continue;
+    }
+    int extents = 1;
+    for (int idx = 1; idx < blocks; idx++) {
+      if (blockNumbers[idx] != blockNumbers[idx - 1] + 1) {
+        extents++;
+      }
+    }
+
+    FragStats *stats = inode->type == UFS_DIRECTORY ? &directories : &files;
+    stats->inodes++;
+    stats->blocks += blocks;
+    stats->extents += extents;
+    if (extents == 1) {
+      stats->singleExtent++;
+    }
+  }
+
+  printStats("files", &files);
+  printStats("directories", &directories);
+
+  BitmapAllocator allocator(super.num_data);
+  vector<pair<int, int> > runs;
+  allocator.freeRuns(dataBitmap.data(), runs);
+  int freeBlocks = 0;
+  int largest = 0;
+  for (size_t idx = 0; idx < runs.size(); idx++) {
+    freeBlocks += runs[idx].second;
+    largest = max(largest, runs[idx].second);
+  }
+  cout << "free space" << endl;
+  cout << "  blocks         " << freeBlocks << endl;
+  cout << "  runs           " << runs.size() << endl;
+  cout << "  largest run    " << largest << endl;
+
+  delete fileSystem;
+  delete disk;
+  return 0;
+}
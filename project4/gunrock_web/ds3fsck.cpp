@@ -0,0 +1,685 @@
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Checks a disk image after a crash: the super block, that every
+// allocated inode is a file or directory whose blocks are all in the data
+// region, that the directories form one tree from the root with the
+// right . and .. entries, and that the bitmaps mark exactly the inodes
+// and blocks of that tree. With -r what it can fix is fixed in one
+// transaction: bad entries are removed, intact inodes in the tree are
+// marked, inodes outside the tree are freed and the bitmaps rewritten.
+// A damaged super block or root and blocks used by two files are only
+// reported.
+//
+// The inode table is checked by several threads, each taking
+// FSCK_CHUNK inodes at a time, and the tree is walked a level at a time
+// with the directories of each level shared between them. The bitmaps
+// are compared a 64-bit word at a time.
+//
+//    $ ./ds3fsck tests/disk_images/a.img
+//    $ ./ds3fsck -r -j 8 crashed.img
+
+#define FSCK_CHUNK (4096)
+#define ENTRIES_PER_BLOCK (UFS_BLOCK_SIZE / (int) sizeof(dir_ent_t))
+
+// A directory as read from disk, whole blocks, and the blocks a repair
+// has to write back
+struct FsckDirectory {
+  vector<int> blockNumbers;
+  vector<dir_ent_t> entries;
+  int count;
+  set<int> dirtyBlocks;
+};
+
+// A directory entry naming a file or directory other than . and ..
+struct FsckName {
+  int child;
+  int parent;
+  int slot;
+};
+
+// The blocks of one inode, in the checking thread's list of blocks
+struct FsckBlocks {
+  int inodeNumber;
+  int first;
+  int count;
+};
+
+struct FsckState;
+
+struct FsckWorker {
+  FsckState *state;
+  vector<pair<int, string> > problems;
+  vector<FsckBlocks> owned;
+  vector<int> blocks;
+  map<int, FsckDirectory> directories;
+  vector<FsckName> names;
+  vector<int> nextLevel;
+  // Blocks of the tree this worker found, and the ones it found twice
+  vector<unsigned char> used;
+  vector<unsigned char> duplicates;
+};
+
+struct FsckState {
+  Disk *disk;
+  LocalFileSystem *fileSystem;
+  super_t super;
+  vector<unsigned char> inodeBitmap;
+  vector<unsigned char> dataBitmap;
+  vector<inode_t> inodes;
+  // Allocated and well formed
+  vector<char> valid;
+  vector<char> reached;
+  // Has a name in some directory, reached or not
+  vector<char> named;
+  map<int, FsckDirectory> directories;
+  vector<FsckDirectory *> directoryList;
+  vector<int> directoryNumbers;
+  vector<int> level;
+  // Next inode, directory or level entry for a thread to take
+  int next;
+};
+
+bool testBit(const unsigned char *bitmap, int index) {
+  return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+void setBit(unsigned char *bitmap, int index) {
+  bitmap[index / 8] |= 1 << (index % 8);
+}
+
+uint64_t loadWord(const vector<unsigned char> &bitmap, size_t word) {
+  uint64_t value = 0;
+  memcpy(&value, &bitmap[word * 8], min((size_t) 8, bitmap.size() - word * 8));
+  return value;
+}
+
+void storeWord(vector<unsigned char> &bitmap, size_t word, uint64_t value) {
+  memcpy(&bitmap[word * 8], &value, min((size_t) 8, bitmap.size() - word * 8));
+}
+
+string inodeName(int inodeNumber) {
+  return "inode " + to_string(inodeNumber);
+}
+
+// Run routine on threads workers at once
+void runWorkers(vector<FsckWorker> &workers, void *(*routine)(void *)) {
+  workers[0].state->next = 0;
+  vector<pthread_t> threads(workers.size());
+  for (size_t idx = 0; idx < workers.size(); idx++) {
+    pthread_create(&threads[idx], NULL, routine, &workers[idx]);
+  }
+  for (size_t idx = 0; idx < workers.size(); idx++) {
+    pthread_join(threads[idx], NULL);
+  }
+}
+
+// Take the next count items of total, returning the first or -1
+int takeWork(FsckState *state, int count, int total) {
+  int first = __atomic_fetch_add(&state->next, count, __ATOMIC_RELAXED);
+  return first < total ? first : -1;
+}
+
+// Whether the layout in the super block fits together and fits the disk
+string checkSuperBlock(super_t *super, int diskBlocks) {
+  if (super->num_inodes <= 0 || super->num_data <= 0) {
+    return "no inodes or no data blocks";
+  }
+  if (super->inode_bitmap_addr < 1 || super->inode_bitmap_len < 1 ||
+      super->data_bitmap_addr < super->inode_bitmap_addr + super->inode_bitmap_len || super->data_bitmap_len < 1 ||
+      super->inode_region_addr < super->data_bitmap_addr + super->data_bitmap_len || super->inode_region_len < 1 ||
+      super->data_region_addr < super->inode_region_addr + super->inode_region_len ||
+      super->data_region_len < super->num_data || super->data_region_addr > diskBlocks - super->data_region_len) {
+    return "regions overlap or run past the end of the disk";
+  }
+  if ((long) super->inode_bitmap_len * UFS_BLOCK_SIZE * 8 < super->num_inodes ||
+      (long) super->data_bitmap_len * UFS_BLOCK_SIZE * 8 < super->num_data ||
+      (long) super->inode_region_len * (long) (UFS_BLOCK_SIZE / sizeof(inode_t)) < super->num_inodes) {
+    return "a bitmap or the inode table is too small";
+  }
+  if (super->magic == UFS_MAGIC && (super->version < 1 || super->version > 3 ||
+                                    (super->features & ~UFS_INLINE_DATA) != 0)) {
+    return "unknown format version or features";
+  }
+  return "";
+}
+
+bool inDataRegion(super_t *super, unsigned int blockNumber) {
+  return blockNumber >= (unsigned int) super->data_region_addr &&
+         blockNumber < (unsigned int) (super->data_region_addr + super->num_data);
+}
+
+// fileBlocks reads the indirect blocks of a version 2 file, so they are
+// checked first
+bool checkIndirectBlocks(FsckState *state, inode_t *inode, int blocks) {
+  if (UFS_VERSION(&state->super) != 2 || inode->type != UFS_REGULAR_FILE || blocks <= DIRECT_PTRS_V2) {
+    return true;
+  }
+  if (!inDataRegion(&state->super, inode->direct[INDIRECT_PTR])) {
+    return false;
+  }
+  int beyond = blocks - DIRECT_PTRS_V2 - UFS_PTRS_PER_BLOCK;
+  if (beyond <= 0) {
+    return true;
+  }
+  if (!inDataRegion(&state->super, inode->direct[DOUBLE_INDIRECT_PTR])) {
+    return false;
+  }
+  unsigned int root[UFS_PTRS_PER_BLOCK];
+  state->disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], root);
+  for (int slot = 0; slot < (beyond + UFS_PTRS_PER_BLOCK - 1) / UFS_PTRS_PER_BLOCK; slot++) {
+    if (!inDataRegion(&state->super, root[slot])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Why an allocated inode is not a well formed file or directory, or ""
+string checkInode(FsckState *state, inode_t *inode, vector<int> &blockNumbers) {
+  int version = UFS_VERSION(&state->super);
+  if (inode->type != UFS_DIRECTORY && inode->type != UFS_REGULAR_FILE) {
+    return "has an unknown type";
+  }
+  if (inode->size < 0 || inode->size > state->fileSystem->maxFileSize()) {
+    return "has a bad size";
+  }
+  int blocks = (inode->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  if (inode->type == UFS_DIRECTORY &&
+      (inode->size % sizeof(dir_ent_t) != 0 || inode->size < 2 * (int) sizeof(dir_ent_t) ||
+       blocks > (version == 2 ? DIRECT_PTRS_V2 : DIRECT_PTRS))) {
+    return "is a directory with a bad size";
+  }
+  if (!checkIndirectBlocks(state, inode, blocks)) {
+    return "has an indirect block outside the data region";
+  }
+  vector<int> indirectBlocks;
+  state->fileSystem->fileBlocks(inode, blockNumbers, indirectBlocks);
+  blockNumbers.insert(blockNumbers.end(), indirectBlocks.begin(), indirectBlocks.end());
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    if (!inDataRegion(&state->super, blockNumbers[idx])) {
+      return "has a block outside the data region";
+    }
+  }
+  return "";
+}
+
+// Record a well formed inode and its blocks, and read it if it is a
+// directory
+void addInode(FsckWorker *worker, int inodeNumber, const vector<int> &blockNumbers) {
+  FsckState *state = worker->state;
+  inode_t *inode = &state->inodes[inodeNumber];
+  state->valid[inodeNumber] = 1;
+  FsckBlocks owned = { inodeNumber, (int) worker->blocks.size(), (int) blockNumbers.size() };
+  worker->owned.push_back(owned);
+  worker->blocks.insert(worker->blocks.end(), blockNumbers.begin(), blockNumbers.end());
+  if (inode->type != UFS_DIRECTORY) {
+    return;
+  }
+
+  FsckDirectory *directory = &worker->directories[inodeNumber];
+  directory->blockNumbers = blockNumbers;
+  directory->entries.resize(blockNumbers.size() * ENTRIES_PER_BLOCK);
+  directory->count = inode->size / sizeof(dir_ent_t);
+  vector<struct iovec> iovecs(blockNumbers.size());
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    iovecs[idx].iov_base = &directory->entries[idx * ENTRIES_PER_BLOCK];
+    iovecs[idx].iov_len = UFS_BLOCK_SIZE;
+  }
+  state->disk->readBlocksV(blockNumbers, iovecs.data());
+}
+
+// Check every allocated inode, and read the directories
+void *scanInodes(void *arg) {
+  FsckWorker *worker = (FsckWorker *) arg;
+  FsckState *state = worker->state;
+  int first;
+  while ((first = takeWork(state, FSCK_CHUNK, state->super.num_inodes)) >= 0) {
+    int end = min(first + FSCK_CHUNK, state->super.num_inodes);
+    for (int inodeNumber = first; inodeNumber < end; inodeNumber++) {
+      if (!testBit(state->inodeBitmap.data(), inodeNumber)) {
+        continue;
+      }
+      vector<int> blockNumbers;
+      string problem = checkInode(state, &state->inodes[inodeNumber], blockNumbers);
+      if (!problem.empty()) {
+        worker->problems.push_back(make_pair(inodeNumber, inodeName(inodeNumber) + " " + problem));
+        continue;
+      }
+      addInode(worker, inodeNumber, blockNumbers);
+    }
+  }
+  return NULL;
+}
+
+void mergeDirectories(FsckState *state, FsckWorker *worker) {
+  map<int, FsckDirectory>::iterator iter;
+  for (iter = worker->directories.begin(); iter != worker->directories.end(); iter++) {
+    state->directories[iter->first].entries.swap(iter->second.entries);
+    state->directories[iter->first].blockNumbers.swap(iter->second.blockNumbers);
+    state->directories[iter->first].count = iter->second.count;
+  }
+  worker->directories.clear();
+}
+
+// An intact inode that a directory names but the bitmap has free was
+// lost by the bitmap rather than by the tree, so it is added like the
+// allocated ones and marked again. A directory found this way can name
+// more of them.
+void findUnmarked(FsckState *state, FsckWorker *worker, vector<pair<int, string> > &problems) {
+  vector<int> pending;
+  map<int, FsckDirectory>::iterator iter;
+  for (iter = state->directories.begin(); iter != state->directories.end(); iter++) {
+    pending.push_back(iter->first);
+  }
+  while (!pending.empty()) {
+    FsckDirectory *directory = &state->directories[pending.back()];
+    pending.pop_back();
+    for (int slot = 2; slot < directory->count; slot++) {
+      int child = directory->entries[slot].inum;
+      if (child < 0 || child >= state->super.num_inodes || testBit(state->inodeBitmap.data(), child)) {
+        continue;
+      }
+      vector<int> blockNumbers;
+      if (!checkInode(state, &state->inodes[child], blockNumbers).empty()) {
+        continue;
+      }
+      setBit(state->inodeBitmap.data(), child);
+      problems.push_back(make_pair(child, inodeName(child) + " is in use but free in the bitmap"));
+      addInode(worker, child, blockNumbers);
+      if (state->inodes[child].type == UFS_DIRECTORY) {
+        mergeDirectories(state, worker);
+        pending.push_back(child);
+      }
+    }
+  }
+}
+
+void removeEntry(FsckDirectory *directory, int slot) {
+  directory->entries[slot].inum = -1;
+  directory->dirtyBlocks.insert(slot / ENTRIES_PER_BLOCK);
+}
+
+// Check the entries of each directory and collect the names of the rest
+void *checkDirectories(void *arg) {
+  FsckWorker *worker = (FsckWorker *) arg;
+  FsckState *state = worker->state;
+  int idx;
+  while ((idx = takeWork(state, 1, state->directoryList.size())) >= 0) {
+    int inodeNumber = state->directoryNumbers[idx];
+    FsckDirectory *directory = state->directoryList[idx];
+    string prefix = inodeName(inodeNumber) + " ";
+    dir_ent_t *entries = directory->entries.data();
+    if (strncmp(entries[0].name, ".", DIR_ENT_NAME_SIZE) != 0 || entries[0].inum != inodeNumber) {
+      worker->problems.push_back(make_pair(inodeNumber, prefix + "has a bad . entry"));
+      memset(entries[0].name, 0, DIR_ENT_NAME_SIZE);
+      strcpy(entries[0].name, ".");
+      entries[0].inum = inodeNumber;
+      directory->dirtyBlocks.insert(0);
+    }
+    if (strncmp(entries[1].name, "..", DIR_ENT_NAME_SIZE) != 0) {
+      // Where it points is checked with the tree
+      worker->problems.push_back(make_pair(inodeNumber, prefix + "has a bad .. entry"));
+      memset(entries[1].name, 0, DIR_ENT_NAME_SIZE);
+      strcpy(entries[1].name, "..");
+      directory->dirtyBlocks.insert(0);
+    }
+
+    set<string> seen;
+    for (int slot = 2; slot < directory->count; slot++) {
+      int child = entries[slot].inum;
+      if (child == -1) {
+        continue;
+      }
+      string problem;
+      if (memchr(entries[slot].name, '\0', DIR_ENT_NAME_SIZE) == NULL) {
+        problem = "has an entry with an unterminated name";
+      } else {
+        string name = entries[slot].name;
+        if (name.empty() || name == "." || name == "..") {
+          problem = "has an entry called \"" + name + "\"";
+        } else if (!seen.insert(name).second) {
+          problem = "has two entries called " + name;
+        } else if (child < 0 || child >= state->super.num_inodes) {
+          problem = "entry " + name + " has a bad inode number";
+        } else if (!testBit(state->inodeBitmap.data(), child)) {
+          problem = "entry " + name + " points to free " + inodeName(child);
+        } else if (!state->valid[child]) {
+          problem = "entry " + name + " points to damaged " + inodeName(child);
+        }
+      }
+      if (!problem.empty()) {
+        worker->problems.push_back(make_pair(inodeNumber, prefix + problem));
+        removeEntry(directory, slot);
+        continue;
+      }
+      FsckName found = { child, inodeNumber, slot };
+      worker->names.push_back(found);
+    }
+  }
+  return NULL;
+}
+
+bool compareNames(const FsckName &first, const FsckName &second) {
+  if (first.child != second.child) {
+    return first.child < second.child;
+  }
+  if (first.parent != second.parent) {
+    return first.parent < second.parent;
+  }
+  return first.slot < second.slot;
+}
+
+// Keep one name for each inode. A directory keeps the one in the
+// directory its .. points to, when there is one, and .. is made to
+// point where the name is.
+void chooseNames(FsckState *state, vector<FsckName> &names, vector<pair<int, string> > &problems) {
+  sort(names.begin(), names.end(), compareNames);
+  size_t first = 0;
+  while (first < names.size()) {
+    size_t end = first;
+    while (end < names.size() && names[end].child == names[first].child) {
+      end++;
+    }
+    int child = names[first].child;
+    bool isDirectory = state->inodes[child].type == UFS_DIRECTORY;
+    int parent = isDirectory ? state->directories[child].entries[1].inum : -1;
+    size_t kept = first;
+    for (size_t idx = first; idx < end; idx++) {
+      if (names[idx].parent == parent) {
+        kept = idx;
+        break;
+      }
+    }
+    if (child == UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+      kept = end;
+    } else {
+      state->named[child] = 1;
+    }
+    for (size_t idx = first; idx < end; idx++) {
+      if (idx == kept) {
+        continue;
+      }
+      FsckDirectory *directory = &state->directories[names[idx].parent];
+      string name = directory->entries[names[idx].slot].name;
+      problems.push_back(make_pair(names[idx].parent, inodeName(names[idx].parent) + " entry " + name + " is another name for " +
+                                                      inodeName(child)));
+      removeEntry(directory, names[idx].slot);
+    }
+    if (isDirectory && kept < end && parent != names[kept].parent) {
+      problems.push_back(make_pair(child, inodeName(child) + " has .. pointing to " + to_string(parent) + " instead of " +
+                                              to_string(names[kept].parent)));
+      state->directories[child].entries[1].inum = names[kept].parent;
+      state->directories[child].dirtyBlocks.insert(0);
+    }
+    first = end;
+  }
+
+  FsckDirectory *root = &state->directories[UFS_ROOT_DIRECTORY_INODE_NUMBER];
+  if (root->entries[1].inum != UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+    problems.push_back(make_pair(UFS_ROOT_DIRECTORY_INODE_NUMBER, "the root directory's .. does not point to itself"));
+    root->entries[1].inum = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    root->dirtyBlocks.insert(0);
+  }
+}
+
+// Mark what the directories of one level of the tree hold
+void *walkLevel(void *arg) {
+  FsckWorker *worker = (FsckWorker *) arg;
+  FsckState *state = worker->state;
+  int idx;
+  while ((idx = takeWork(state, 1, state->level.size())) >= 0) {
+    FsckDirectory *directory = &state->directories.find(state->level[idx])->second;
+    for (int slot = 2; slot < directory->count; slot++) {
+      int child = directory->entries[slot].inum;
+      if (child == -1) {
+        continue;
+      }
+      // Each inode has one name left, so no other thread marks it
+      state->reached[child] = 1;
+      if (state->inodes[child].type == UFS_DIRECTORY) {
+        worker->nextLevel.push_back(child);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Mark the blocks of the inodes in the tree that this worker checked
+void *markBlocks(void *arg) {
+  FsckWorker *worker = (FsckWorker *) arg;
+  FsckState *state = worker->state;
+  worker->used.assign(state->dataBitmap.size(), 0);
+  worker->duplicates.assign(state->dataBitmap.size(), 0);
+  for (size_t idx = 0; idx < worker->owned.size(); idx++) {
+    FsckBlocks *owned = &worker->owned[idx];
+    if (!state->reached[owned->inodeNumber]) {
+      continue;
+    }
+    for (int block = owned->first; block < owned->first + owned->count; block++) {
+      int index = worker->blocks[block] - state->super.data_region_addr;
+      if (testBit(worker->used.data(), index)) {
+        setBit(worker->duplicates.data(), index);
+      }
+      setBit(worker->used.data(), index);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  bool repair = false;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int arg = 1;
+  for (; arg < argc - 1; arg++) {
+    if (string(argv[arg]) == "-r") {
+      repair = true;
+    } else if (string(argv[arg]) == "-j" && arg + 1 < argc - 1) {
+      threads = atoi(argv[++arg]);
+    } else {
+      break;
+    }
+  }
+  if (arg != argc - 1 || threads <= 0) {
+    cerr << argv[0] << ": [-r] [-j threads] diskImageFile" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " -r tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  FsckState state;
+  state.disk = new Disk(argv[arg], UFS_BLOCK_SIZE);
+  unsigned char block[UFS_BLOCK_SIZE];
+  state.disk->readBlock(0, block);
+  memcpy(&state.super, block, sizeof(super_t));
+  string problem = checkSuperBlock(&state.super, state.disk->numberOfBlocks());
+  if (!problem.empty()) {
+    cout << "super block: " << problem << endl;
+    delete state.disk;
+    return 1;
+  }
+  super_t *super = &state.super;
+  state.fileSystem = new LocalFileSystem(state.disk);
+  state.inodeBitmap.resize((super->num_inodes + 7) / 8);
+  state.dataBitmap.resize((super->num_data + 7) / 8);
+  state.inodes.resize(super->num_inodes);
+  state.fileSystem->readInodeBitmap(super, state.inodeBitmap.data());
+  state.fileSystem->readDataBitmap(super, state.dataBitmap.data());
+  state.fileSystem->readInodeRegion(super, state.inodes.data());
+  state.valid.assign(super->num_inodes, 0);
+  state.reached.assign(super->num_inodes, 0);
+  state.named.assign(super->num_inodes, 0);
+
+  vector<FsckWorker> workers(threads);
+  for (int idx = 0; idx < threads; idx++) {
+    workers[idx].state = &state;
+  }
+  runWorkers(workers, scanInodes);
+  vector<pair<int, string> > problems;
+  for (int idx = 0; idx < threads; idx++) {
+    problems.insert(problems.end(), workers[idx].problems.begin(), workers[idx].problems.end());
+    workers[idx].problems.clear();
+    mergeDirectories(&state, &workers[idx]);
+  }
+  findUnmarked(&state, &workers[0], problems);
+  if (!state.valid[UFS_ROOT_DIRECTORY_INODE_NUMBER] ||
+      state.inodes[UFS_ROOT_DIRECTORY_INODE_NUMBER].type != UFS_DIRECTORY) {
+    cout << "the root directory is damaged" << endl;
+    delete state.fileSystem;
+    delete state.disk;
+    return 1;
+  }
+
+  map<int, FsckDirectory>::iterator iter;
+  for (iter = state.directories.begin(); iter != state.directories.end(); iter++) {
+    state.directoryNumbers.push_back(iter->first);
+    state.directoryList.push_back(&iter->second);
+  }
+  runWorkers(workers, checkDirectories);
+  vector<FsckName> names;
+  for (int idx = 0; idx < threads; idx++) {
+    problems.insert(problems.end(), workers[idx].problems.begin(), workers[idx].problems.end());
+    names.insert(names.end(), workers[idx].names.begin(), workers[idx].names.end());
+    workers[idx].names.clear();
+  }
+  chooseNames(&state, names, problems);
+
+  state.reached[UFS_ROOT_DIRECTORY_INODE_NUMBER] = 1;
+  state.level.assign(1, UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  while (!state.level.empty()) {
+    runWorkers(workers, walkLevel);
+    state.level.clear();
+    for (int idx = 0; idx < threads; idx++) {
+      state.level.insert(state.level.end(), workers[idx].nextLevel.begin(), workers[idx].nextLevel.end());
+      workers[idx].nextLevel.clear();
+    }
+  }
+
+  // Inodes outside the tree are freed, damaged ones were reported
+  // already. Only the top of a detached subtree is reported.
+  vector<unsigned char> inodeBitmap(state.inodeBitmap.size(), 0);
+  int detached = 0;
+  for (int inodeNumber = 0; inodeNumber < super->num_inodes; inodeNumber++) {
+    if (state.reached[inodeNumber]) {
+      setBit(inodeBitmap.data(), inodeNumber);
+    } else if (state.valid[inodeNumber] && state.named[inodeNumber]) {
+      detached++;
+    } else if (state.valid[inodeNumber]) {
+      problems.push_back(make_pair(inodeNumber, inodeName(inodeNumber) + " is not in any directory"));
+    }
+  }
+
+  // Each worker marks the blocks of the inodes it checked, then the
+  // bitmaps are combined a word at a time
+  runWorkers(workers, markBlocks);
+  vector<unsigned char> dataBitmap(state.dataBitmap.size(), 0);
+  vector<unsigned char> duplicates(state.dataBitmap.size(), 0);
+  size_t words = (dataBitmap.size() + 7) / 8;
+  int unused = 0;
+  int unmarked = 0;
+  int shared = 0;
+  for (size_t word = 0; word < words; word++) {
+    uint64_t used = 0;
+    uint64_t twice = 0;
+    for (int idx = 0; idx < threads; idx++) {
+      uint64_t mine = loadWord(workers[idx].used, word);
+      twice |= (used & mine) | loadWord(workers[idx].duplicates, word);
+      used |= mine;
+    }
+    uint64_t onDisk = loadWord(state.dataBitmap, word);
+    unused += __builtin_popcountll(onDisk & ~used);
+    unmarked += __builtin_popcountll(used & ~onDisk);
+    shared += __builtin_popcountll(twice);
+    storeWord(dataBitmap, word, used);
+    storeWord(duplicates, word, twice);
+  }
+  // The bitmap problems come after the inode ones
+  sort(problems.begin(), problems.end());
+  map<int, vector<int> > sharers;
+  for (int idx = 0; shared > 0 && idx < threads; idx++) {
+    for (size_t file = 0; file < workers[idx].owned.size(); file++) {
+      FsckBlocks *owned = &workers[idx].owned[file];
+      for (int block = owned->first; state.reached[owned->inodeNumber] && block < owned->first + owned->count; block++) {
+        int index = workers[idx].blocks[block] - super->data_region_addr;
+        if (testBit(duplicates.data(), index)) {
+          sharers[index].push_back(owned->inodeNumber);
+        }
+      }
+    }
+  }
+  for (map<int, vector<int> >::iterator sharer = sharers.begin(); sharer != sharers.end(); sharer++) {
+    sort(sharer->second.begin(), sharer->second.end());
+    string users;
+    for (size_t idx = 0; idx < sharer->second.size(); idx++) {
+      users += (idx == 0 ? "" : ", ") + to_string(sharer->second[idx]);
+    }
+    problems.push_back(make_pair(-1, "block " + to_string(super->data_region_addr + sharer->first) + " is used by inodes " + users));
+  }
+  if (detached > 0) {
+    problems.push_back(make_pair(-1, to_string(detached) + " inodes are in directories outside the tree"));
+  }
+  if (unused > 0) {
+    problems.push_back(make_pair(-1, to_string(unused) + " blocks are marked in use but no file has them"));
+  }
+  if (unmarked > 0) {
+    problems.push_back(make_pair(-1, to_string(unmarked) + " blocks are in use but free in the bitmap"));
+  }
+  for (size_t idx = 0; idx < problems.size(); idx++) {
+    cout << problems[idx].second << endl;
+  }
+  int files = 0;
+  int blocks = 0;
+  for (int inodeNumber = 0; inodeNumber < super->num_inodes; inodeNumber++) {
+    files += state.reached[inodeNumber];
+  }
+  for (size_t word = 0; word < words; word++) {
+    blocks += __builtin_popcountll(loadWord(dataBitmap, word));
+  }
+  cout << files << " files and directories, " << blocks << " blocks, " << problems.size() << " problems" << endl;
+
+  int ret = problems.empty() ? 0 : 1;
+  if (repair && !problems.empty()) {
+    state.disk->beginTransaction();
+    for (iter = state.directories.begin(); iter != state.directories.end(); iter++) {
+      FsckDirectory *directory = &iter->second;
+      if (!state.reached[iter->first]) {
+        continue;
+      }
+      set<int>::iterator dirty;
+      for (dirty = directory->dirtyBlocks.begin(); dirty != directory->dirtyBlocks.end(); dirty++) {
+        state.disk->writeBlock(directory->blockNumbers[*dirty], &directory->entries[*dirty * ENTRIES_PER_BLOCK]);
+      }
+    }
+    state.fileSystem->writeInodeBitmap(super, inodeBitmap.data());
+    state.fileSystem->writeDataBitmap(super, dataBitmap.data());
+    if (!state.disk->commit()) {
+      cerr << "Could not repair the image" << endl;
+    } else if (shared > 0) {
+      cout << "repaired all but the blocks used by more than one file" << endl;
+    } else {
+      cout << "repaired" << endl;
+      ret = 0;
+    }
+  }
+
+  delete state.fileSystem;
+  delete state.disk;
+  return ret;
+}
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Copies a directory tree from your computer into the disk image with
+// one LocalFileSystem::batch in one transaction, so the bitmaps, inode
+// table and each directory are written once however many files there
+// are. Files that exist are overwritten, like ds3cp.
+
+// Add operations for everything in srcDirectory, which goes in the
+// directory that operation parentOperation creates, or in parentInode
+// if it is -1. File contents are kept in contents.
+bool addDirectory(string srcDirectory, int parentInode, int parentOperation,
+                  vector<BatchOperation> &operations, deque<string> &contents) {
+  DIR *dir = opendir(srcDirectory.c_str());
+  if (dir == NULL) {
+    return false;
+  }
+  vector<string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string name = entry->d_name;
+    if (name != "." && name != "..") {
+      names.push_back(name);
+    }
+  }
+  closedir(dir);
+  sort(names.begin(), names.end());
+
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    string srcPath = srcDirectory + "/" + names[idx];
+    struct stat info;
+    if (lstat(srcPath.c_str(), &info) != 0) {
+      return false;
+    }
+    if (!S_ISDIR(info.st_mode) && !S_ISREG(info.st_mode)) {
+      // Symbolic links, devices and so on have no UFS equivalent
+      continue;
+    }
+
+    BatchOperation operation;
+    operation.op = BATCH_CREATE;
+    operation.parentInodeNumber = parentInode;
+    operation.parentOperation = parentOperation;
+    operation.name = names[idx];
+    operation.type = S_ISDIR(info.st_mode) ? UFS_DIRECTORY : UFS_REGULAR_FILE;
+    operation.data = NULL;
+    operation.size = 0;
+    if (S_ISREG(info.st_mode)) {
+      ifstream file(srcPath.c_str(), ios::binary);
+      if (!file) {
+        return false;
+      }
+      stringstream data;
+      data << file.rdbuf();
+      contents.push_back(data.str());
+      operation.data = contents.back().data();
+      operation.size = contents.back().size();
+    }
+    operations.push_back(operation);
+
+    if (S_ISDIR(info.st_mode) &&
+        !addDirectory(srcPath, parentInode, operations.size() - 1, operations, contents)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    cerr << argv[0] << ": diskImageFile src_directory dst_inode" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " tests/disk_images/a.img photos 0" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  string srcDirectory = string(argv[2]);
+  int dstInode = stoi(argv[3]);
+
+  vector<BatchOperation> operations;
+  // A deque so that adding contents never moves what is already there
+  deque<string> contents;
+  int ret = 0;
+  if (!addDirectory(srcDirectory, dstInode, -1, operations, contents)) {
+    ret = 1;
+  } else {
+    disk->beginTransaction();
+    if (fileSystem->batch(operations) < 0) {
+      disk->rollback();
+      ret = 1;
+    } else if (!disk->commit()) {
+      ret = 1;
+    }
+  }
+  if (ret != 0) {
+    cerr << "Could not import " << srcDirectory << endl;
+  }
+
+  delete fileSystem;
+  delete disk;
+  return ret;
+}
@@ -0,0 +1,178 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "DiskStats.h"
+#include "LatencyModel.h"
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Measures PUT and GET of one large object on each image given. Version
+// 2 and 3 images store it as one file. A version 1 image can't, so it is
+// split into MAX_FILE_SIZE shards the way clients have to, one request
+// each. Every request is a transaction, as in the server. Extents are
+// the runs of consecutive blocks the object ended up in, each read with
+// one preadv of up to IOV_MAX blocks. The GETs are also timed on the
+// simulated disk of the hdd LatencyModel, where every extent is a seek. Use fresh images with room for the
+// object, it is left in /large.
+//
+// With -a the image is aged first: AGE_FILES files as big as the object
+// between them are written to /aged and every other one is removed,
+// leaving holes at the front of the data region.
+//
+//    $ ./mkfs -f v1.img -d 16384 -i 1024
+//    $ ./mkfs -f v2.img -d 16384 -i 1024 -V 2
+//    $ ./mkfs -f v3.img -d 16384 -i 1024 -V 3
+//    $ ./ds3largeobj 32 v1.img v2.img v3.img
+
+#define AGE_FILES (256)
+
+struct LargeObjectRun {
+  int shards;
+  int extents;
+  double putSeconds;
+  double getSeconds;
+  double hddGetSeconds;
+  unsigned long blocksWritten;
+  unsigned long blocksRead;
+  bool ok;
+};
+
+unsigned long totalIO(Disk *disk, bool writes) {
+  unsigned long total = 0;
+  for (int region = 0; region < NUM_REGIONS; region++) {
+    RegionCounters counters = disk->stats()->counters(region);
+    total += writes ? counters.writes : counters.reads;
+  }
+  return total;
+}
+
+// Fill the image with files and remove every other one
+bool ageImage(LocalFileSystem *fileSystem, const vector<char> &object) {
+  int directory = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "aged");
+  int size = (object.size() / AGE_FILES + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE * UFS_BLOCK_SIZE;
+  size = min(size, fileSystem->maxFileSize());
+  for (int file = 0; file < AGE_FILES && directory >= 0; file++) {
+    int inodeNumber = fileSystem->create(directory, UFS_REGULAR_FILE, "a" + to_string(file));
+    if (inodeNumber < 0 || fileSystem->write(inodeNumber, object.data(), size) != size) {
+      return false;
+    }
+  }
+  for (int file = 0; file < AGE_FILES && directory >= 0; file += 2) {
+    fileSystem->unlink(directory, "a" + to_string(file));
+  }
+  return directory >= 0;
+}
+
+LargeObjectRun runImage(string diskImageFile, const vector<char> &object, bool age) {
+  LargeObjectRun run = { 0, 0, 0, 0, 0, 0, 0, false };
+  Disk *disk = new Disk(diskImageFile, UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  int directory = -1;
+  if (!age || ageImage(fileSystem, object)) {
+    directory = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "large");
+  }
+  int shardSize = fileSystem->maxFileSize();
+  run.shards = (object.size() + shardSize - 1) / shardSize;
+  if (directory < 0) {
+    delete fileSystem;
+    delete disk;
+    return run;
+  }
+
+  disk->stats()->reset();
+  run.ok = true;
+  uint64_t start = DiskStats::now();
+  for (int shard = 0; shard < run.shards && run.ok; shard++) {
+    int size = min((int) object.size() - shard * shardSize, shardSize);
+    disk->beginTransaction();
+    int inodeNumber = fileSystem->create(directory, UFS_REGULAR_FILE, "s" + to_string(shard));
+    run.ok = inodeNumber >= 0 && fileSystem->write(inodeNumber, &object[(size_t) shard * shardSize], size) == size;
+    if (run.ok) {
+      run.ok = disk->commit();
+    } else {
+      disk->rollback();
+    }
+  }
+  run.putSeconds = (DiskStats::now() - start) / 1e9;
+  run.blocksWritten = totalIO(disk, true);
+
+  disk->stats()->reset();
+  LatencyModel *hdd = LatencyModel::create("hdd", disk->numberOfBlocks());
+  disk->setLatencyModel(hdd);
+  vector<char> buffer(shardSize);
+  start = DiskStats::now();
+  for (int shard = 0; shard < run.shards && run.ok; shard++) {
+    int size = min((int) object.size() - shard * shardSize, shardSize);
+    disk->beginTransaction();
+    int inodeNumber = fileSystem->lookup(directory, "s" + to_string(shard));
+    int bytes = inodeNumber < 0 ? -1 : fileSystem->read(inodeNumber, buffer.data(), size);
+    run.ok = disk->commit() && bytes == size && memcmp(buffer.data(), &object[(size_t) shard * shardSize], size) == 0;
+  }
+  run.getSeconds = (DiskStats::now() - start) / 1e9;
+  run.hddGetSeconds = hdd->elapsed() / 1e9;
+  run.blocksRead = totalIO(disk, false);
+  disk->setLatencyModel(NULL);
+  delete hdd;
+
+  for (int shard = 0; shard < run.shards && run.ok; shard++) {
+    inode_t inode;
+    vector<int> blockNumbers;
+    vector<int> indirectBlocks;
+    fileSystem->stat(fileSystem->lookup(directory, "s" + to_string(shard)), &inode);
+    fileSystem->fileBlocks(&inode, blockNumbers, indirectBlocks);
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      if (idx == 0 || blockNumbers[idx] != blockNumbers[idx - 1] + 1) {
+        run.extents++;
+      }
+    }
+  }
+
+  delete fileSystem;
+  delete disk;
+  return run;
+}
+
+int main(int argc, char *argv[]) {
+  bool age = argc > 1 && string(argv[1]) == "-a";
+  int first = age ? 2 : 1;
+  if (argc - first < 2) {
+    cerr << argv[0] << ": [-a] megabytes diskImageFile..." << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " 32 v1.img v2.img v3.img" << endl;
+    return 1;
+  }
+  int megabytes = atoi(argv[first]);
+  if (megabytes <= 0 || megabytes > MAX_FILE_SIZE_V2 / (1 << 20)) {
+    cerr << "megabytes must be between 1 and " << MAX_FILE_SIZE_V2 / (1 << 20) << endl;
+    return 1;
+  }
+
+  vector<char> object((size_t) megabytes << 20);
+  for (size_t idx = 0; idx < object.size(); idx++) {
+    object[idx] = (char) (idx / 64 + idx / 4096);
+  }
+
+  int ret = 0;
+  cout << "image                 shards   extents    PUT MB/s    GET MB/s  hdd GET MB/s   blocks written   blocks read"
+       << endl;
+  for (int idx = first + 1; idx < argc; idx++) {
+    LargeObjectRun run = runImage(argv[idx], object, age);
+    if (!run.ok) {
+      cerr << "Could not store the object in " << argv[idx] << endl;
+      ret = 1;
+      continue;
+    }
+    cout << left << setw(20) << argv[idx] << right << setw(8) << run.shards << setw(10) << run.extents << fixed << setprecision(1)
+         << setw(12) << megabytes / run.putSeconds << setw(12) << megabytes / run.getSeconds << setw(14) << megabytes / run.hddGetSeconds
+         << setw(17) << run.blocksWritten << setw(14) << run.blocksRead << endl;
+  }
+  return ret;
+}
@@ -11,12 +11,12 @@
 
 using namespace std;
 
-/*
-  Use this function with std::sort for directory entries
+// Entries fetched per readdir call
+#define READDIR_BATCH (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+
 bool compareByName(const dir_ent_t& a, const dir_ent_t& b) {
     return std::strcmp(a.name, b.name) < 0;
 }
-*/
 
 int main(int argc, char *argv[]) {
   if (argc != 3) {
@@ -27,11 +27,49 @@ int main(int argc, char *argv[]) {
   }
 
   // parse command line arguments
-  /*
   Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   string directory = string(argv[2]);
-  */
-  
-  return 0;
+
+  vector<string> names = StringUtils::split(directory, '/');
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  string name = ".";
+  for (size_t idx = 0; idx < names.size() && inodeNumber >= 0; idx++) {
+    if (!names[idx].empty()) {
+      name = names[idx];
+      inodeNumber = fileSystem->lookup(inodeNumber, name);
+    }
+  }
+
+  inode_t inode;
+  int ret = 0;
+  if (inodeNumber < 0 || fileSystem->stat(inodeNumber, &inode) < 0) {
+    ret = 1;
+  } else if (inode.type == UFS_REGULAR_FILE) {
+    cout << inodeNumber << "\t" << name << endl;
+  } else {
+    // Directories are read a block at a time rather than all at once
+    vector<dir_ent_t> entries;
+    dir_ent_t batch[READDIR_BATCH];
+    int cursor = 0;
+    int found;
+    while ((found = fileSystem->readdir(inodeNumber, &cursor, batch, READDIR_BATCH)) > 0) {
+      entries.insert(entries.end(), batch, batch + found);
+    }
+    if (found < 0) {
+      ret = 1;
+    } else {
+      sort(entries.begin(), entries.end(), compareByName);
+      for (size_t idx = 0; idx < entries.size(); idx++) {
+        cout << entries[idx].inum << "\t" << entries[idx].name << endl;
+      }
+    }
+  }
+  if (ret != 0) {
+    cerr << "Directory not found" << endl;
+  }
+
+  delete fileSystem;
+  delete disk;
+  return ret;
 }
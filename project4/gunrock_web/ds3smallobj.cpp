@@ -0,0 +1,160 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "DiskStats.h"
+#include "LatencyModel.h"
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Measures PUT and GET of many small objects on each image given, with
+// the metadata and directory caches on like the server. Object sizes go
+// from 1 to SMALL_OBJECT_MAX bytes, so on images made with mkfs -I about
+// half of them are kept in their inode and a GET of one reads no data
+// block. Every request is a transaction, as in the server. The GETs are
+// also timed on the simulated disk of the hdd LatencyModel. Use fresh
+// images, the objects are left in /small, SMALL_OBJECTS_PER_DIRECTORY to
+// a directory.
+//
+//    $ ./mkfs -f blocks.img -d 16384 -i 4096
+//    $ ./mkfs -f inline.img -d 16384 -i 4096 -I
+//    $ ./ds3smallobj 2000 blocks.img inline.img
+
+#define SMALL_OBJECT_MAX (240)
+#define SMALL_OBJECTS_PER_DIRECTORY (500)
+
+struct SmallObjectRun {
+  int inlineFiles;
+  int dataBlocks;
+  double putSeconds;
+  double getSeconds;
+  double hddGetSeconds;
+  unsigned long blocksRead;
+  bool ok;
+};
+
+int objectSize(int object) {
+  return 1 + object * 37 % SMALL_OBJECT_MAX;
+}
+
+string objectName(int object) {
+  return "o" + to_string(object);
+}
+
+SmallObjectRun runImage(string diskImageFile, int objects, const vector<char> &contents) {
+  SmallObjectRun run = { 0, 0, 0, 0, 0, 0, false };
+  Disk *disk = new Disk(diskImageFile, UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  fileSystem->setMetadataCache(true);
+  fileSystem->setDirectoryCache(1 << 20);
+  int directories = (objects + SMALL_OBJECTS_PER_DIRECTORY - 1) / SMALL_OBJECTS_PER_DIRECTORY;
+  vector<int> directoryInodes;
+  int top = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "small");
+  for (int idx = 0; idx < directories && top >= 0; idx++) {
+    int inodeNumber = fileSystem->create(top, UFS_DIRECTORY, "d" + to_string(idx));
+    if (inodeNumber < 0) {
+      break;
+    }
+    directoryInodes.push_back(inodeNumber);
+  }
+  if ((int) directoryInodes.size() < directories) {
+    delete fileSystem;
+    delete disk;
+    return run;
+  }
+
+  run.ok = true;
+  uint64_t start = DiskStats::now();
+  for (int object = 0; object < objects && run.ok; object++) {
+    int size = objectSize(object);
+    int directory = directoryInodes[object / SMALL_OBJECTS_PER_DIRECTORY];
+    disk->beginTransaction();
+    int inodeNumber = fileSystem->create(directory, UFS_REGULAR_FILE, objectName(object));
+    run.ok = inodeNumber >= 0 && fileSystem->write(inodeNumber, contents.data(), size) == size;
+    if (run.ok) {
+      run.ok = disk->commit();
+    } else {
+      disk->rollback();
+    }
+  }
+  run.putSeconds = (DiskStats::now() - start) / 1e9;
+
+  disk->stats()->reset();
+  LatencyModel *hdd = LatencyModel::create("hdd", disk->numberOfBlocks());
+  disk->setLatencyModel(hdd);
+  vector<char> buffer(SMALL_OBJECT_MAX);
+  start = DiskStats::now();
+  for (int object = 0; object < objects && run.ok; object++) {
+    int size = objectSize(object);
+    disk->beginTransaction();
+    int inodeNumber = fileSystem->lookup(directoryInodes[object / SMALL_OBJECTS_PER_DIRECTORY], objectName(object));
+    int bytes = inodeNumber < 0 ? -1 : fileSystem->read(inodeNumber, buffer.data(), size);
+    run.ok = disk->commit() && bytes == size && memcmp(buffer.data(), contents.data(), size) == 0;
+  }
+  run.getSeconds = (DiskStats::now() - start) / 1e9;
+  run.hddGetSeconds = hdd->elapsed() / 1e9;
+  for (int region = 0; region < NUM_REGIONS; region++) {
+    run.blocksRead += disk->stats()->counters(region).reads;
+  }
+  disk->setLatencyModel(NULL);
+  delete hdd;
+
+  for (int object = 0; object < objects && run.ok; object++) {
+    inode_t inode;
+    vector<int> blockNumbers;
+    vector<int> indirectBlocks;
+    fileSystem->stat(fileSystem->lookup(directoryInodes[object / SMALL_OBJECTS_PER_DIRECTORY], objectName(object)), &inode);
+    fileSystem->fileBlocks(&inode, blockNumbers, indirectBlocks);
+    if (blockNumbers.empty()) {
+      run.inlineFiles++;
+    }
+    run.dataBlocks += blockNumbers.size() + indirectBlocks.size();
+  }
+
+  delete fileSystem;
+  delete disk;
+  return run;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    cerr << argv[0] << ": objects diskImageFile..." << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " 2000 blocks.img inline.img" << endl;
+    return 1;
+  }
+  int objects = atoi(argv[1]);
+  if (objects <= 0) {
+    cerr << "objects must be positive" << endl;
+    return 1;
+  }
+
+  vector<char> contents(SMALL_OBJECT_MAX);
+  for (size_t idx = 0; idx < contents.size(); idx++) {
+    contents[idx] = (char) ('a' + idx % 26);
+  }
+
+  int ret = 0;
+  cout << "image                 inline  data blocks   data KB    PUT/s    GET us  hdd GET us  blocks read/GET" << endl;
+  for (int idx = 2; idx < argc; idx++) {
+    SmallObjectRun run = runImage(argv[idx], objects, contents);
+    if (!run.ok) {
+      cerr << "Could not store the objects in " << argv[idx] << endl;
+      ret = 1;
+      continue;
+    }
+    cout << left << setw(20) << argv[idx] << right << setw(8) << run.inlineFiles << setw(13) << run.dataBlocks
+         << setw(10) << run.dataBlocks * (UFS_BLOCK_SIZE / 1024) << fixed << setprecision(0) << setw(9)
+         << objects / run.putSeconds << setprecision(1) << setw(10) << run.getSeconds * 1e6 / objects
+         << setw(12) << run.hddGetSeconds * 1e6 / objects << setprecision(2) << setw(17)
+         << (double) run.blocksRead / objects << endl;
+  }
+  return ret;
+}
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Disk.h"
+#include "Snapshot.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Delta files work anywhere a disk image does, for example
+//     $ ds3snap create test.img tests/disk_images/b.img
+//     $ ds3cp test.img tests/6kwords.txt 5
+// leaves b.img untouched.
+
+Disk *openSnapshot(string deltaFile) {
+  int fd = open(deltaFile.c_str(), O_RDONLY);
+  if (fd < 0 || !Snapshot::isSnapshot(fd)) {
+    cerr << deltaFile << " is not a snapshot" << endl;
+    exit(1);
+  }
+  close(fd);
+  return new Disk(deltaFile, UFS_BLOCK_SIZE);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4) {
+    cerr << argv[0] << ": create deltaFile baseImageFile" << endl;
+    cerr << argv[0] << ": merge deltaFile" << endl;
+    cerr << argv[0] << ": discard deltaFile" << endl;
+    cerr << argv[0] << ": info deltaFile" << endl;
+    return 1;
+  }
+
+  string command = string(argv[1]);
+  string deltaFile = string(argv[2]);
+  if (command == "create" && argc == 4) {
+    Snapshot::create(deltaFile, argv[3], UFS_BLOCK_SIZE);
+  } else if (command == "merge" && argc == 3) {
+    Disk *disk = openSnapshot(deltaFile);
+    disk->getSnapshot()->merge();
+    delete disk;
+    unlink(deltaFile.c_str());
+  } else if (command == "discard" && argc == 3) {
+    delete openSnapshot(deltaFile);
+    unlink(deltaFile.c_str());
+  } else if (command == "info" && argc == 3) {
+    Disk *disk = openSnapshot(deltaFile);
+    cout << "base        " << disk->getSnapshot()->baseImage() << endl;
+    cout << "blocks      " << disk->numberOfBlocks() << endl;
+    cout << "changed     " << disk->getSnapshot()->changedBlocks() << endl;
+    delete disk;
+  } else {
+    cerr << "Unknown command " << command << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,395 @@
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "DiskStats.h"
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Runs LocalFileSystem calls from many threads at once and checks that
+// nothing was lost, then measures how reads and writes scale with the
+// number of threads. Use a freshly made image, it adds and removes files.
+//
+// Each thread works in a directory of its own, writing, reading back,
+// listing and removing files, and also adds and removes names in one
+// directory that all threads share. Every file must read back what was
+// last written to it. Afterwards every inode and block reachable from
+// the root must be marked in the bitmaps, once, and nothing else. With
+// -t each operation is a transaction, retried when it loses a conflict.
+// On a version 2 image files are big enough to need an indirect block.
+//
+//    $ ./mkfs -f stress.img -d 4096 -i 1024
+//    $ ./ds3stress stress.img 8 2000
+
+#define STRESS_FILES (16)
+#define STRESS_MAX_BLOCKS (4)
+#define STRESS_MAX_BLOCKS_V2 (DIRECT_PTRS_V2 + 4)
+#define BENCH_FILES (64)
+#define BENCH_FILE_SIZE (4 * UFS_BLOCK_SIZE)
+
+struct Worker {
+  LocalFileSystem *fileSystem;
+  bool transactions;
+  int id;
+  int operations;
+  int directory;
+  int sharedDirectory;
+  int maxBlocks;
+  unsigned int seed;
+  int errors;
+  int retries;
+  // For the benchmark
+  bool writes;
+  vector<int> files;
+};
+
+string fileName(string prefix, int number) {
+  return prefix + to_string(number);
+}
+
+// Contents that differ by thread, file and version, so a block that ends
+// up in the wrong file or a lost write shows up
+string makeContents(Worker *worker, int file, int version) {
+  int size = rand_r(&worker->seed) % (worker->maxBlocks * UFS_BLOCK_SIZE + 1);
+  string contents(size, '\0');
+  for (int idx = 0; idx < size; idx++) {
+    contents[idx] = (char) (worker->id * 31 + file * 7 + version + idx / 64);
+  }
+  return contents;
+}
+
+// One operation on the worker's files. Returns false if what it found
+// doesn't match expected. pending holds the change to expected to make
+// once the operation is known to have happened.
+bool runOperation(Worker *worker, int choice, int file, int version, map<int, string> &expected,
+                  set<int> &shared, map<int, string> &pending, set<int> &pendingShared) {
+  LocalFileSystem *fileSystem = worker->fileSystem;
+  string name = fileName("f", file);
+  pending = expected;
+  pendingShared = shared;
+
+  if (choice < 40) {
+    string contents = makeContents(worker, file, version);
+    int inodeNumber = fileSystem->create(worker->directory, UFS_REGULAR_FILE, name);
+    if (inodeNumber < 0 || fileSystem->write(inodeNumber, contents.data(), contents.size()) != (int) contents.size()) {
+      return false;
+    }
+    pending[file] = contents;
+  } else if (choice < 70) {
+    int inodeNumber = fileSystem->lookup(worker->directory, name);
+    if (expected.count(file) == 0) {
+      return inodeNumber == -ENOTFOUND;
+    }
+    vector<char> buffer(worker->maxBlocks * UFS_BLOCK_SIZE + 1);
+    int bytes = inodeNumber < 0 ? -1 : fileSystem->read(inodeNumber, buffer.data(), buffer.size());
+    return bytes == (int) expected[file].size() && memcmp(buffer.data(), expected[file].data(), bytes) == 0;
+  } else if (choice < 85) {
+    if (fileSystem->unlink(worker->directory, name) != 0) {
+      return false;
+    }
+    pending.erase(file);
+  } else if (choice < 95) {
+    string sharedName = fileName("s" + to_string(worker->id) + "-", file);
+    if (shared.count(file) == 0) {
+      if (fileSystem->create(worker->sharedDirectory, UFS_REGULAR_FILE, sharedName) < 0) {
+        return false;
+      }
+      pendingShared.insert(file);
+    } else {
+      if (fileSystem->lookup(worker->sharedDirectory, sharedName) < 0 ||
+          fileSystem->unlink(worker->sharedDirectory, sharedName) != 0) {
+        return false;
+      }
+      pendingShared.erase(file);
+    }
+  } else {
+    vector<dir_ent_t> entries;
+    if (fileSystem->readdirSorted(worker->directory, "", "f", entries, STRESS_FILES + 1) < 0) {
+      return false;
+    }
+    set<string> names;
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      names.insert(entries[idx].name);
+    }
+    set<string> expectedNames;
+    for (map<int, string>::iterator iter = expected.begin(); iter != expected.end(); iter++) {
+      expectedNames.insert(fileName("f", iter->first));
+    }
+    return names == expectedNames;
+  }
+  return true;
+}
+
+void *stressWorker(void *arg) {
+  Worker *worker = (Worker *) arg;
+  Disk *disk = worker->fileSystem->disk;
+  map<int, string> expected;
+  set<int> shared;
+  for (int op = 0; op < worker->operations; op++) {
+    int choice = rand_r(&worker->seed) % 100;
+    int file = rand_r(&worker->seed) % STRESS_FILES;
+    unsigned int seed = worker->seed;
+    while (true) {
+      // A retry writes the same contents again
+      worker->seed = seed;
+      map<int, string> pending;
+      set<int> pendingShared;
+      if (worker->transactions) {
+        disk->beginTransaction();
+      }
+      bool ok = runOperation(worker, choice, file, op, expected, shared, pending, pendingShared);
+      if (worker->transactions && !disk->commit()) {
+        worker->retries++;
+        continue;
+      }
+      if (!ok) {
+        worker->errors++;
+      } else {
+        expected = pending;
+        shared = pendingShared;
+      }
+      break;
+    }
+  }
+  return NULL;
+}
+
+void *benchWorker(void *arg) {
+  Worker *worker = (Worker *) arg;
+  vector<char> buffer(BENCH_FILE_SIZE, (char) worker->id);
+  for (int op = 0; op < worker->operations; op++) {
+    int file = worker->files[rand_r(&worker->seed) % worker->files.size()];
+    int bytes = worker->writes ? worker->fileSystem->write(file, buffer.data(), buffer.size())
+                               : worker->fileSystem->read(file, buffer.data(), buffer.size());
+    if (bytes != BENCH_FILE_SIZE) {
+      worker->errors++;
+    }
+  }
+  return NULL;
+}
+
+// Run count workers at once, returning the wall clock time in seconds
+double runWorkers(vector<Worker> &workers, void *(*routine)(void *)) {
+  uint64_t start = DiskStats::now();
+  vector<pthread_t> threads(workers.size());
+  for (size_t idx = 0; idx < workers.size(); idx++) {
+    pthread_create(&threads[idx], NULL, routine, &workers[idx]);
+  }
+  for (size_t idx = 0; idx < workers.size(); idx++) {
+    pthread_join(threads[idx], NULL);
+  }
+  return (DiskStats::now() - start) / 1e9;
+}
+
+// Walk the tree from the root and compare what it uses with the bitmaps
+int checkImage(LocalFileSystem *fileSystem) {
+  super_t super;
+  fileSystem->readSuperBlock(&super);
+  vector<unsigned char> inodeBitmap((super.num_inodes + 7) / 8);
+  vector<unsigned char> dataBitmap((super.num_data + 7) / 8);
+  vector<inode_t> inodes(super.num_inodes);
+  fileSystem->readInodeBitmap(&super, inodeBitmap.data());
+  fileSystem->readDataBitmap(&super, dataBitmap.data());
+  fileSystem->readInodeRegion(&super, inodes.data());
+
+  int problems = 0;
+  vector<bool> reached(super.num_inodes, false);
+  vector<bool> used(super.num_data, false);
+  vector<int> pending(1, UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  reached[UFS_ROOT_DIRECTORY_INODE_NUMBER] = true;
+  while (!pending.empty()) {
+    int inodeNumber = pending.back();
+    pending.pop_back();
+    inode_t *inode = &inodes[inodeNumber];
+    if (!((inodeBitmap[inodeNumber / 8] >> (inodeNumber % 8)) & 1)) {
+      cerr << "inode " << inodeNumber << " is in use but free in the bitmap" << endl;
+      problems++;
+    }
+    vector<int> blockNumbers;
+    vector<int> indirectBlocks;
+    fileSystem->fileBlocks(inode, blockNumbers, indirectBlocks);
+    blockNumbers.insert(blockNumbers.end(), indirectBlocks.begin(), indirectBlocks.end());
+    for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+      int block = blockNumbers[idx] - super.data_region_addr;
+      if (block < 0 || block >= super.num_data) {
+        cerr << "inode " << inodeNumber << " points outside the data region" << endl;
+        problems++;
+      } else if (used[block]) {
+        cerr << "block " << blockNumbers[idx] << " is used twice" << endl;
+        problems++;
+      } else {
+        used[block] = true;
+        if (!((dataBitmap[block / 8] >> (block % 8)) & 1)) {
+          cerr << "block " << blockNumbers[idx] << " is in use but free in the bitmap" << endl;
+          problems++;
+        }
+      }
+    }
+    if (inode->type != UFS_DIRECTORY) {
+      continue;
+    }
+
+    int cursor = 0;
+    dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+    int count;
+    while ((count = fileSystem->readdir(inodeNumber, &cursor, entries, UFS_BLOCK_SIZE / sizeof(dir_ent_t))) > 0) {
+      for (int idx = 0; idx < count; idx++) {
+        int child = entries[idx].inum;
+        if (strcmp(entries[idx].name, ".") == 0 || strcmp(entries[idx].name, "..") == 0) {
+          continue;
+        }
+        if (child < 0 || child >= super.num_inodes || reached[child]) {
+          cerr << "bad or repeated entry " << entries[idx].name << " in inode " << inodeNumber << endl;
+          problems++;
+          continue;
+        }
+        reached[child] = true;
+        pending.push_back(child);
+      }
+    }
+  }
+
+  for (int inodeNumber = 0; inodeNumber < super.num_inodes; inodeNumber++) {
+    if (((inodeBitmap[inodeNumber / 8] >> (inodeNumber % 8)) & 1) && !reached[inodeNumber]) {
+      cerr << "inode " << inodeNumber << " is allocated but unreachable" << endl;
+      problems++;
+    }
+  }
+  for (int block = 0; block < super.num_data; block++) {
+    if (((dataBitmap[block / 8] >> (block % 8)) & 1) && !used[block]) {
+      cerr << "block " << super.data_region_addr + block << " is allocated but unused" << endl;
+      problems++;
+    }
+  }
+  return problems;
+}
+
+int main(int argc, char *argv[]) {
+  bool transactions = argc > 1 && string(argv[1]) == "-t";
+  int first = transactions ? 2 : 1;
+  if (argc - first != 3) {
+    cerr << argv[0] << ": [-t] diskImageFile threads operations" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " stress.img 8 2000" << endl;
+    return 1;
+  }
+  int threads = atoi(argv[first + 1]);
+  int operations = atoi(argv[first + 2]);
+  if (threads <= 0 || operations <= 0) {
+    cerr << "threads and operations must be positive" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[first], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  fileSystem->setMetadataCache(true);
+  fileSystem->setDirectoryCache(1 << 20);
+
+  int stressDirectory = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "stress");
+  int sharedDirectory = stressDirectory < 0 ? stressDirectory :
+    fileSystem->create(stressDirectory, UFS_DIRECTORY, "shared");
+  if (sharedDirectory < 0) {
+    cerr << "Could not set up the stress directories" << endl;
+    return 1;
+  }
+
+  vector<Worker> workers(threads);
+  for (int idx = 0; idx < threads; idx++) {
+    Worker *worker = &workers[idx];
+    worker->fileSystem = fileSystem;
+    worker->transactions = transactions;
+    worker->id = idx;
+    worker->operations = operations;
+    worker->directory = fileSystem->create(stressDirectory, UFS_DIRECTORY, fileName("t", idx));
+    worker->sharedDirectory = sharedDirectory;
+    worker->maxBlocks = fileSystem->formatVersion() >= 2 ? STRESS_MAX_BLOCKS_V2 : STRESS_MAX_BLOCKS;
+    worker->seed = idx + 1;
+    worker->errors = 0;
+    worker->retries = 0;
+    if (worker->directory < 0) {
+      cerr << "Could not set up the stress directories" << endl;
+      return 1;
+    }
+  }
+
+  double seconds = runWorkers(workers, stressWorker);
+  int errors = 0;
+  int retries = 0;
+  for (int idx = 0; idx < threads; idx++) {
+    errors += workers[idx].errors;
+    retries += workers[idx].retries;
+  }
+  int problems = checkImage(fileSystem);
+  cout << "stress: " << threads * operations << " operations in " << fixed << setprecision(2) << seconds
+       << "s, " << errors << " wrong results, " << retries << " retries, " << problems
+       << " problems in the image" << endl;
+
+  // Scaling, GETs of shared files and PUTs to a directory per thread
+  int benchDirectory = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "bench");
+  vector<int> benchFiles;
+  vector<char> contents(BENCH_FILE_SIZE, 'b');
+  for (int idx = 0; idx < BENCH_FILES && benchDirectory >= 0; idx++) {
+    int inodeNumber = fileSystem->create(benchDirectory, UFS_REGULAR_FILE, fileName("b", idx));
+    if (inodeNumber >= 0 && fileSystem->write(inodeNumber, contents.data(), contents.size()) == BENCH_FILE_SIZE) {
+      benchFiles.push_back(inodeNumber);
+    }
+  }
+  vector<vector<int> > putFiles(threads);
+  for (int idx = 0; idx < threads && benchDirectory >= 0; idx++) {
+    int directory = fileSystem->create(benchDirectory, UFS_DIRECTORY, fileName("p", idx));
+    for (int file = 0; file < 4 && directory >= 0; file++) {
+      int inodeNumber = fileSystem->create(directory, UFS_REGULAR_FILE, fileName("f", file));
+      if (inodeNumber >= 0) {
+        putFiles[idx].push_back(inodeNumber);
+      }
+    }
+    if (putFiles[idx].size() != 4) {
+      benchFiles.clear();
+    }
+  }
+  if ((int) benchFiles.size() != BENCH_FILES) {
+    cerr << "Not enough space for the benchmark files" << endl;
+    return 1;
+  }
+
+  vector<int> counts;
+  for (int count = 1; count < threads; count *= 2) {
+    counts.push_back(count);
+  }
+  counts.push_back(threads);
+
+  cout << "threads       GET/s       PUT/s" << endl;
+  for (size_t run = 0; run < counts.size(); run++) {
+    int count = counts[run];
+    double rates[2];
+    for (int writes = 0; writes < 2; writes++) {
+      vector<Worker> benchWorkers(count);
+      for (int idx = 0; idx < count; idx++) {
+        benchWorkers[idx] = workers[idx];
+        benchWorkers[idx].seed = idx + 1;
+        benchWorkers[idx].writes = writes;
+        benchWorkers[idx].files = writes ? putFiles[idx] : benchFiles;
+      }
+      double elapsed = runWorkers(benchWorkers, benchWorker);
+      for (int idx = 0; idx < count; idx++) {
+        errors += benchWorkers[idx].errors;
+      }
+      rates[writes] = count * operations / elapsed;
+    }
+    cout << setw(7) << count << setw(12) << setprecision(0) << rates[0] << setw(12) << rates[1] << endl;
+  }
+
+  delete fileSystem;
+  delete disk;
+  return errors == 0 && problems == 0 ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "DiskStats.h"
+#include "LatencyModel.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Traces are written by any tool or server run with DS3_TRACE=traceFile
+// in its environment.
+
+vector<struct DiskTraceRecord> readTrace(string traceFile) {
+  int fd = open(traceFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open trace file " << traceFile << endl;
+    exit(1);
+  }
+
+  vector<struct DiskTraceRecord> records;
+  struct DiskTraceRecord record;
+  ssize_t ret;
+  while ((ret = read(fd, &record, sizeof(record))) == sizeof(record)) {
+    records.push_back(record);
+  }
+  if (ret != 0 || records.empty()) {
+    cerr << "Could not read trace file " << traceFile << endl;
+    exit(1);
+  }
+  close(fd);
+  return records;
+}
+
+void summarize(vector<struct DiskTraceRecord> &records, Disk *disk) {
+  DiskStats stats;
+  if (disk != NULL) {
+    LocalFileSystem fileSystem(disk);
+    super_t super;
+    fileSystem.readSuperBlock(&super);
+    stats.setLayout(&super);
+  }
+
+  unsigned long opCounts[NUM_DISK_OPS] = { 0 };
+  for (size_t idx = 0; idx < records.size(); idx++) {
+    int op = records[idx].op;
+    if (op >= NUM_DISK_OPS) {
+      cerr << "Invalid trace record " << idx << endl;
+      exit(1);
+    }
+    opCounts[op]++;
+    // fsyncs and transaction markers aren't tied to a block or region
+    if (records[idx].block >= 0) {
+      stats.record(op, vector<int>(1, records[idx].block), records[idx].txnId);
+    }
+  }
+
+  double seconds = (records.back().timestamp - records.front().timestamp) / 1e9;
+  cout << "records     " << records.size() << endl;
+  cout << "duration    " << seconds << " s" << endl;
+  for (int op = 0; op < NUM_DISK_OPS; op++) {
+    cout << DiskStats::opName(op) << string(12 - string(DiskStats::opName(op)).length(), ' ')
+         << opCounts[op] << endl;
+  }
+  cout << endl;
+  stats.print(cout);
+}
+
+void replay(vector<struct DiskTraceRecord> &records, string diskImageFile, string modelName) {
+  Disk *disk = new Disk(diskImageFile, UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  disk->stats()->reset();
+
+  LatencyModel *model = NULL;
+  if (modelName != "") {
+    model = LatencyModel::create(modelName, disk->numberOfBlocks());
+    if (model == NULL) {
+      cerr << "Unknown latency model " << modelName << endl;
+      exit(1);
+    }
+    disk->setLatencyModel(model);
+  }
+
+  // Writes put back what is already in the block, so replaying leaves the
+  // image unchanged. The current contents come from a separate descriptor
+  // so that they don't show up in the statistics.
+  int fd = open(diskImageFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open image file " << diskImageFile << endl;
+    exit(1);
+  }
+
+  unsigned char buffer[UFS_BLOCK_SIZE];
+  set<uint64_t> rolledBack;
+  bool inTransaction = false;
+  uint64_t start = DiskStats::now();
+  for (size_t idx = 0; idx < records.size(); idx++) {
+    struct DiskTraceRecord *record = &records[idx];
+    if (record->block >= disk->numberOfBlocks()) {
+      cerr << "Trace block " << record->block << " is past the end of " << diskImageFile << endl;
+      exit(1);
+    }
+
+    switch (record->op) {
+    case DISK_OP_READ:
+      disk->readBlock(record->block, buffer);
+      break;
+    case DISK_OP_WRITE:
+      // Rollback writes are regenerated by Disk::rollback itself
+      if (rolledBack.count(record->txnId) == 0) {
+        if (pread(fd, buffer, UFS_BLOCK_SIZE, (off_t) record->block * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+          cerr << "Could not read file" << endl;
+          exit(1);
+        }
+        disk->writeBlock(record->block, buffer);
+      }
+      break;
+    case DISK_OP_BEGIN:
+      if (!inTransaction) {
+        disk->beginTransaction();
+        inTransaction = true;
+      }
+      break;
+    case DISK_OP_COMMIT:
+      if (inTransaction) {
+        disk->commit();
+        inTransaction = false;
+      }
+      break;
+    case DISK_OP_ROLLBACK:
+      rolledBack.insert(record->txnId);
+      if (inTransaction) {
+        disk->rollback();
+        inTransaction = false;
+      }
+      break;
+    default:
+      // fsyncs and undo records are generated by the writes themselves
+      break;
+    }
+  }
+  if (inTransaction) {
+    disk->commit();
+  }
+  double seconds = (DiskStats::now() - start) / 1e9;
+  close(fd);
+
+  cout << "replayed    " << records.size() << " records" << endl;
+  cout << "elapsed     " << seconds << " s" << endl;
+  cout << endl;
+  disk->stats()->print(cout);
+
+  ReadaheadStats readahead = disk->readaheadStats();
+  cout << endl << "readahead   " << readahead.prefetched << " prefetched, " << readahead.hits << " hits, "
+       << readahead.wasted << " wasted, window " << readahead.window << endl;
+
+  delete fileSystem;
+  delete disk;
+  delete model;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 5) {
+    cerr << argv[0] << ": summary traceFile [diskImageFile]" << endl;
+    cerr << argv[0] << ": replay traceFile diskImageFile [hdd|ssd|flat]" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ DS3_TRACE=ls.trace ./ds3ls tests/disk_images/a.img /" << endl;
+    cerr << "    $ " << argv[0] << " summary ls.trace tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  // Don't trace our own I/O into the trace we are reading
+  unsetenv("DS3_TRACE");
+
+  string command = string(argv[1]);
+  vector<struct DiskTraceRecord> records = readTrace(argv[2]);
+  if (command == "summary" && argc <= 4) {
+    Disk *disk = argc == 4 ? new Disk(argv[3], UFS_BLOCK_SIZE) : NULL;
+    summarize(records, disk);
+    delete disk;
+  } else if (command == "replay" && argc >= 4) {
+    replay(records, argv[3], argc == 5 ? argv[4] : "");
+  } else {
+    cerr << "Unknown command " << command << endl;
+    return 1;
+  }
+
+  return 0;
+}
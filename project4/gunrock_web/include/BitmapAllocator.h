@@ -0,0 +1,91 @@
+#ifndef _BITMAP_ALLOCATOR_H_
+#define _BITMAP_ALLOCATOR_H_
+
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Free bit search for the inode and data bitmaps.
+ *
+ * Bitmaps are scanned a 64-bit word at a time, using count trailing zeros
+ * to find the free bit in a word, or four words at a time with AVX2 when
+ * the build enables it. Bit i is bit i % 8 of byte i / 8, so on a little
+ * endian machine it is also bit i % 64 of word i / 64.
+ *
+ * By default the lowest free bit is used, as the on-disk format requires.
+ * Next-fit instead starts each search where the last one ended and wraps
+ * around, which spreads allocations over large images.
+ *
+ * The allocator can also keep hints about the bitmap as last written: how
+ * many bits are free in each bitmap block and the first word with a free
+ * bit. Full blocks and the full prefix are then skipped. Bits set in the
+ * caller's copy since the last write only make the hints pessimistic,
+ * but bits cleared in it must be passed to release, or searches skip
+ * them until the copy is written. Without hints every search scans from
+ * the start, or from the cursor for next-fit.
+ */
+class BitmapAllocator {
+ public:
+  BitmapAllocator(int count);
+
+  void setNextFit(bool nextFit);
+
+  // Find a free bit, set it in bitmap and return its index, or -1 when
+  // every bit is set
+  int allocate(unsigned char *bitmap);
+  // Find up to k free bits in one pass, set them and append them to
+  // indexes in the order they were found. Returns how many it found.
+  int allocateN(unsigned char *bitmap, int k, std::vector<int> &indexes);
+  // Like allocateN, but keeps the bits together. Bits from goal onwards
+  // are taken first while they are free, so a file can grow in place.
+  // The rest comes from the smallest free run that holds all of it, or
+  // failing that from the longest runs, in bit order. goal may be -1.
+  int allocateRun(unsigned char *bitmap, int k, int goal, std::vector<int> &indexes);
+  // The first free bit at or after goal's word, wrapping around
+  int allocateNear(unsigned char *bitmap, int goal);
+  // Every run of free bits as (first bit, length), in bit order
+  void freeRuns(const unsigned char *bitmap, std::vector<std::pair<int, int> > &runs);
+
+  // Start keeping hints for a bitmap that matches the disk
+  void reset(const unsigned char *bitmap);
+  // Bring the hints up to date with a bitmap that is about to be written
+  // over `before`. Neither may change until this returns.
+  void update(const unsigned char *before, const unsigned char *after);
+  // Stop keeping hints, the bitmap can change without update calls
+  void forget();
+  // A bit was cleared in the caller's copy, so searches must look at it
+  // again before the copy is written
+  void release(int index);
+
+  // Free bits as of the last reset or update, -1 without hints
+  int freeCount();
+
+  // Free bits in a bitmap of count bits
+  static int countFree(const unsigned char *bitmap, int count);
+
+ private:
+  uint64_t loadWord(const unsigned char *bitmap, int word);
+  int findFree(const unsigned char *bitmap, int startWord, int endWord);
+  void advanceLowWater(const unsigned char *bitmap);
+  bool blockFull(int block);
+  static bool longerRun(const std::pair<int, int> &first, const std::pair<int, int> &second);
+
+  int count;
+  int words;
+  bool nextFit;
+  // Next-fit search start, as a word
+  int cursor;
+
+  bool hasHints;
+  // No word before this one has a free bit
+  int lowWater;
+  // Free bits in each bitmap block
+  std::vector<int> blockFree;
+  // Bits released in each block since the last reset or update
+  std::vector<int> blockReleased;
+  int totalFree;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _BLOCK_HASH_CACHE_H_
+#define _BLOCK_HASH_CACHE_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * Hashes of the data blocks LocalFileSystem wrote most recently.
+ *
+ * Overwrites use them to find blocks whose contents changed without
+ * reading them back. The hashes are only hints: a different hash means
+ * the block changed, but a matching one is confirmed by comparing with
+ * the block on disk before a write is skipped. So a stale hash, from a
+ * rollback or from another writer, costs at most an extra read or write.
+ */
+class BlockHashCache {
+ public:
+  BlockHashCache(size_t maxEntries);
+  ~BlockHashCache();
+
+  // Hash of what was last written to blockNumber, false if unknown
+  bool lookup(int blockNumber, uint64_t *hash);
+  void insert(int blockNumber, uint64_t hash);
+  // Drop the hashes of freed blocks
+  void forget(const std::vector<int> &blockNumbers);
+  void clear();
+
+  static uint64_t hash(const void *block);
+
+ private:
+  size_t maxEntries;
+  pthread_mutex_t lock;
+  std::unordered_map<int, uint64_t> hashes;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _DIRECTORY_CACHE_H_
+#define _DIRECTORY_CACHE_H_
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ufs.h"
+
+struct DirectoryCacheStats {
+  unsigned long hits;          // lookups answered with an inode number
+  unsigned long negativeHits;  // lookups answered with "not found"
+  unsigned long misses;        // lookups that had to scan the directory
+  unsigned long evictions;
+  unsigned long entries;
+  unsigned long bytes;
+};
+
+/**
+ * Directory entry cache for LocalFileSystem::lookup.
+ *
+ * Maps (parent inode, name) to an inode number. A directory is added
+ * whole the first time it is scanned. After that, names missing from a
+ * fully cached directory are known not to exist without going to disk.
+ * Names looked up in a directory that is only partly cached get negative
+ * entries.
+ *
+ * Entries are evicted least recently used first to stay within a memory
+ * budget. Evicting a positive entry means the directory is no longer
+ * fully cached.
+ *
+ * The names of each directory are also kept sorted, so a fully cached
+ * directory can be listed in name order without sorting it: a page
+ * starts with a seek and a prefix is a range of the index.
+ */
+class DirectoryCache {
+ public:
+  DirectoryCache(size_t budgetBytes);
+  ~DirectoryCache();
+
+  // On a hit returns true and sets inodeNumber, to -1 if name is known
+  // not to exist
+  bool lookup(int parentInodeNumber, const std::string &name, int *inodeNumber);
+  // Add every live entry of a directory that was just read from disk,
+  // unless it would take more than half of the budget
+  void fill(int parentInodeNumber, const std::vector<dir_ent_t> &entries);
+  // Record that name now maps to inodeNumber, -1 after an unlink
+  void insert(int parentInodeNumber, const std::string &name, int inodeNumber);
+  // For a fully cached directory, fill entries with up to maxEntries live
+  // entries whose names start with prefix and come after `after`, in
+  // strcmp order, and return true. False if it isn't fully cached.
+  bool list(int parentInodeNumber, const std::string &after, const std::string &prefix,
+            int maxEntries, std::vector<dir_ent_t> &entries);
+  // Forget a directory that was removed, its inode number can be reused
+  void invalidateDirectory(int inodeNumber);
+  void clear();
+  // Clear the cache if the disk's undo generation has changed since the
+  // last call, as a rollback may have undone changes it has seen
+  void checkGeneration(uint64_t generation);
+
+  DirectoryCacheStats stats();
+
+ private:
+  struct Key {
+    int parentInodeNumber;
+    std::string name;
+    bool operator==(const Key &other) const {
+      return parentInodeNumber == other.parentInodeNumber && name == other.name;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return std::hash<std::string>()(key.name) * 31 + key.parentInodeNumber;
+    }
+  };
+  struct Entry {
+    int inodeNumber;
+    std::list<Key>::iterator position;
+  };
+
+  void insertLocked(int parentInodeNumber, const std::string &name, int inodeNumber);
+  void erase(const Key &key);
+  void evict();
+  static size_t cost(const std::string &name);
+
+  size_t budgetBytes;
+  pthread_mutex_t lock;
+  uint64_t generation;
+
+  std::unordered_map<Key, Entry, KeyHash> entries;
+  // Most recently used at the front
+  std::list<Key> lru;
+  std::map<int, std::set<std::string> > namesByDirectory;
+  std::set<int> complete;
+  DirectoryCacheStats counters;
+};
+
+#endif
@@ -3,29 +3,219 @@
 
 #include <string>
 #include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "DiskStats.h"
+#include "Readahead.h"
+
+class IoUring;
+class LatencyModel;
+class Snapshot;
 
 struct UndoRecord {
   int blockNumber;
   unsigned char *blockData;
 };
 
+/**
+ * A transaction, owned by the thread that began it.
+ *
+ * Ordinary blocks written by a transaction belong to it until it ends and
+ * their old contents are kept in undoLog. Mergeable blocks (the bitmaps)
+ * are never owned. Instead each write is applied as the XOR of what the
+ * transaction changed since it last read the block, so transactions that
+ * flip different bits of the same bitmap block don't conflict.
+ */
+class Transaction {
+ public:
+  uint64_t id;
+  bool aborted;
+  std::set<int> writeSet;
+  std::deque<struct UndoRecord> undoLog;
+  // blockData holds the XOR delta this transaction applied
+  std::deque<struct UndoRecord> mergeUndoLog;
+  // Mergeable blocks as this transaction last saw them
+  std::map<int, std::vector<unsigned char> > readImages;
+  // Blocks to discard once the transaction commits
+  std::vector<int> discards;
+};
+
+class DiskBatch;
+
+// One submitted preadv/pwritev-sized run (or fsync) within a batch
+struct DiskRequest {
+  DiskBatch *batch;
+  ssize_t expectedBytes;
+  int op;
+};
+
+// A group of block I/Os submitted together, see Disk::submitReadBlocksV
+class DiskBatch {
+ public:
+  bool isWrite;
+  bool isSync;
+  int pending;
+  uint64_t submitTime;
+  std::vector<struct DiskRequest> requests;
+  // For a write, readahead leaves these blocks alone until it completes
+  std::vector<int> writeBlocks;
+};
+
 class Disk {
  public:
   Disk(std::string imageFile, int blockSize);
+  ~Disk();
   void readBlock(int blockNumber, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
   int numberOfBlocks();
 
-  void beginTransaction();
-  void commit();
+  /**
+   * Multi-block I/O.
+   *
+   * readBlocks/writeBlocks transfer `count` blocks starting at
+   * `startBlock` to or from one contiguous buffer of count * blockSize
+   * bytes.
+   *
+   * readBlocksV/writeBlocksV are the scatter-gather versions: iovecs[i]
+   * is the blockSize buffer for blockNumbers[i]. Runs of adjacent block
+   * numbers are coalesced into a single preadv/pwritev call.
+   */
+  void readBlocks(int startBlock, int count, void *buffer);
+  void writeBlocks(int startBlock, int count, void *buffer);
+  void readBlocksV(const std::vector<int> &blockNumbers, struct iovec *iovecs);
+  void writeBlocksV(const std::vector<int> &blockNumbers, struct iovec *iovecs);
+
+  /**
+   * Asynchronous block I/O.
+   *
+   * The submit calls queue every run of a batch with io_uring in one
+   * system call and return without waiting. complete() reaps the batch,
+   * and frees it. The iovecs and buffers must stay valid until then.
+   * Write batches end with an fsync that runs after all of their writes.
+   *
+   * When the kernel lacks io_uring the submit calls do the I/O
+   * synchronously with preadv/pwritev and complete() only frees the batch.
+   */
+  DiskBatch *submitReadBlocksV(const std::vector<int> &blockNumbers, struct iovec *iovecs);
+  DiskBatch *submitWriteBlocksV(const std::vector<int> &blockNumbers, struct iovec *iovecs);
+  void complete(DiskBatch *batch);
+  bool isAsync();
+
+  // Block sized buffers from the pool registered with io_uring. I/O on
+  // these uses fixed buffers, saving the per-I/O page pinning.
+  void *allocateBuffer();
+  void freeBuffer(void *buffer);
+
+  // Readahead: prefetch blocks the caller knows it will read soon, for
+  // example every direct block of a file before reading it
+  void prefetchBlocks(const std::vector<int> &blockNumbers);
+  ReadaheadStats readaheadStats();
+
+  // Per-region I/O counters and latency histograms. Setting DS3_TRACE to
+  // a file name in the environment also appends every I/O to that trace.
+  DiskStats *stats();
+
+  // Charge every physical I/O to a simulated device, see LatencyModel.h.
+  // The caller keeps ownership of the model. DiskStats::print reports
+  // the simulated time.
+  void setLatencyModel(LatencyModel *latencyModel);
+  LatencyModel *getLatencyModel();
+
+  // The overlay when imageFile is a ds3snap delta file, otherwise NULL
+  Snapshot *getSnapshot();
+
+  /**
+   * Transactions.
+   *
+   * Each thread can have one open transaction, which every read and write
+   * from that thread runs in. Transactions that write different blocks run
+   * in parallel. When two transactions want the same block the older one
+   * waits and the younger one is aborted: its writes are undone right away,
+   * later writes are ignored and commit() returns false so the caller can
+   * retry. Readers also wait for blocks that another transaction owns, so
+   * they never see uncommitted data outside of the mergeable blocks.
+   */
+  Transaction *beginTransaction();
+  bool commit();
   void rollback();
-  
+  // Give up this thread's transaction as if it had lost a conflict, for
+  // callers about to wait on a lock of their own that a transaction
+  // waiting for its blocks may hold
+  void abort();
+  Transaction *currentTransaction();
+  // Changes each time a transaction's writes are undone, so that caches
+  // of block contents know to reload
+  uint64_t undoGeneration();
+
+  // Mark blocks whose writes are merged bitwise, like the bitmaps
+  void setMergeable(int startBlock, int count);
+  // For callers that keep their own copy of a mergeable block: record
+  // image as what this thread's transaction last saw of it, so its next
+  // write only merges the bytes that differ from image
+  void setReadImage(int blockNumber, const void *image);
+
+  // Tell the host the contents of these blocks are no longer needed by
+  // punching holes in the image file, which then reads back as zeros.
+  // Inside a transaction the holes are punched when it commits. This is
+  // advisory and does nothing on file systems without hole punching.
+  void discardBlocks(const std::vector<int> &blockNumbers);
+
  private:
+  // Owns the ring and the buffer pool, so it can't be copied
+  Disk(const Disk &);
+  Disk &operator=(const Disk &);
+
+  void checkBlockNumbers(const std::vector<int> &blockNumbers);
+  bool waitForBlocks(Transaction *txn, const std::vector<int> &blockNumbers, bool acquire);
+  void saveUndoImages(Transaction *txn, const std::vector<int> &blockNumbers);
+  void writeMergeable(Transaction *txn, int blockNumber, void *buffer);
+  void abortTransaction(Transaction *txn);
+  void undoTransaction(Transaction *txn);
+  void endTransaction(Transaction *txn);
+  void writeRaw(int blockNumber, void *buffer);
+  void readRaw(int blockNumber, void *buffer);
+  bool isMergeable(int blockNumber);
+  void cancelDiscards(const std::vector<int> &blockNumbers);
+  void punchHoles(const std::vector<int> &blockNumbers);
+  void transferBlocksV(int fd, bool isWrite, const std::vector<int> &blockNumbers, struct iovec *iovecs);
+  DiskBatch *submitWrite(const std::vector<int> &blockNumbers, struct iovec *iovecs, bool wait);
+  DiskBatch *submitBlocksV(int op, const std::vector<int> &blockNumbers, struct iovec *iovecs, bool wait);
+  struct io_uring_sqe *getSqe();
+  void reapCompletions(unsigned waitNr);
+  bool isPoolBuffer(void *buffer);
+
   std::string imageFile;
   int blockSize;
   int imageFileSize;
-  bool isInTransaction;
-  std::deque<struct UndoRecord> undoLog;
+
+  pthread_mutex_t txnLock;
+  pthread_cond_t txnReleased;
+  pthread_mutex_t mergeLock;
+  // Guards transactions' discards, and is held while they are punched
+  pthread_mutex_t discardLock;
+  std::map<pthread_t, Transaction *> threadTransactions;
+  std::map<int, Transaction *> blockOwners;
+  std::vector<std::pair<int, int> > mergeableRanges;
+  uint64_t nextTxnId;
+  uint64_t undoCount;
+
+  int fd;
+  bool canPunchHoles;
+  Snapshot *snapshot;
+  IoUring *ring;
+  unsigned inFlight;
+  pthread_mutex_t ringLock;
+  unsigned char *bufferPool;
+  bool bufferPoolRegistered;
+  std::vector<void *> freeBuffers;
+  Readahead *readahead;
+  DiskStats *diskStats;
+  LatencyModel *latencyModel;
 };
 
 #endif
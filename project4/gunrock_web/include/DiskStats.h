@@ -0,0 +1,105 @@
+#ifndef _DISK_STATS_H_
+#define _DISK_STATS_H_
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ufs.h"
+
+class LatencyModel;
+
+// Regions of a UFS image, from the super_t layout
+#define REGION_SUPER        (0)
+#define REGION_INODE_BITMAP (1)
+#define REGION_DATA_BITMAP  (2)
+#define REGION_INODES       (3)
+#define REGION_DATA         (4)
+#define REGION_UNKNOWN      (5)
+#define NUM_REGIONS         (6)
+
+// Operations recorded in counters, histograms and traces
+#define DISK_OP_READ     (0)
+#define DISK_OP_WRITE    (1)
+#define DISK_OP_FSYNC    (2)
+#define DISK_OP_UNDO     (3)
+#define DISK_OP_BEGIN    (4)
+#define DISK_OP_COMMIT   (5)
+#define DISK_OP_ROLLBACK (6)
+#define NUM_DISK_OPS     (7)
+
+// Latency histogram buckets are powers of two microseconds
+#define LATENCY_BUCKETS (24)
+
+// One record of the binary trace file, see DiskStats::openTrace
+struct DiskTraceRecord {
+  uint64_t timestamp; // nanoseconds, CLOCK_MONOTONIC
+  uint32_t op;        // DISK_OP_*
+  int32_t block;      // -1 for operations without a block
+  uint64_t txnId;     // 0 outside of a transaction
+};
+
+struct RegionCounters {
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long fsyncs;
+  unsigned long undoRecords;
+  // Bytes that didn't need writing because the block already held them
+  unsigned long bytesAvoided;
+};
+
+/**
+ * Block I/O accounting for Disk.
+ *
+ * Counts reads, writes, fsyncs and undo records for each region of the
+ * image and keeps a latency histogram for each kind of I/O. Optionally
+ * appends every operation to a binary trace that ds3trace can summarize
+ * or replay.
+ */
+class DiskStats {
+ public:
+  DiskStats();
+  ~DiskStats();
+
+  // Classify blocks by region. Until this is called only the super
+  // block is known.
+  void setLayout(const super_t *super);
+  int regionForBlock(int blockNumber);
+
+  // Record one operation on each block, all in the same transaction
+  void record(int op, const std::vector<int> &blockNumbers, uint64_t txnId);
+  // Record an operation that isn't tied to a block, like a commit
+  void record(int op, uint64_t txnId);
+  void recordLatency(int op, uint64_t nanoseconds);
+  // Record writes that were skipped because the blocks were unchanged
+  void recordAvoided(const std::vector<int> &blockNumbers);
+
+  bool openTrace(std::string traceFile);
+  // print also reports the simulated device time of this model
+  void setLatencyModel(LatencyModel *latencyModel);
+
+  RegionCounters counters(int region);
+  unsigned long latencyBucket(int op, int bucket);
+  void print(std::ostream &out);
+  void reset();
+
+  static uint64_t now();
+  static const char *regionName(int region);
+  static const char *opName(int op);
+
+ private:
+  void appendTrace(const std::vector<struct DiskTraceRecord> &records);
+
+  pthread_mutex_t lock;
+  bool hasLayout;
+  super_t super;
+  RegionCounters regionCounters[NUM_REGIONS];
+  unsigned long latencies[NUM_DISK_OPS][LATENCY_BUCKETS];
+  int traceFd;
+  LatencyModel *latencyModel;
+};
+
+#endif
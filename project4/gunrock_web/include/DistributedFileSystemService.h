@@ -3,19 +3,52 @@
 
 #include "HttpService.h"
 #include "LocalFileSystem.h"
+#include "PathCache.h"
 
+#include <map>
 #include <string>
+#include <vector>
 
 class DistributedFileSystemService : public HttpService {
  public:
+  // driveFile can be a ds3snap delta file. GETs with ?snapshot=1 are
+  // then served from its base image, a consistent point-in-time view,
+  // while PUTs, DELETEs and MOVEs go to the delta.
   DistributedFileSystemService(std::string driveFile);
 
+  // GET /ds3/?stats=1 returns the free and total inodes and data blocks
+  // and the path cache's hit rate and lookups avoided per resolve
   virtual void get(HTTPRequest *request, HTTPResponse *response);
+  // With ?bulk=tar the body is a tar archive, which is unpacked below the
+  // path in one transaction
   virtual void put(HTTPRequest *request, HTTPResponse *response);
+  // Changes part of a file without sending all of it. The body is
+  // appended, or written at ?offset=N, and ?truncate=N sets the size.
+  // Missing files are created like PUT, except for truncate. GETs of a
+  // file take ?offset=N&length=M to read part of it. ?defrag=1
+  // defragments the file or everything below the directory, root
+  // included, while other requests carry on.
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  // The new path is in a Destination header, like /ds3/x/y.txt
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
 
 private:
+  std::vector<std::string> pathComponents(HTTPRequest *request);
+  int resolve(PathCache *pathCache, const std::vector<std::string> &path, size_t length);
+  void putBulk(const std::vector<std::string> &path, const std::string &archive);
+  void defragment(const std::vector<std::string> &path, HTTPResponse *response);
+  void stats(HTTPResponse *response);
+  std::string pathCacheStats();
+  void checkSpace(const std::vector<std::string> &path, int offset, int size);
+  int bulkDirectory(const std::vector<std::string> &path, size_t length, std::vector<BatchOperation> &operations,
+                    std::vector<std::vector<std::string> > &paths, std::map<std::string, int> &directories);
+  int createDirectories(const std::vector<std::string> &path, size_t length, std::vector<int> &inodeNumbers);
+
   LocalFileSystem *fileSystem;
+  LocalFileSystem *snapshotFileSystem;
+  PathCache *pathCache;
+  PathCache *snapshotPathCache;
 };
 
 #endif
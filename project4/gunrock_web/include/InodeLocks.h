@@ -0,0 +1,38 @@
+#ifndef _INODE_LOCKS_H_
+#define _INODE_LOCKS_H_
+
+#include <vector>
+
+#include <pthread.h>
+
+/**
+ * A reader-writer lock for each inode, plus one for the whole namespace.
+ *
+ * Writers are preferred, so a stream of readers can't starve a write.
+ * Numbers outside the table have nothing to lock and are ignored, the
+ * caller will fail them anyway. The locks are not recursive.
+ */
+class InodeLocks {
+ public:
+  InodeLocks(int count);
+  ~InodeLocks();
+
+  // False instead of waiting when the lock is taken
+  bool tryLock(int inodeNumber, bool exclusive);
+  void lock(int inodeNumber, bool exclusive);
+  void unlock(int inodeNumber);
+
+  bool tryLockNamespace(bool exclusive);
+  void lockNamespace(bool exclusive);
+  void unlockNamespace();
+
+ private:
+  static void initLock(pthread_rwlock_t *lock);
+  static bool tryLock(pthread_rwlock_t *lock, bool exclusive);
+  static void lock(pthread_rwlock_t *lock, bool exclusive);
+
+  std::vector<pthread_rwlock_t> locks;
+  pthread_rwlock_t namespaceLock;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _IO_URING_H_
+#define _IO_URING_H_
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/**
+ * A minimal io_uring submission/completion ring built directly on the
+ * io_uring_setup and io_uring_enter system calls.
+ *
+ * The ring is not thread safe, callers serialize access to it. If the
+ * kernel does not support io_uring, isAvailable() returns false and the
+ * ring must not be used.
+ */
+class IoUring {
+ public:
+  IoUring(unsigned entries);
+  ~IoUring();
+  bool isAvailable();
+
+  // Register one contiguous buffer as fixed buffer index 0
+  bool registerBuffer(void *buffer, size_t size);
+
+  // Get the next free submission queue entry, or NULL if the queue is full
+  struct io_uring_sqe *getSqe();
+
+  // Submit queued entries and wait for at least waitNr completions
+  int submitAndWait(unsigned waitNr);
+
+  // Copy out the next completion, returns false if there is none
+  bool peekCqe(struct io_uring_cqe *cqe);
+
+  unsigned sqEntries();
+  unsigned cqEntries();
+
+ private:
+  void teardown();
+
+  int ringFd;
+  struct io_uring_params params;
+
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned sqLocalTail;
+
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef _LATENCY_MODEL_H_
+#define _LATENCY_MODEL_H_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * Simulated device time for Disk.
+ *
+ * A model attached with Disk::setLatencyModel sees every physical I/O
+ * the disk issues and advances a virtual clock by the time the modeled
+ * device would have taken. Nothing sleeps, so benchmarks run at full
+ * speed while still reporting device time.
+ *
+ * Operations use the DISK_OP_* numbering from DiskStats.h.
+ */
+class LatencyModel {
+ public:
+  LatencyModel();
+  virtual ~LatencyModel();
+
+  // Account for one batch of blocks, in the order they are issued
+  void access(int op, const std::vector<int> &blockNumbers);
+
+  // Simulated nanoseconds since creation or the last reset()
+  uint64_t elapsed();
+  void reset();
+  virtual std::string name() = 0;
+
+  // "hdd", "ssd" or "flat", NULL for anything else
+  static LatencyModel *create(std::string name, int numberOfBlocks);
+
+ protected:
+  // Time the device needs for the batch, starting at clock
+  virtual uint64_t cost(int op, const std::vector<int> &blockNumbers, uint64_t clock) = 0;
+
+ private:
+  pthread_mutex_t lock;
+  uint64_t clock;
+};
+
+// Every block costs the same, whatever the operation or position
+class FlatLatencyModel : public LatencyModel {
+ public:
+  FlatLatencyModel(uint64_t blockNanoseconds, uint64_t fsyncNanoseconds);
+  virtual std::string name();
+
+ protected:
+  virtual uint64_t cost(int op, const std::vector<int> &blockNumbers, uint64_t clock);
+
+ private:
+  uint64_t blockNanoseconds;
+  uint64_t fsyncNanoseconds;
+};
+
+// A single spindle: seek time grows with the square root of the track
+// distance and rotational delay depends on where the platter is when the
+// head arrives, so sequential blocks on a track transfer back to back.
+class HddLatencyModel : public LatencyModel {
+ public:
+  HddLatencyModel(int numberOfBlocks, int blocksPerTrack, int rpm,
+                  uint64_t minSeekNanoseconds, uint64_t maxSeekNanoseconds);
+  virtual std::string name();
+
+ protected:
+  virtual uint64_t cost(int op, const std::vector<int> &blockNumbers, uint64_t clock);
+
+ private:
+  int numberOfTracks;
+  int blocksPerTrack;
+  uint64_t rotationNanoseconds;
+  uint64_t minSeekNanoseconds;
+  uint64_t maxSeekNanoseconds;
+  int headTrack;
+};
+
+// Fixed per-operation latency, with a batch spread over parallel channels
+class SsdLatencyModel : public LatencyModel {
+ public:
+  SsdLatencyModel(int channels, uint64_t readNanoseconds, uint64_t writeNanoseconds,
+                  uint64_t fsyncNanoseconds);
+  virtual std::string name();
+
+ protected:
+  virtual uint64_t cost(int op, const std::vector<int> &blockNumbers, uint64_t clock);
+
+ private:
+  int channels;
+  uint64_t readNanoseconds;
+  uint64_t writeNanoseconds;
+  uint64_t fsyncNanoseconds;
+};
+
+#endif
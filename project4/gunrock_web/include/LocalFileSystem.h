@@ -1,9 +1,17 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <map>
 #include <string>
+#include <vector>
 
+#include <pthread.h>
+
+#include "BitmapAllocator.h"
+#include "BlockHashCache.h"
 #include "Disk.h"
+#include "DirectoryCache.h"
+#include "InodeLocks.h"
 #include "ufs.h"
 
 /**
@@ -44,9 +52,72 @@
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
 
+// Operations for LocalFileSystem::batch
+#define BATCH_CREATE (0)
+#define BATCH_UNLINK (1)
+
+// One step of a LocalFileSystem::batch
+struct BatchOperation {
+  int op;                 // BATCH_CREATE or BATCH_UNLINK
+  int parentInodeNumber;
+  // When >= 0, the parent is instead the directory created by this
+  // earlier operation, so a batch can build a whole tree
+  int parentOperation;
+  std::string name;
+  int type;               // for BATCH_CREATE
+  // For BATCH_CREATE of a regular file, the contents to write as if by
+  // write(). NULL leaves an existing file as it is. Must stay valid
+  // until batch returns.
+  const void *data;
+  int size;
+  // Set by batch: the inode number for a create, 0 for an unlink, or
+  // the error that stopped the batch
+  int result;
+};
+
+// What LocalFileSystem::defragment and the calls it makes did
+struct DefragStats {
+  int directoriesCompacted;
+  int entriesRemoved;       // unused entries dropped
+  int directoryBlocksFreed;
+  int filesRelocated;
+  int extentsBefore;        // of the files relocated
+  int extentsAfter;
+};
+
+// Tries at each transaction of defragment, and blocks copied at a time
+#define DEFRAG_ATTEMPTS (3)
+#define DEFRAG_COPY_BLOCKS (256)
+
+// Most blocks of a file or directory read ahead for a sequential reader
+#define PREFETCH_BLOCKS (32)
+
+struct BatchState;
+struct BatchDirectory;
+
+// Locking
+//
+// Calls from many threads can run at once. Each inode has a reader-writer
+// lock: reading a file or directory takes it shared, and changing a file,
+// or a directory's entries, takes it exclusively. Every call but stat also
+// takes a namespace lock shared, except rename and batch, which move whole
+// subtrees and take it exclusively instead of any inode locks.
+//
+// Lock order: the namespace lock, then a directory before anything in it.
+// Only unlink holds two inode locks, the parent's and then the child's.
+// Below those come the inode bitmap, the data bitmap and the inode table,
+// each with a mutex that is held only from reading the region to writing
+// it back, never across other I/O.
+//
+// Inside a transaction, a call that would wait for an inode lock while
+// its transaction holds blocks gives the transaction up first, since the
+// holder of the lock may be waiting for those blocks. Its commit() then
+// fails as if it had lost a conflict.
+
 class LocalFileSystem {
  public:
   LocalFileSystem(Disk *disk);
+  ~LocalFileSystem();
   /**
    * Lookup an inode.
    *
@@ -113,6 +184,40 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read the entries of a directory a block at a time.
+   *
+   * Fills entries with up to maxEntries live entries, in the order they
+   * are on disk, reading only the directory blocks it needs. *cursor is
+   * the slot to start from, 0 the first time, and is moved past the last
+   * slot looked at, so it can be kept as a resume token for a later
+   * call. Slots don't move, except when compactDirectory runs in
+   * between, and entries created or removed in between may or may not
+   * show up.
+   *
+   * Success: number of entries filled in, 0 once the directory is done
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber or not a directory, negative
+   * cursor or maxEntries.
+   */
+  int readdir(int inodeNumber, int *cursor, dir_ent_t *entries, int maxEntries);
+  /**
+   * Read the entries of a directory in name order.
+   *
+   * Replaces entries with up to maxEntries live entries whose names start
+   * with prefix and come after `after` ("" for the first page), sorted
+   * with strcmp. With the directory cache the sorted index is built once
+   * per directory and kept up to date, so each call is a seek and a walk.
+   * Otherwise the directory is read and sorted each time.
+   *
+   * Success: number of entries, 0 once there are no more
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber or not a directory, negative
+   * maxEntries.
+   */
+  int readdirSorted(int inodeNumber, std::string after, std::string prefix,
+                    std::vector<dir_ent_t> &entries, int maxEntries);
+
   /**
    * Remove a file or directory.
    *
@@ -126,6 +231,102 @@ class LocalFileSystem {
    * existing is NOT a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Read part of a file or directory.
+   *
+   * Reads up to `size` bytes starting at `offset`, only touching the
+   * blocks in that range. Reading at or past the end returns 0.
+   *
+   * Success: number of bytes read
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, negative offset or size.
+   */
+  int readAt(int inodeNumber, int offset, void *buffer, int size);
+  /**
+   * Write part of a file.
+   *
+   * Writes `size` bytes at `offset`, keeping the rest of the file and
+   * only touching the blocks in that range. The file grows if the write
+   * goes past its end, and any gap before offset reads back as zeros.
+   * If the disk fills up, writes as much as fits.
+   *
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE.
+   * Failure modes: invalid inodeNumber, negative offset or size, the end
+   * is past maxFileSize(), not a regular file.
+   */
+  int writeAt(int inodeNumber, int offset, const void *buffer, int size);
+  // writeAt the current end of the file
+  int append(int inodeNumber, const void *buffer, int size);
+  /**
+   * Set the size of a file.
+   *
+   * Shrinking frees the blocks past the new end, growing adds zeros.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, size is negative or more than
+   * maxFileSize(), not a regular file, not enough space to grow, in which
+   * case nothing changes.
+   */
+  int truncate(int inodeNumber, int size);
+  /**
+   * Apply many creates, writes and unlinks at once.
+   *
+   * Each operation behaves like the create (followed by write) or unlink
+   * call it stands for, in order, and allocates the same inodes and
+   * blocks. But everything is worked out in memory first, then the data
+   * blocks, directory blocks, bitmaps and inode table are each written
+   * once. Callers wrap it in a transaction for a single commit.
+   *
+   * Success: 0
+   * Failure: the first operation's error, any of the create, write or
+   * unlink errors. Nothing is written to disk.
+   */
+  int batch(std::vector<BatchOperation> &operations);
+  /**
+   * Move a file or directory.
+   *
+   * Moves name in parentInodeNumber to newName in newParentInodeNumber,
+   * keeping its inode. A directory that changes parent gets its ".."
+   * updated.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -ENOTFOUND, -EINVALIDNAME, -EUNLINKNOTALLOWED,
+   * -ENOTENOUGHSPACE.
+   * Failure modes: either parent does not exist or isn't a directory, name
+   * does not exist, newName already exists, a directory would move below
+   * itself, or either name is invalid or '.' or '..'.
+   */
+  int rename(int parentInodeNumber, std::string name, int newParentInodeNumber, std::string newName);
+  /**
+   * Defragment a directory or a file.
+   *
+   * compactDirectory moves the live entries of a directory to the front,
+   * keeping their order, and frees the blocks past the last one. relocate
+   * copies a file split over several runs of blocks into fewer runs, if
+   * the free space allows, and frees its old blocks. Both add what they
+   * did to stats.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDTYPE.
+   * Failure modes: invalid inodeNumber, not a directory for
+   * compactDirectory or not a regular file for relocate.
+   */
+  int compactDirectory(int inodeNumber, DefragStats *stats);
+  int relocate(int inodeNumber, DefragStats *stats);
+  /**
+   * Defragment a file, or a directory and everything below it, while
+   * other calls carry on. Call it outside a transaction: each directory
+   * and file is done in a transaction of its own, tried up to
+   * DEFRAG_ATTEMPTS times when it loses a conflict.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE.
+   * Failure modes: invalid inodeNumber.
+   */
+  int defragment(int inodeNumber, DefragStats *stats);
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -135,7 +336,9 @@ class LocalFileSystem {
    */
   void readSuperBlock(super_t *super);
 
-  // Helper functions, you should read/write the entire inode and bitmap regions
+  // Helper functions, you should read/write the entire inode and bitmap regions.
+  // Bitmap buffers hold (num_inodes + 7) / 8 or (num_data + 7) / 8 bytes and
+  // the inode buffer holds num_inodes inodes.
   void readInodeBitmap(super_t *super, unsigned char *inodeBitmap);
   void writeInodeBitmap(super_t *super, unsigned char *inodeBitmap);
   void readDataBitmap(super_t *super, unsigned char *dataBitmap);
@@ -143,10 +346,164 @@ class LocalFileSystem {
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
 
+  // The image's format version, see ufs.h, and the largest file it holds
+  int formatVersion();
+  int maxFileSize();
+  // Free inodes and data blocks. With the metadata cache they come from
+  // counts kept up to date as the bitmaps change, so they take constant
+  // time, otherwise they count the bitmaps.
+  int freeInodes();
+  int freeDataBlocks();
+  // Data blocks, indirect blocks included, that writing size bytes at
+  // offset of file inodeNumber adds. offset -1 is the end of the file
+  // and inodeNumber -1 a new file. 0 for writes the write itself rejects.
+  int blocksNeeded(int inodeNumber, int offset, int size);
+  // Every data block of a file in order, and the indirect blocks that
+  // point at them: the indirect block, then the double indirect block
+  // and the blocks it points at. Version 1 files have none, and files
+  // stored inline no blocks at all.
+  void fileBlocks(inode_t *inode, std::vector<int> &blockNumbers, std::vector<int> &indirectBlocks);
+
+  // Punch holes in the image for data blocks that write and unlink free,
+  // so the image file only takes up space on the host for live data.
+  // Also turned on by DS3_PUNCH_HOLES in the environment.
+  void setPunchHoles(bool punchHoles);
+
+  // Keep the super block, bitmaps and inode table in memory so the helpers
+  // above don't go to disk on every call. Writes compare against the cache
+  // and only write the blocks that changed, and a transaction rollback
+  // drops the cache. Assumes nothing else writes the image meanwhile.
+  // Also turned on by DS3_METADATA_CACHE in the environment.
+  void setMetadataCache(bool cacheMetadata);
+  // Start each inode and block search where the last one ended instead of
+  // taking the lowest free entry, see BitmapAllocator.h. Also turned on by
+  // DS3_NEXT_FIT in the environment.
+  void setNextFitAllocation(bool nextFit);
+  // Give each write of a file one contiguous run of blocks where possible,
+  // continuing from the file's last block, and put directory blocks next
+  // to their parent's. Also turned on by DS3_EXTENT_ALLOCATION in the
+  // environment.
+  void setExtentAllocation(bool extentAllocation);
+
+  // Answer lookups from an in-memory index of directory entries using at
+  // most budgetBytes, see DirectoryCache.h. 0 turns it off.
+  void setDirectoryCache(size_t budgetBytes);
+  DirectoryCacheStats directoryCacheStats();
+  // Remember the hashes of up to maxEntries data blocks as they are
+  // written, so overwrites can tell which blocks changed without reading
+  // them back, see BlockHashCache.h. 0 turns it off.
+  void setBlockHashCache(size_t maxEntries);
+
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+ private:
+  // A bitmap or the inode table as last read or written
+  struct CachedRegion {
+    std::vector<unsigned char> data;
+    bool loaded;
+    uint64_t generation;
+  };
+
+  // The calls above, for callers that already hold the locks they need
+  int lookupLocked(int parentInodeNumber, std::string name);
+  int createLocked(int parentInodeNumber, int type, std::string name);
+  int writeLocked(int inodeNumber, const void *buffer, int size);
+  int readAtLocked(int inodeNumber, int offset, void *buffer, int size);
+  int readdirLocked(int inodeNumber, int *cursor, dir_ent_t *entries, int maxEntries);
+  int readdirSortedLocked(int inodeNumber, std::string after, std::string prefix,
+                          std::vector<dir_ent_t> &entries, int maxEntries);
+  int truncateLocked(int inodeNumber, int size);
+  int unlinkLocked(int parentInodeNumber, std::string name);
+  int renameLocked(int parentInodeNumber, std::string name, int newParentInodeNumber, std::string newName);
+  int compactDirectoryLocked(int inodeNumber, DefragStats *stats);
+  int relocateLocked(int inodeNumber, DefragStats *stats);
+  int batchLocked(std::vector<BatchOperation> &operations);
+  void lockNamespace(bool exclusive);
+  void lockInode(int inodeNumber, bool exclusive);
+  void abortBeforeWaiting();
+  bool inodeAllocated(super_t *super, int inodeNumber);
+  void readInode(super_t *super, int inodeNumber, inode_t *inode);
+  void writeInode(super_t *super, int inodeNumber, const inode_t *inode);
+  void updateInodes(super_t *super, const std::map<int, inode_t> &inodes);
+  int allocateBlocks(super_t *super, inode_t *inode, int blocks, int newBlocks, bool allOrNothing);
+  // Block maps, see ufs.h for the version 2 and 3 layouts
+  bool usesExtents(inode_t *inode);
+  int directPointers();
+  int indirectBlockCount(int blocks);
+  int extentCount(inode_t *inode, int blocks);
+  void mapBlocks(inode_t *inode, int first, int count, std::vector<int> &blockNumbers);
+  void prefetchFile(inode_t *inode, int first, int count);
+  void indirectBlocks(inode_t *inode, int blocks, std::vector<int> &indirectBlocks);
+  void setBlocks(inode_t *inode, int first, const std::vector<int> &blockNumbers,
+                 const std::vector<int> &indirectBlocks);
+  void setPointer(std::map<int, std::vector<unsigned int> > &pointerBlocks,
+                  const std::vector<int> &indirectBlocks, int existing, int index, int slot, int blockNumber);
+  void dropBlocks(inode_t *inode, int blocks, int newBlocks, std::vector<int> &released);
+  void clearPointers(inode_t *inode, int blocks);
+  bool fitsInline(int size);
+  bool isInline(inode_t *inode);
+  int dataBlocks(inode_t *inode);
+  void setInline(inode_t *inode, const void *data, int size);
+  static int countExtents(const std::vector<int> &blockNumbers);
+  static int extentsFit(int extents, int goal, const std::vector<int> &freeBlocks);
+  int mergeExtents(super_t *super, inode_t *inode, int blocks, int newBlocks, unsigned char *dataBitmap,
+                   std::vector<int> &run);
+  void copyBlocks(const std::vector<int> &from, const std::vector<int> &to);
+  void freeBlocks(super_t *super, const std::vector<int> &blockNumbers);
+  void readRegion(int startBlock, int numBlocks, void *buffer, int size);
+  void writeRegion(int startBlock, int numBlocks, const void *buffer, int size);
+  void readData(inode_t *inode, int offset, void *buffer, int size);
+  void writeData(inode_t *inode, int offset, const void *buffer, int size, int oldSize);
+  void readDirectory(inode_t *inode, std::vector<dir_ent_t> &entries);
+  int findEntry(const std::vector<dir_ent_t> &entries, std::string name);
+  void releaseBlocks(const std::vector<int> &blockNumbers);
+  // Callers hold the inode's lock
+  int writeRange(int inodeNumber, int offset, const void *buffer, int size, bool allOrNothing);
+  int reserveEntry(super_t *super, inode_t *parent, const std::vector<dir_ent_t> &entries,
+                   unsigned char *dataBitmap, bool *newBlock);
+  void writeEntry(inode_t *directory, int slot, bool newBlock, std::string name, int inodeNumber);
+  int allocateDirectoryBlock(super_t *super, inode_t *parent, unsigned char *dataBitmap);
+  int batchCreate(BatchState *state, int parentInodeNumber, BatchOperation *operation);
+  int batchWrite(BatchState *state, int inodeNumber, const void *data, int size);
+  int batchUnlink(BatchState *state, int parentInodeNumber, BatchOperation *operation);
+  BatchDirectory *batchDirectory(BatchState *state, int inodeNumber);
+  void batchCommit(BatchState *state);
+  bool loadRegion(CachedRegion *region, int startBlock, int numBlocks, BitmapAllocator *allocator,
+                  bool reload);
+  int cachedFreeCount(CachedRegion *region, int startBlock, int numBlocks, BitmapAllocator *allocator,
+                      pthread_mutex_t *lock);
+  DirectoryCache *currentDirectoryCache();
+  void writeCachedRegion(int startBlock, std::vector<unsigned char> &cache, size_t first,
+                         const void *buffer, int size, int unitSize);
+
+  static bool compareEntries(const dir_ent_t &first, const dir_ent_t &second);
+  static bool testBit(const unsigned char *bitmap, int index);
+  static void clearBit(unsigned char *bitmap, int index);
+  static void initDirectoryBlock(dir_ent_t *block);
+
+  int version;
+  bool inlineData;
+  bool punchHoles;
+
+  bool cacheMetadata;
+  super_t cachedSuper;
+  CachedRegion inodeBitmapCache;
+  CachedRegion dataBitmapCache;
+  CachedRegion inodeTableCache;
+
+  InodeLocks *inodeLocks;
+  pthread_mutex_t inodeBitmapLock;
+  pthread_mutex_t dataBitmapLock;
+  pthread_mutex_t inodeTableLock;
+
+  BitmapAllocator *inodeAllocator;
+  BitmapAllocator *dataAllocator;
+  bool extentAllocation;
+  DirectoryCache *directoryCache;
+  BlockHashCache *blockHashes;
 };  
 
 #endif
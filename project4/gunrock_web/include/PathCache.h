@@ -0,0 +1,77 @@
+#ifndef _PATH_CACHE_H_
+#define _PATH_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "LocalFileSystem.h"
+
+struct PathCacheStats {
+  unsigned long resolves;        // calls to resolve
+  unsigned long hits;            // resolves answered without any lookup
+  unsigned long partialHits;     // resolves that started below the root
+  unsigned long misses;          // resolves that walked from the root
+  unsigned long lookups;         // LocalFileSystem::lookup calls made
+  unsigned long lookupsAvoided;  // path components answered by the cache
+  unsigned long invalidations;
+  unsigned long entries;
+};
+
+/**
+ * Full path to inode number cache for the DS3 service.
+ *
+ * resolve() starts from the longest cached prefix of a path and only
+ * calls LocalFileSystem::lookup for the components below it, adding each
+ * prefix it resolves. Only paths that exist are cached, so creating
+ * files never needs an invalidation, but anything that removes or moves
+ * a path must call invalidate() for it after committing.
+ *
+ * Lookups in the cache run concurrently under a read lock. A resolve
+ * that raced with an invalidation does not add what it found, and a
+ * transaction rollback on the disk empties the cache.
+ */
+class PathCache {
+ public:
+  PathCache(LocalFileSystem *fileSystem, size_t maxEntries);
+  ~PathCache();
+
+  // Inode number of the first `length` components of path, or the
+  // error from LocalFileSystem::lookup
+  int resolve(const std::vector<std::string> &path, size_t length);
+  // Record an inode number for a path that was just created
+  void insert(const std::vector<std::string> &path, size_t length, int inodeNumber);
+  // Forget a path and everything below it
+  void invalidate(const std::vector<std::string> &path, size_t length);
+  void clear();
+
+  PathCacheStats stats();
+
+ private:
+  struct Entry {
+    int inodeNumber;
+    // Set on every hit, cleared by the eviction sweep
+    bool referenced;
+  };
+
+  static std::string key(const std::vector<std::string> &path, size_t length);
+  void checkGeneration();
+  void insertLocked(const std::string &key, int inodeNumber);
+  void evict();
+
+  LocalFileSystem *fileSystem;
+  size_t maxEntries;
+  pthread_rwlock_t lock;
+  pthread_mutex_t statsLock;
+  // Ordered so that everything below a path is one range
+  std::map<std::string, Entry> entries;
+  uint64_t generation;
+  // Bumped by every invalidation
+  uint64_t version;
+  PathCacheStats counters;
+};
+
+#endif
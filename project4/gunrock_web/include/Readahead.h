@@ -0,0 +1,82 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+class Disk;
+class DiskBatch;
+
+struct ReadaheadStats {
+  unsigned long prefetched; // blocks read ahead of demand
+  unsigned long hits;       // demand reads served from prefetched blocks
+  unsigned long wasted;     // prefetched blocks evicted or invalidated unread
+  int window;               // current readahead window, in blocks
+};
+
+/**
+ * Sequential readahead for Disk.
+ *
+ * Demand reads are reported with access(). When a read starts where the
+ * previous one ended, the next `window` blocks are submitted as one
+ * asynchronous batch and kept in a small cache until a demand read
+ * consumes them. Callers that know their future reads, like a file's
+ * direct blocks, can pass them to hint() instead.
+ *
+ * The window doubles each time a full window is consumed and halves when
+ * prefetched blocks are thrown away unread.
+ */
+class Readahead {
+ public:
+  Readahead(Disk *disk, int blockSize, int capacity);
+  ~Readahead();
+
+  // Copy a prefetched block into buffer, returns false on a miss
+  bool lookup(int blockNumber, void *buffer);
+  // Record a demand read of count blocks and read ahead if it is sequential
+  void access(int startBlock, int count);
+  // Prefetch blocks that are known to be read soon
+  void hint(const std::vector<int> &blockNumbers);
+  // Drop a block that is about to be overwritten
+  void invalidate(int blockNumber);
+  // Drop blocks a write is about to change and don't read them ahead
+  // until endWrite, so a prefetch can't race the write and keep what was
+  // there before
+  void beginWrite(const std::vector<int> &blockNumbers);
+  void endWrite(const std::vector<int> &blockNumbers);
+
+  ReadaheadStats stats();
+
+ private:
+  struct CachedBlock {
+    void *buffer;
+    DiskBatch *batch; // in-flight read, NULL once it has completed
+  };
+
+  void prefetch(const std::vector<int> &blockNumbers);
+  void waitFor(DiskBatch *batch);
+  void evict(int blockNumber);
+
+  Disk *disk;
+  int blockSize;
+  int capacity;
+  pthread_mutex_t lock;
+
+  std::map<int, CachedBlock> cache;
+  std::deque<int> fifo;
+  std::map<DiskBatch *, std::vector<struct iovec> *> batchIovecs;
+  // Blocks with writes in flight, and how many
+  std::map<int, int> writing;
+
+  int nextExpected;
+  int prefetchedUpTo;
+  int window;
+  int hitsInWindow;
+  ReadaheadStats counters;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define SNAPSHOT_MAGIC "DS3SNAP"
+#define SNAPSHOT_VERSION (1)
+
+// Block 0 of a delta file
+struct SnapshotHeader {
+  char magic[8];
+  int version;
+  int blockSize;
+  int numberOfBlocks;
+  char baseImage[1024];
+};
+
+/**
+ * A copy-on-write overlay over a read-only base image.
+ *
+ * Writes go to a delta file and never touch the base, so the base stays
+ * a consistent point-in-time view for as long as the delta exists. The
+ * delta file holds a header block, a bitmap of the blocks written so far
+ * and then one slot per base block, at the same position as in the base.
+ * Slots that were never written are holes, so the delta only takes up
+ * space for changed blocks.
+ *
+ * Disk opens delta files transparently, so every tool works on them.
+ * merge() folds the changes back into the base.
+ */
+class Snapshot {
+ public:
+  // Open the delta file behind fd, which Disk already opened
+  Snapshot(std::string deltaFile, int fd);
+  ~Snapshot();
+
+  static bool isSnapshot(int fd);
+  static void create(std::string deltaFile, std::string baseImage, int blockSize);
+
+  int numberOfBlocks();
+  std::string baseImage();
+  int changedBlocks();
+
+  // Same contract as Disk::transferBlocksV, blocks come from the delta
+  // when they have been written and from the base otherwise
+  void transferBlocksV(bool isWrite, const std::vector<int> &blockNumbers, struct iovec *iovecs);
+  void sync();
+
+  // Copy every changed block into the base image
+  void merge();
+
+ private:
+  void transfer(int fd, bool isWrite, off_t offset, struct iovec *iovecs, int iovcnt);
+  bool isChanged(int blockNumber);
+
+  int fd;
+  int baseFd;
+  struct SnapshotHeader header;
+  int bitmapBlocks;
+  std::vector<unsigned char> bitmap;
+  pthread_mutex_t lock;
+};
+
+#endif
@@ -12,6 +12,34 @@
 
 #define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
 
+// Version 2 images keep the last two pointers of a regular file for an
+// indirect block and a double indirect block, each holding
+// UFS_PTRS_PER_BLOCK pointers. Directories only use the direct ones.
+#define UFS_MAGIC (0x55465332)
+#define DIRECT_PTRS_V2 (DIRECT_PTRS - 2)
+#define INDIRECT_PTR (DIRECT_PTRS - 2)
+#define DOUBLE_INDIRECT_PTR (DIRECT_PTRS - 1)
+#define UFS_PTRS_PER_BLOCK (UFS_BLOCK_SIZE / 4)
+
+// size is an int, so that is the limit rather than the pointers
+#define MAX_FILE_SIZE_V2 (0x7fffffff / UFS_BLOCK_SIZE * UFS_BLOCK_SIZE)
+
+// Version 3 images map a regular file with extents instead: its pointers
+// pair up into UFS_EXTENTS runs of blocks, in file order, each a first
+// block and a length. Unused extents are (-1, 0). The size limit is the
+// same as version 2's.
+#define UFS_EXTENTS (DIRECT_PTRS / 2)
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+} extent_t;
+
+// Images with UFS_INLINE_DATA in their features, of any version, keep a
+// regular file of up to UFS_INLINE_SIZE bytes in the pointers of its
+// inode instead of in a data block
+#define UFS_INLINE_DATA (1)
+#define UFS_INLINE_SIZE (DIRECT_PTRS * 4)
+
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
 typedef struct {
@@ -38,7 +66,13 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int magic;             // UFS_MAGIC from version 2 on or with features, 0 before
+    int version;           // format version when magic is set
+    int features;          // UFS_INLINE_DATA when magic is set
 } super_t;
 
+#define UFS_VERSION(super) ((super)->magic == UFS_MAGIC ? (super)->version : 1)
+#define UFS_FEATURES(super) ((super)->magic == UFS_MAGIC ? (super)->features : 0)
+
 
 #endif // __ufs_h__
@@ -8,7 +8,10 @@
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-p] [-V <version>] [-I]\n");
+    fprintf(stderr, "  -p  preallocate the image instead of leaving it sparse\n");
+    fprintf(stderr, "  -V  format version, 1 (the default), 2 for indirect blocks or 3 for extents\n");
+    fprintf(stderr, "  -I  keep files of up to %d bytes inside their inode\n", UFS_INLINE_SIZE);
     exit(1);
 }
 
@@ -18,8 +21,11 @@ int main(int argc, char *argv[]) {
     int num_inodes = 32;
     int num_data = 32;
     int visual = 0;
+    int preallocate = 0;
+    int version = 1;
+    int inline_data = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:vpV:I")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -33,6 +39,15 @@ int main(int argc, char *argv[]) {
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'p':
+	    preallocate = 1;
+	    break;
+	case 'V':
+	    version = atoi(optarg);
+	    break;
+	case 'I':
+	    inline_data = 1;
+	    break;
 	default:
 	    usage();
 	}
@@ -40,16 +55,9 @@ int main(int argc, char *argv[]) {
     argc -= optind;
     argv += optind;
 
-    if (image_file == NULL)
+    if (image_file == NULL || version < 1 || version > 3)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
-
     int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
 	perror("open");
@@ -66,6 +74,11 @@ int main(int argc, char *argv[]) {
     s.num_inodes = num_inodes;
     s.num_data = num_data;
 
+    // version 1 images without features predate the magic and leave it zero
+    s.magic = version >= 2 || inline_data ? UFS_MAGIC : 0;
+    s.version = s.magic == UFS_MAGIC ? version : 0;
+    s.features = inline_data ? UFS_INLINE_DATA : 0;
+
     // inode bitmap
     int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
 
@@ -103,20 +116,29 @@ int main(int argc, char *argv[]) {
     printf("total blocks        %d\n", total_blocks);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
     printf("  data blocks       %d\n", num_data);
+    if (s.magic == UFS_MAGIC)
+	printf("  format version    %d\n", version);
+    if (inline_data)
+	printf("  inline data       up to %d bytes\n", UFS_INLINE_SIZE);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
 
-    // first, zero out all the blocks
+    // first, size the image: the file is empty, so every block past the
+    // super block is a hole that reads back as zeros
     int i;
-    for (i = 1; i < total_blocks; i++) {
-        rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-        if (rc != UFS_BLOCK_SIZE) {
-            perror("write");
-            exit(1);
-        }
+    off_t image_size = (off_t) total_blocks * UFS_BLOCK_SIZE;
+    if (ftruncate(fd, image_size) != 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+    if (preallocate) {
+	rc = posix_fallocate(fd, 0, image_size);
+	if (rc != 0) {
+	    fprintf(stderr, "posix_fallocate: %s\n", strerror(rc));
+	    exit(1);
+	}
     }
-    free(empty_buffer);
 
     //
     // need to allocate first inode in inode bitmap
@@ -149,6 +171,7 @@ int main(int argc, char *argv[]) {
     } inode_block;
 
     inode_block itable;
+    memset(&itable, 0, sizeof(itable));
     itable.inodes[0].type = UFS_DIRECTORY;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
     itable.inodes[0].direct[0] = s.data_region_addr;
@@ -169,6 +192,7 @@ int main(int argc, char *argv[]) {
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
     dir_block_t parent;
+    memset(&parent, 0, sizeof(parent));
     strcpy(parent.entries[0].name, ".");
     parent.entries[0].inum = 0;
 
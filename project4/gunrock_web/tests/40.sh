@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e
+
+cp tests/disk_images/a.img test.img
+
+# Clear inode 3's bit in the inode bitmap and mark data block 4 as in use
+printf '\x07' | dd of=test.img bs=1 seek=4096 conv=notrunc status=none
+printf '\x1f' | dd of=test.img bs=1 seek=8192 conv=notrunc status=none
+
+./ds3fsck test.img || echo "ds3fsck exited with $?"
+./ds3fsck -r test.img || echo "ds3fsck exited with $?"
+./ds3fsck test.img
+./ds3bits test.img
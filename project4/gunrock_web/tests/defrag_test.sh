@@ -0,0 +1,70 @@
+#!/bin/bash
+set -e
+
+# Formats test.img with the mkfs flags given and fragments two files by
+# appending to them in turn through the server, with a directory that
+# has lost most of its entries. ds3defrag and POST ?defrag=1 must keep
+# every file's contents and leave a consistent image.
+./mkfs -f test.img -d 256 -i 256 "$@" > /dev/null
+
+server=
+trap "kill \$server 2> /dev/null || true; rm -f test.a test.b test.chunk" EXIT
+startServer() {
+  ./gunrock_web -p 8090 -i test.img > /dev/null 2>&1 &
+  server=$!
+  for attempt in $(seq 1 50); do
+    curl -s -o /dev/null http://localhost:8090/ds3/ && break
+    sleep 0.1
+  done
+}
+stopServer() {
+  kill $server
+  wait $server || true
+}
+request() {
+  curl -s -o /dev/null -w "%{http_code}" "$@" | grep -v 200 || true
+}
+append() {
+  for round in $(seq $1 $2); do
+    seq $((round * 1000)) $((round * 1000 + 999)) > test.chunk
+    request -X POST --data-binary @test.chunk http://localhost:8090/ds3/a.txt
+    cat test.chunk >> test.a
+    rev test.chunk > test.chunk.b
+    mv test.chunk.b test.chunk
+    request -X POST --data-binary @test.chunk http://localhost:8090/ds3/b.txt
+    cat test.chunk >> test.b
+  done
+}
+check() {
+  curl -s http://localhost:8090/ds3/a.txt | cmp - test.a && echo "a.txt matches"
+  curl -s http://localhost:8090/ds3/b.txt | cmp - test.b && echo "b.txt matches"
+}
+
+: > test.a
+: > test.b
+startServer
+append 1 6
+for idx in $(seq 1 140); do
+  request -X PUT --data-binary "$idx" http://localhost:8090/ds3/d/$idx.txt
+done
+for idx in $(seq 1 130); do
+  request -X DELETE http://localhost:8090/ds3/d/$idx.txt
+done
+stopServer
+
+./ds3frag test.img
+./ds3defrag test.img
+./ds3frag test.img
+./ds3ls test.img /
+./ds3ls test.img /d
+./ds3fsck test.img
+./ds3bits test.img
+
+# The server defragments online too
+startServer
+check
+append 7 10
+curl -s -X POST "http://localhost:8090/ds3/?defrag=1"
+check
+stopServer
+./ds3fsck test.img
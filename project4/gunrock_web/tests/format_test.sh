@@ -0,0 +1,20 @@
+#!/bin/bash
+set -e
+
+# Formats test.img with the mkfs flags given, imports a small tree with a
+# file large enough to need indirect blocks or extents, and checks it.
+./mkfs -f test.img -d 256 -i 64 "$@" > /dev/null
+
+rm -rf test.dir
+mkdir -p test.dir/docs
+cp tests/6kwords.txt test.dir/docs/
+seq 1 40000 > test.dir/numbers.txt
+echo "a short note" > test.dir/note.txt
+
+./ds3import test.img test.dir 0
+rm -rf test.dir
+
+./ds3ls test.img /
+./ds3ls test.img /docs
+./ds3fsck test.img
+./ds3bits --summary test.img
@@ -0,0 +1,62 @@
+#!/bin/bash
+set -e
+
+# Formats test.img with the mkfs flags given, serves it and checks
+# appends, writes at an offset, truncation and ranged reads, including
+# files that move between their inode and data blocks with -I.
+./mkfs -f test.img -d 256 -i 64 "$@" > /dev/null
+
+./gunrock_web -p 8089 -i test.img > /dev/null 2>&1 &
+server=$!
+trap "kill $server 2> /dev/null || true; rm -f test.expected" EXIT
+for attempt in $(seq 1 50); do
+  curl -s -o /dev/null http://localhost:8089/ds3/ && break
+  sleep 0.1
+done
+
+url=http://localhost:8089/ds3/a/f.txt
+request() {
+  curl -s -o /dev/null -w "%{http_code}\n" "$@"
+}
+freeBlocks() {
+  curl -s "http://localhost:8089/ds3/?stats=1" | grep "free data blocks"
+}
+
+# Small writes, appends and overwrites
+request -X PUT --data-binary "hello" $url
+request -X POST --data-binary " world" $url
+request -X POST --data-binary "J" "$url?offset=0"
+curl -s $url; echo
+curl -s "$url?offset=6&length=5"; echo
+curl -s "$url?offset=6&length=2147479552"; echo
+curl -s "$url?offset=100&length=10"; echo
+freeBlocks
+
+# Growing a file zero-fills it and shrinking it drops the tail
+request -X POST "$url?truncate=200"
+curl -s $url | wc -c
+curl -s "$url?offset=11" | tr -d '\0' | wc -c
+freeBlocks
+request -X POST "$url?truncate=5"
+curl -s $url; echo
+freeBlocks
+
+# A file whose last block is partly used
+seq 1 2000 > test.expected
+request -X PUT --data-binary @test.expected $url
+seq 2001 2100 > test.dir
+cat test.dir >> test.expected
+request -X POST --data-binary @test.dir $url
+rm -f test.dir
+curl -s $url | cmp - test.expected && echo "contents match"
+curl -s "$url?offset=4090&length=20"; echo
+
+# Writing past the end leaves a zero-filled gap
+request -X POST --data-binary "end" "$url?offset=12000"
+curl -s $url | wc -c
+curl -s "$url?offset=9393&length=2607" | tr -d '\0' | wc -c
+curl -s "$url?offset=12000"; echo
+
+kill $server
+wait $server || true
+./ds3fsck test.img